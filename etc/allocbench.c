@@ -0,0 +1,98 @@
+/*
+* allocbench.c -- compare the slab allocator with the C library allocator
+* runs string- and table-heavy scripts in states created by luaL_newstate
+* and luaL_newslabstate and reports the time taken by each, then the time
+* taken by lua_close on a large heap. The last column runs the scripts in
+* a state from luaL_newstate with the allocation sampler on at its default
+* rate (256 KB), to compare with the first one.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+static const char *const workloads[][2] = {
+ {"strings",
+  "local t = {}\n"
+  "for i = 1, 200000 do\n"
+  "  local s = 'key' .. i\n"
+  "  t[i % 1000 + 1] = s .. string.rep('x', i % 40)\n"
+  "end\n"},
+ {"tables",
+  "local t = {}\n"
+  "for i = 1, 200000 do\n"
+  "  t[i % 5000 + 1] = {x = i, y = i * 2, {i}, name = 'p'}\n"
+  "end\n"},
+ {"closures",
+  "local t = {}\n"
+  "for i = 1, 200000 do\n"
+  "  local v = i\n"
+  "  t[i % 2000 + 1] = function() return v end\n"
+  "end\n"},
+ {NULL, NULL}
+};
+
+static double run(lua_State *L, const char *code, int reps)
+{
+ clock_t start;
+ int i;
+ if (L==NULL) return -1;
+ luaL_openlibs(L);
+ start=clock();
+ for (i=0; i<reps; i++)
+ {
+  if (luaL_dostring(L,code)!=0)
+  {
+   fprintf(stderr,"%s\n",lua_tostring(L,-1));
+   break;
+  }
+ }
+ lua_close(L);
+ return (double)(clock()-start)/CLOCKS_PER_SEC;
+}
+
+static lua_State *sampled(void)
+{
+ lua_State *L=luaL_newstate();
+ if (L!=NULL) lua_setallocsampler(L,256*1024);
+ return L;
+}
+
+static const char heap[]=
+ "big = {}\n"
+ "for i = 1, 1000000 do big[i] = {tostring(i)} end\n";
+
+static double closetime(lua_State *L)
+{
+ clock_t start;
+ if (L==NULL) return -1;
+ luaL_openlibs(L);
+ if (luaL_dostring(L,heap)!=0) fprintf(stderr,"%s\n",lua_tostring(L,-1));
+ start=clock();
+ lua_close(L);
+ return (double)(clock()-start)/CLOCKS_PER_SEC;
+}
+
+int main(int argc, char *argv[])
+{
+ int i;
+ int reps=(argc>1) ? atoi(argv[1]) : 5;
+ printf("%-10s %10s %10s %10s\n","workload","malloc","slab","sampled");
+ for (i=0; workloads[i][0]!=NULL; i++)
+ {
+  double m=run(luaL_newstate(),workloads[i][1],reps);
+  double s=run(luaL_newslabstate(),workloads[i][1],reps);
+  double p=run(sampled(),workloads[i][1],reps);
+  printf("%-10s %9.3fs %9.3fs %9.3fs\n",workloads[i][0],m,s,p);
+ }
+ {
+  double m=closetime(luaL_newstate());
+  double s=closetime(luaL_newslabstate());
+  printf("%-10s %9.3fs %9.3fs\n","lua_close",m,s);
+ }
+ return 0;
+}
@@ -0,0 +1,103 @@
+/*
+* closbench.c -- measure closure creation
+* creates closures in loops, once as written (the upvalues are captured
+* by value) and once with a dead assignment to the captured locals that
+* makes them upvalues shared by reference, and reports the best of a few
+* runs of each and the speedup.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define RUNS	5
+
+/* '%s' marks where the assignment that defeats capture by value goes */
+static const char *const workloads[][2] = {
+ {"loopvar",
+  "local N, t = 2000000, {}\n"
+  "for i = 1, N do\n"
+  "  local v = i\n"
+  "  %s\n"
+  "  t[i % 100 + 1] = function() return v end\n"
+  "end\n"
+  "assert(t[1]() == N)\n"},
+ {"callback",
+  "local N, s = 1000000, 0\n"
+  "local function each(t, f) for i = 1, #t do f(t[i]) end end\n"
+  "local t = {1, 2, 3}\n"
+  "for i = 1, N do\n"
+  "  local k = i % 3\n"
+  "  %s\n"
+  "  each(t, function(x) s = s + x * k end)\n"
+  "end\n"},
+ {"nested",
+  "local N, t = 1000000, {}\n"
+  "for i = 1, N do\n"
+  "  local a, b = i, i + 1\n"
+  "  %s\n"
+  "  t[i % 100 + 1] = function() return function() return a + b end end\n"
+  "end\n"
+  "assert(t[1]()() == 2 * N + 1)\n"},
+ {NULL, NULL}
+};
+
+static const char *const spoilers[] = {
+ "if N < 0 then v = nil end",
+ "if N < 0 then k = nil end",
+ "if N < 0 then a, b = nil end",
+};
+
+static double now(void)
+{
+ struct timespec ts;
+ timespec_get(&ts,TIME_UTC);
+ return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static double run(const char *code)
+{
+ double best=-1;
+ int i;
+ for (i=0; i<RUNS; i++)
+ {
+  lua_State *L=luaL_newstate();
+  double start;
+  if (L==NULL) return -1;
+  luaL_openlibs(L);
+  if (luaL_loadstring(L,code)!=0)
+  {
+   fprintf(stderr,"%s\n",lua_tostring(L,-1));
+   lua_close(L);
+   return -1;
+  }
+  start=now();
+  if (lua_pcall(L,0,0,0)!=0) fprintf(stderr,"%s\n",lua_tostring(L,-1));
+  start=now()-start;
+  if (best<0 || start<best) best=start;
+  lua_close(L);
+ }
+ return best;
+}
+
+int main(void)
+{
+ char code[1024];
+ int i;
+ printf("%-10s %10s %10s %8s\n","workload","reference","value","speedup");
+ for (i=0; workloads[i][0]!=NULL; i++)
+ {
+  double ref,val;
+  sprintf(code,workloads[i][1],spoilers[i]);
+  ref=run(code);
+  sprintf(code,workloads[i][1],"");
+  val=run(code);
+  printf("%-10s %9.3fs %9.3fs %7.2fx\n",workloads[i][0],ref,val,(val>0) ? ref/val : 0);
+ }
+ return 0;
+}
@@ -0,0 +1,69 @@
+/*
+* corobench.c -- measure the cost of short-lived coroutines
+* runs create/resume/finish cycles with the thread pool disabled and
+* enabled (see LUA_GCTHREADPOOL) and reports cycles per second for each.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+static const char *const workloads[][2] = {
+ {"finish",
+  "local create, resume = coroutine.create, coroutine.resume\n"
+  "local f = function(a) return a end\n"
+  "for i = 1, 200000 do resume(create(f), i) end\n"},
+ {"yield",
+  "local create, resume, yield = coroutine.create, coroutine.resume, coroutine.yield\n"
+  "local f = function(a) yield(a) return a end\n"
+  "for i = 1, 200000 do local co = create(f) resume(co, i) resume(co) end\n"},
+ {"wrap",
+  "local wrap = coroutine.wrap\n"
+  "local f = function(a) return a + 1 end\n"
+  "for i = 1, 200000 do wrap(f)(i) end\n"},
+ {NULL, NULL}
+};
+
+#define CYCLES	200000
+
+static double run(const char *code, int pool, int reps)
+{
+ lua_State *L=luaL_newstate();
+ clock_t start;
+ double t;
+ int i;
+ if (L==NULL) return -1;
+ luaL_openlibs(L);
+ lua_gc(L,LUA_GCTHREADPOOL,pool);
+ start=clock();
+ for (i=0; i<reps; i++)
+ {
+  if (luaL_dostring(L,code)!=0)
+  {
+   fprintf(stderr,"%s\n",lua_tostring(L,-1));
+   break;
+  }
+ }
+ t=(double)(clock()-start)/CLOCKS_PER_SEC;
+ lua_close(L);
+ return (t>0) ? (double)CYCLES*reps/t : 0;
+}
+
+int main(int argc, char *argv[])
+{
+ int i;
+ int reps=(argc>1) ? atoi(argv[1]) : 5;
+ int pool=(argc>2) ? atoi(argv[2]) : 32;
+ printf("%-10s %14s %14s\n","workload","no pool","pool");
+ for (i=0; workloads[i][0]!=NULL; i++)
+ {
+  double n=run(workloads[i][1],0,reps);
+  double p=run(workloads[i][1],pool,reps);
+  printf("%-10s %12.0f/s %12.0f/s\n",workloads[i][0],n,p);
+ }
+ return 0;
+}
@@ -0,0 +1,110 @@
+/*
+* dumpbench.c -- measure precompiled chunks
+* dumps a generated program with many functions, with and without debug
+* information, and reports the size of each chunk and the best time of
+* a few runs of dumping and loading it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define RUNS	10
+#define NFUNCS	2000
+
+static const char *const func =
+ "function M.f%d(a, b, t)\n"
+ "  local s = 0\n"
+ "  for i = 1, #t do\n"
+ "    if t[i] == 'x' then s = s + a elseif t[i] == 'y' then s = s - b\n"
+ "    elseif t[i] == 'z' then s = s * 2 else s = s / 2 end\n"
+ "  end\n"
+ "  local r = {name = 'f%d', value = s, list = {1, 2, 3, 4}}\n"
+ "  return function() return r, s + a end\n"
+ "end\n";
+
+static double now(void)
+{
+ struct timespec ts;
+ timespec_get(&ts,TIME_UTC);
+ return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static int writer(lua_State *L, const void *p, size_t size, void *ud)
+{
+ (void)L;
+ luaL_addlstring((luaL_Buffer *)ud,(const char *)p,size);
+ return 0;
+}
+
+static void run(lua_State *L, int strip)
+{
+ luaL_Buffer b;
+ const char *chunk;
+ size_t size;
+ double dump=-1,load=-1;
+ int i;
+ for (i=0; i<RUNS; i++)
+ {
+  double start=now();
+  lua_pushvalue(L,1);
+  luaL_buffinit(L,&b);
+  lua_dump53(L,writer,&b,strip);
+  luaL_pushresult(&b);
+  lua_remove(L,-2);
+  start=now()-start;
+  if (dump<0 || start<dump) dump=start;
+  if (i<RUNS-1) lua_pop(L,1);
+ }
+ chunk=lua_tolstring(L,-1,&size);
+ for (i=0; i<RUNS; i++)
+ {
+  double start=now();
+  if (luaL_loadbufferx(L,chunk,size,"=big","b")!=0)
+  {
+   fprintf(stderr,"%s\n",lua_tostring(L,-1));
+   exit(EXIT_FAILURE);
+  }
+  start=now()-start;
+  if (load<0 || start<load) load=start;
+  lua_pop(L,1);
+  lua_gc(L,LUA_GCCOLLECT,0);
+ }
+ lua_pop(L,1);
+ printf("%-9s %8luKB %9.4fs %9.4fs\n",strip ? "stripped" : "full",
+        (unsigned long)(size/1024),dump,load);
+}
+
+int main(void)
+{
+ luaL_Buffer b;
+ lua_State *L=luaL_newstate();
+ int i;
+ if (L==NULL) return EXIT_FAILURE;
+ luaL_openlibs(L);
+ luaL_buffinit(L,&b);
+ luaL_addstring(&b,"local M = {}\n");
+ for (i=1; i<=NFUNCS; i++)
+ {
+  lua_pushfstring(L,func,i,i);
+  luaL_addvalue(&b);
+ }
+ luaL_addstring(&b,"return M\n");
+ luaL_pushresult(&b);
+ if (luaL_loadbufferx(L,lua_tostring(L,-1),lua_rawlen(L,-1),"=big","t")!=0)
+ {
+  fprintf(stderr,"%s\n",lua_tostring(L,-1));
+  return EXIT_FAILURE;
+ }
+ lua_replace(L,1);
+ printf("%-9s %10s %10s %10s\n","chunk","size","dump","load");
+ run(L,0);
+ run(L,1);
+ lua_close(L);
+ return 0;
+}
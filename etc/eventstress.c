@@ -0,0 +1,148 @@
+/*
+* eventstress.c -- stress the event queue with many producers
+* runs 1, 2, 4, ... producer threads posting numbered events with
+* lua_postevent while the main thread drains them in batches of varying
+* size, and checks that every event arrives once, in the order its
+* producer posted it, and that lua_pendingevents agrees with the drains.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define EVENTS		100000	/* per producer */
+#define MAXPRODUCERS	64
+
+typedef struct Producer {
+ pthread_t thread;
+ lua_State *L;
+ int id;
+} Producer;
+
+static double now(void)
+{
+ struct timespec ts;
+ timespec_get(&ts,TIME_UTC);
+ return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void fail(const char *what, int producers)
+{
+ fprintf(stderr,"eventstress: %s (%d producers)\n",what,producers);
+ exit(EXIT_FAILURE);
+}
+
+/* each event is: producer id, sequence number, and every 8th one a string */
+static void *produce(void *arg)
+{
+ Producer *p=(Producer*)arg;
+ char buff[32];
+ int i;
+ for (i=1; i<=EVENTS; i++)
+ {
+  lua_Event *ev=lua_newevent();
+  if (ev==NULL) fail("out of memory",0);
+  lua_eventnumber(ev,p->id);
+  lua_eventnumber(ev,i);
+  if (i%8==0)
+  {
+   sprintf(buff,"%d:%d",p->id,i);
+   lua_eventstring(ev,buff,strlen(buff));
+  }
+  if (!lua_postevent(p->L,ev)) fail("event not posted",0);
+ }
+ return NULL;
+}
+
+/* checks the events on the top of the stack; returns how many there are */
+static int check(lua_State *L, int *last, int producers)
+{
+ int i,n=(int)lua_rawlen(L,-1);
+ char buff[32];
+ for (i=1; i<=n; i++)
+ {
+  int id,seq,nv;
+  lua_rawgeti(L,-1,i);
+  lua_getfield(L,-1,"n");
+  nv=lua_tointeger(L,-1);
+  lua_rawgeti(L,-2,1);
+  lua_rawgeti(L,-3,2);
+  id=lua_tointeger(L,-2);
+  seq=lua_tointeger(L,-1);
+  if (id<0 || id>=producers) fail("bad producer id",producers);
+  if (seq!=last[id]+1) fail("events of a producer out of order",producers);
+  last[id]=seq;
+  if (nv!=((seq%8==0) ? 3 : 2)) fail("bad number of values",producers);
+  if (nv==3)
+  {
+   lua_rawgeti(L,-4,3);
+   sprintf(buff,"%d:%d",id,seq);
+   if (strcmp(lua_tostring(L,-1),buff)!=0) fail("bad string value",producers);
+   lua_pop(L,1);
+  }
+  lua_pop(L,4);
+ }
+ return n;
+}
+
+static double run(int producers)
+{
+ Producer p[MAXPRODUCERS];
+ int last[MAXPRODUCERS];
+ lua_State *L=luaL_newstate();
+ int total=producers*EVENTS,received=0,batch=0;
+ double start;
+ int i;
+ if (L==NULL) fail("cannot create state",producers);
+ luaL_openlibs(L);
+ memset(last,0,sizeof(last));
+ start=now();
+ for (i=0; i<producers; i++)
+ {
+  p[i].L=L;
+  p[i].id=i;
+  if (pthread_create(&p[i].thread,NULL,produce,&p[i])!=0)
+   fail("cannot create thread",producers);
+ }
+ while (received<total)
+ {
+  int max=(batch++%4==0) ? -1 : 1+batch%256;	/* sometimes all of them */
+  int n=lua_drainevents(L,max);
+  if (n<0 || (max>=0 && n>max)) fail("bad number of events drained",producers);
+  if (check(L,last,producers)!=n) fail("drain result disagrees with its sequence",producers);
+  lua_pop(L,1);
+  received+=n;
+  n=lua_pendingevents(L);
+  if (n<0 || n>total-received) fail("bad pending count",producers);
+  if (batch%64==0) lua_gc(L,LUA_GCSTEP,0);
+ }
+ for (i=0; i<producers; i++) pthread_join(p[i].thread,NULL);
+ start=now()-start;
+ for (i=0; i<producers; i++)
+  if (last[i]!=EVENTS) fail("events lost",producers);
+ if (lua_pendingevents(L)!=0) fail("pending count not back to 0",producers);
+ if (lua_drainevents(L,-1)!=0) fail("events left after all were received",producers);
+ lua_close(L);
+ return start;
+}
+
+int main(int argc, char *argv[])
+{
+ int n;
+ int max=(argc>1) ? atoi(argv[1]) : 8;
+ if (max>MAXPRODUCERS) max=MAXPRODUCERS;
+ printf("%-10s %10s %10s %14s\n","producers","events","time","events/s");
+ for (n=1; n<=max; n*=2)
+ {
+  double t=run(n);
+  printf("%-10d %10d %9.3fs %14.0f\n",n,n*EVENTS,t,(t>0) ? n*EVENTS/t : 0);
+ }
+ printf("ok\n");
+ return 0;
+}
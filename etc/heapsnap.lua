@@ -0,0 +1,234 @@
+--
+-- heapsnap.lua
+-- analyzes heap snapshots written by lua_heapsnapshot (debug.heapsnapshot)
+--
+--   lua heapsnap.lua top  snapshot [n]     objects retaining most memory
+--   lua heapsnap.lua diff old new [n]      paths whose retained size grew
+--
+-- The retained size of an object is the memory that would be freed if
+-- the object were released: its own size plus the sizes of all objects
+-- it dominates (those reachable from the roots only through it).
+-- Objects are named by their shortest path from the roots, which is
+-- stable between snapshots, so 'diff' compares retained sizes by path.
+--
+
+local function load (fname)
+  local f = assert(io.open(fname, "rb"))
+  local header = f:read("*l")
+  if header ~= "luaheap 1" then
+    error(fname .. ": not a heap snapshot", 0)
+  end
+  local nodes = {root = {type = "root", size = 0, info = "-"}}
+  local succ, label = {root = {}}, {root = {}}
+  for line in f:lines() do
+    local kind = line:sub(1, 1)
+    if kind == "n" then
+      local id, type, size, info = line:match("^n (%S+) (%S+) (%d+) (.*)$")
+      nodes[id] = {type = type, size = tonumber(size), info = info}
+      succ[id] = succ[id] or {}
+      label[id] = label[id] or {}
+    elseif kind == "e" then
+      local from, to, l = line:match("^e (%S+) (%S+) (.*)$")
+      local s = succ[from]
+      if not s then
+        s = {}; succ[from] = s; label[from] = {}
+      end
+      s[#s + 1] = to
+      label[from][#s] = l
+    end
+  end
+  f:close()
+  for id, s in pairs(succ) do  -- objects referenced but not described
+    for _, to in ipairs(s) do
+      if not nodes[to] then
+        nodes[to] = {type = "?", size = 0, info = "-"}
+      end
+    end
+  end
+  return {nodes = nodes, succ = succ, label = label}
+end
+
+
+-- breadth-first walk from the roots, giving each object its shortest path
+local function names (snap)
+  local parent, via = {}, {}
+  local queue, head = {"root"}, 1
+  parent.root = false
+  while queue[head] do
+    local id = queue[head]; head = head + 1
+    local s, l = snap.succ[id] or {}, snap.label[id] or {}
+    for i, to in ipairs(s) do
+      if parent[to] == nil then
+        parent[to] = id
+        via[to] = l[i]
+        queue[#queue + 1] = to
+      end
+    end
+  end
+  local cache = {root = ""}
+  local function path (id)
+    local p = cache[id]
+    if p then return p end
+    local lbl = via[id]
+    local pp = path(parent[id])
+    if pp == "" then p = lbl
+    elseif lbl:sub(1, 1) == "[" then p = pp .. lbl
+    else p = pp .. "." .. lbl
+    end
+    p = p:gsub("^registry%.globals", "_G")
+    cache[id] = p
+    return p
+  end
+  return path, parent
+end
+
+
+-- dominator tree (Cooper, Harvey and Kennedy) and retained sizes
+local function retained (snap)
+  local succ, order, rpo = snap.succ, {}, {}
+  -- iterative depth-first search, numbering objects in postorder
+  local visited, stack = {root = true}, {{"root", 1}}
+  while #stack > 0 do
+    local top = stack[#stack]
+    local s = succ[top[1]] or {}
+    local to = s[top[2]]
+    top[2] = top[2] + 1
+    if to == nil then
+      order[#order + 1] = top[1]
+      rpo[top[1]] = #order
+      stack[#stack] = nil
+    elseif not visited[to] then
+      visited[to] = true
+      stack[#stack + 1] = {to, 1}
+    end
+  end
+  local preds = {}
+  for _, id in ipairs(order) do
+    for _, to in ipairs(succ[id] or {}) do
+      local p = preds[to]
+      if not p then p = {}; preds[to] = p end
+      p[#p + 1] = id
+    end
+  end
+  local idom = {root = "root"}
+  local function intersect (a, b)
+    while a ~= b do
+      while rpo[a] < rpo[b] do a = idom[a] end
+      while rpo[b] < rpo[a] do b = idom[b] end
+    end
+    return a
+  end
+  local changed = true
+  while changed do
+    changed = false
+    for i = #order - 1, 1, -1 do  -- reverse postorder, skipping root
+      local id = order[i]
+      local new
+      for _, p in ipairs(preds[id]) do
+        if idom[p] then
+          new = new and intersect(p, new) or p
+        end
+      end
+      if idom[id] ~= new then
+        idom[id] = new
+        changed = true
+      end
+    end
+  end
+  local size = {}
+  for _, id in ipairs(order) do size[id] = snap.nodes[id].size end
+  for _, id in ipairs(order) do  -- children come before their dominators
+    if id ~= "root" then
+      size[idom[id]] = size[idom[id]] + size[id]
+    end
+  end
+  return size, order
+end
+
+
+local function bytype (snap)
+  local count, bytes = {}, {}
+  for _, n in pairs(snap.nodes) do
+    count[n.type] = (count[n.type] or 0) + 1
+    bytes[n.type] = (bytes[n.type] or 0) + n.size
+  end
+  return count, bytes
+end
+
+
+local function top (fname, n)
+  local snap = load(fname)
+  local size, order = retained(snap)
+  local path = names(snap)
+  local count, bytes = bytype(snap)
+  print(string.format("%-14s %10s %12s", "type", "count", "bytes"))
+  for t, c in pairs(count) do
+    print(string.format("%-14s %10d %12d", t, c, bytes[t]))
+  end
+  print()
+  table.sort(order, function (a, b) return size[a] > size[b] end)
+  print(string.format("%12s %10s %-12s %s", "retained", "self", "type", "path"))
+  local shown = 0
+  for _, id in ipairs(order) do
+    if shown >= n then break end
+    if id ~= "root" then
+      local node = snap.nodes[id]
+      print(string.format("%12d %10d %-12s %s  (%s)", size[id], node.size,
+                          node.type, path(id), node.info))
+      shown = shown + 1
+    end
+  end
+end
+
+
+local function bypath (fname)
+  local snap = load(fname)
+  local size, order = retained(snap)
+  local path = names(snap)
+  local t = {}
+  for _, id in ipairs(order) do
+    if id ~= "root" then
+      local p = path(id)
+      t[p] = (t[p] or 0) + size[id]
+    end
+  end
+  return t, snap
+end
+
+
+local function diff (old, new, n)
+  local a, sa = bypath(old)
+  local b, sb = bypath(new)
+  local ca, ba = bytype(sa)
+  local cb, bb = bytype(sb)
+  print(string.format("%-14s %10s %12s", "type", "+count", "+bytes"))
+  for t in pairs(cb) do
+    local dc, db = cb[t] - (ca[t] or 0), bb[t] - (ba[t] or 0)
+    if dc ~= 0 or db ~= 0 then
+      print(string.format("%-14s %+10d %+12d", t, dc, db))
+    end
+  end
+  print()
+  local growth = {}
+  for p, s in pairs(b) do
+    local d = s - (a[p] or 0)
+    if d > 0 then growth[#growth + 1] = {p, d} end
+  end
+  table.sort(growth, function (x, y) return x[2] > y[2] end)
+  print(string.format("%12s %s", "+retained", "path"))
+  for i = 1, math.min(n, #growth) do
+    print(string.format("%+12d %s", growth[i][2], growth[i][1]))
+  end
+end
+
+
+local cmd = arg[1]
+if cmd == "top" and arg[2] then
+  top(arg[2], tonumber(arg[3]) or 20)
+elseif cmd == "diff" and arg[3] then
+  diff(arg[2], arg[3], tonumber(arg[4]) or 20)
+else
+  io.stderr:write("usage: lua heapsnap.lua top snapshot [n]\n",
+                  "       lua heapsnap.lua diff old new [n]\n")
+  os.exit(1)
+end
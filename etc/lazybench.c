@@ -0,0 +1,86 @@
+/*
+* lazybench.c -- measure lazy loads
+* loads a generated program with many functions, of which it calls a
+* few, as a plain text chunk and as a lazy one (load mode "tL"), and
+* reports the best load time of a few runs of each and the memory the
+* loaded program keeps.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define RUNS	10
+#define NFUNCS	2000
+
+static const char *const func =
+ "function M.f%d(a, b, t)\n"
+ "  local s = 0\n"
+ "  for i = 1, #t do\n"
+ "    if t[i] == 'x' then s = s + a elseif t[i] == 'y' then s = s - b\n"
+ "    elseif t[i] == 'z' then s = s * 2 else s = s / 2 end\n"
+ "  end\n"
+ "  local r = {name = 'f%d', value = s, list = {1, 2, 3, 4}}\n"
+ "  return function() return r, s + a end\n"
+ "end\n";
+
+static double now(void)
+{
+ struct timespec ts;
+ timespec_get(&ts,TIME_UTC);
+ return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void run(lua_State *L, const char *code, const char *mode)
+{
+ double best=-1;
+ int i,kb=0;
+ for (i=0; i<RUNS; i++)
+ {
+  double start=now();
+  if (luaL_loadbufferx(L,code,strlen(code),"=big",mode)!=0 ||
+      lua_pcall(L,0,1,0)!=0)
+  {
+   fprintf(stderr,"%s\n",lua_tostring(L,-1));
+   exit(EXIT_FAILURE);
+  }
+  start=now()-start;
+  if (best<0 || start<best) best=start;
+  lua_setglobal(L,"M");
+  lua_gc(L,LUA_GCCOLLECT,0);
+  kb=lua_gc(L,LUA_GCCOUNT,0);
+ }
+ luaL_dostring(L,"for i = 1, 10 do M['f' .. i](1, 2, {'x', 'y'})() end");
+ printf("%-6s %9.4fs %8dKB\n",mode,best,kb);
+ lua_pushnil(L);
+ lua_setglobal(L,"M");
+ lua_gc(L,LUA_GCCOLLECT,0);
+}
+
+int main(void)
+{
+ luaL_Buffer b;
+ lua_State *L=luaL_newstate();
+ int i;
+ if (L==NULL) return EXIT_FAILURE;
+ luaL_openlibs(L);
+ luaL_buffinit(L,&b);
+ luaL_addstring(&b,"local M = {}\n");
+ for (i=1; i<=NFUNCS; i++)
+ {
+  lua_pushfstring(L,func,i,i);
+  luaL_addvalue(&b);
+ }
+ luaL_addstring(&b,"return M\n");
+ luaL_pushresult(&b);
+ printf("%-6s %10s %10s\n","mode","load","resident");
+ run(L,lua_tostring(L,-1),"t");
+ run(L,lua_tostring(L,-1),"tL");
+ lua_close(L);
+ return 0;
+}
@@ -0,0 +1,120 @@
+/*
+* optbench.c -- measure the bytecode optimizer
+* runs a few workloads loaded as plain text chunks and as optimized ones
+* (load mode "tO", as luac -O does) and reports the best of a few runs
+* of each and the speedup.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define RUNS	5
+
+static const char *const workloads[][2] = {
+ {"mathloop",
+  "local N = 3000000\n"
+  "local s = 0\n"
+  "for i = 1, N do s = s + math.sin(i) * math.cos(i) end\n"
+  "return s\n"},
+ {"sieve",
+  "local N = 2000000\n"
+  "local composite, count = {}, 0\n"
+  "for i = 2, N do\n"
+  "  if not composite[i] then\n"
+  "    count = count + 1\n"
+  "    for m = i * i, N, i do composite[m] = true end\n"
+  "  end\n"
+  "end\n"
+  "assert(count == 148933)\n"},
+ {"strings",
+  "local t = {}\n"
+  "for i = 1, 300000 do\n"
+  "  local s = string.format('%d', i)\n"
+  "  t[#t + 1] = string.len(s) + tonumber(s) % 7\n"
+  "end\n"
+  "return #t\n"},
+ {"life",
+  "local w, h = 64, 64\n"
+  "local cells, next = {}, {}\n"
+  "for i = 1, w * h do cells[i] = (i * 7) % 5 < 2 and 1 or 0; next[i] = 0 end\n"
+  "for gen = 1, 60 do\n"
+  "  for y = 0, h - 1 do\n"
+  "    local ym, yp = (y - 1) % h * w, (y + 1) % h * w\n"
+  "    for x = 1, w do\n"
+  "      local xm, xp = (x - 2) % w + 1, x % w + 1\n"
+  "      local yw = y * w\n"
+  "      local sum = cells[ym + xm] + cells[ym + x] + cells[ym + xp] +\n"
+  "                  cells[yw + xm] + cells[yw + xp] +\n"
+  "                  cells[yp + xm] + cells[yp + x] + cells[yp + xp]\n"
+  "      next[yw + x] = (sum == 3 or (sum == 2 and cells[yw + x] == 1)) and 1 or 0\n"
+  "    end\n"
+  "  end\n"
+  "  cells, next = next, cells\n"
+  "end\n"},
+ {"helpers",
+  "local w = 64\n"
+  "local function idx(x, y) return y * w + x end\n"
+  "local function clamp(x, a, b)\n"
+  "  if x < a then return a elseif x > b then return b end\n"
+  "  return x\n"
+  "end\n"
+  "local s = 0\n"
+  "for n = 1, 30 do\n"
+  "  for y = 0, 255 do\n"
+  "    for x = 0, 255 do s = s + clamp(idx(x, y), 100, 10000) end\n"
+  "  end\n"
+  "end\n"
+  "assert(s == 13774717080)\n"},
+ {NULL, NULL}
+};
+
+static double now(void)
+{
+ struct timespec ts;
+ timespec_get(&ts,TIME_UTC);
+ return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static double run(const char *code, const char *mode)
+{
+ double best=-1;
+ int i;
+ for (i=0; i<RUNS; i++)
+ {
+  lua_State *L=luaL_newstate();
+  double start;
+  if (L==NULL) return -1;
+  luaL_openlibs(L);
+  if (luaL_loadbufferx(L,code,strlen(code),"=workload",mode)!=0)
+  {
+   fprintf(stderr,"%s\n",lua_tostring(L,-1));
+   lua_close(L);
+   return -1;
+  }
+  start=now();
+  if (lua_pcall(L,0,0,0)!=0) fprintf(stderr,"%s\n",lua_tostring(L,-1));
+  start=now()-start;
+  if (best<0 || start<best) best=start;
+  lua_close(L);
+ }
+ return best;
+}
+
+int main(void)
+{
+ int i;
+ printf("%-10s %10s %10s %8s\n","workload","plain","optimized","speedup");
+ for (i=0; workloads[i][0]!=NULL; i++)
+ {
+  double plain=run(workloads[i][1],"t");
+  double opt=run(workloads[i][1],"tO");
+  printf("%-10s %9.3fs %9.3fs %7.2fx\n",workloads[i][0],plain,opt,(opt>0) ? plain/opt : 0);
+ }
+ return 0;
+}
@@ -0,0 +1,104 @@
+/*
+* workbench.c -- measure how the work library scales with the number of workers
+* runs a sieve (as in test/sieve.lua) and a game of life (as in test/life.lua)
+* split into independent pieces with pool:map on pools of 1, 2, 4, ... workers
+* and reports the wall-clock time and speedup of each.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+static const char *const workloads[][2] = {
+ {"sieve",
+  "local work, n = require 'work', ...\n"
+  "local pool = work.pool(n)\n"
+  "local function count(r)\n"
+  "  local lo, hi, c = r[1], r[2], 0\n"
+  "  local composite = {}\n"
+  "  for p = 2, math.floor(math.sqrt(hi)) do\n"
+  "    for m = math.max(p * p, math.ceil(lo / p) * p), hi, p do composite[m - lo] = true end\n"
+  "  end\n"
+  "  for i = math.max(lo, 2), hi do if not composite[i - lo] then c = c + 1 end end\n"
+  "  return c\n"
+  "end\n"
+  "local ranges = {}\n"
+  "for i = 0, 63 do ranges[#ranges + 1] = {i * 50000, i * 50000 + 49999} end\n"
+  "local total = 0\n"
+  "for _, c in ipairs(pool:map(count, ranges)) do total = total + c end\n"
+  "pool:close()\n"
+  "assert(total == 230209)\n"},
+ {"life",
+  "local work, n = require 'work', ...\n"
+  "local pool = work.pool(n)\n"
+  "local function run(seed)\n"
+  "  local w, h = 64, 64\n"
+  "  local cells, next = {}, {}\n"
+  "  for i = 1, w * h do cells[i] = (i * seed) % 7 < 2 and 1 or 0; next[i] = 0 end\n"
+  "  for gen = 1, 20 do\n"
+  "    for y = 0, h - 1 do\n"
+  "      local ym, yp = (y - 1) % h * w, (y + 1) % h * w\n"
+  "      for x = 1, w do\n"
+  "        local xm, xp = (x - 2) % w + 1, x % w + 1\n"
+  "        local yw = y * w\n"
+  "        local sum = cells[ym + xm] + cells[ym + x] + cells[ym + xp] +\n"
+  "                    cells[yw + xm] + cells[yw + xp] +\n"
+  "                    cells[yp + xm] + cells[yp + x] + cells[yp + xp]\n"
+  "        next[yw + x] = (sum == 3 or (sum == 2 and cells[yw + x] == 1)) and 1 or 0\n"
+  "      end\n"
+  "    end\n"
+  "    cells, next = next, cells\n"
+  "  end\n"
+  "  local alive = 0\n"
+  "  for i = 1, w * h do alive = alive + cells[i] end\n"
+  "  return alive\n"
+  "end\n"
+  "local seeds = {}\n"
+  "for i = 1, 64 do seeds[i] = i end\n"
+  "pool:map(run, seeds)\n"
+  "pool:close()\n"},
+ {NULL, NULL}
+};
+
+static double now(void)
+{
+ struct timespec ts;
+ timespec_get(&ts,TIME_UTC);
+ return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static double run(const char *code, int workers)
+{
+ lua_State *L=luaL_newstate();
+ double start;
+ if (L==NULL) return -1;
+ luaL_openlibs(L);
+ start=now();
+ if (luaL_loadstring(L,code)!=0 || (lua_pushinteger(L,workers),lua_pcall(L,1,0,0))!=0)
+  fprintf(stderr,"%s\n",lua_tostring(L,-1));
+ start=now()-start;
+ lua_close(L);
+ return start;
+}
+
+int main(int argc, char *argv[])
+{
+ int i,n;
+ int max=(argc>1) ? atoi(argv[1]) : 8;
+ printf("%-10s %8s %10s %8s\n","workload","workers","time","speedup");
+ for (i=0; workloads[i][0]!=NULL; i++)
+ {
+  double base=run(workloads[i][1],1);
+  printf("%-10s %8d %9.3fs %7.2fx\n",workloads[i][0],1,base,1.0);
+  for (n=2; n<=max; n*=2)
+  {
+   double t=run(workloads[i][1],n);
+   printf("%-10s %8d %9.3fs %7.2fx\n",workloads[i][0],n,t,(t>0) ? base/t : 0);
+  }
+ }
+ return 0;
+}
@@ -0,0 +1,384 @@
+/*
+** $Id: lalloc.c $
+** Size-class slab allocator for Lua states
+** See Copyright Notice in lua.h
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#define lalloc_c
+#define LUA_LIB
+
+#include "lua.h"
+
+#include "lauxlib.h"
+
+
+/* This file uses only the official API of Lua.
+** The allocator could be written as an application function.
+*/
+
+
+/*
+** Small blocks (up to SLAB_MAXSIZE bytes) are served from pages of
+** SLAB_PAGESIZE bytes, each page holding blocks of a single size class.
+** Size classes are multiples of SLAB_GRAIN, which covers all the small
+** objects of the core (strings, tables, closures, upvalues, nodes and
+** short vectors). Bigger blocks go straight to 'realloc'.
+**
+** Pages are aligned to their own size, so the page of any small block
+** is found by masking its address. Each page counts its live blocks;
+** a page whose count drops to zero is returned to the system (with
+** 'madvise' where available) and kept in a per-arena list of empty
+** pages, to be reused by any size class.
+**
+** Large blocks carry a small header linking them in a list of the
+** arena, so that 'luaL_freeslab' can release the whole arena (pages
+** and large blocks) without any help from the state. States created
+** by 'luaL_newslabstate' use that as their release function, so
+** 'lua_close' does not need to free objects one by one.
+**
+** 'lua_Alloc' must not fail when shrinking a block. A small block with
+** no room in a smaller class stays where it is. A large block with no
+** room in a page stays large too, but Lua now passes a small old size
+** for it; such blocks move to a second list ('kept') that is searched
+** for any small block whenever it is not empty. The arena is
+** never released by the allocator itself: whoever created it frees it
+** once, after the state is gone (or could not be built).
+*/
+
+#if !defined(SLAB_PAGESIZE)
+#define SLAB_PAGESIZE	(64 * 1024)
+#endif
+
+#if !defined(SLAB_MAXSIZE)
+#define SLAB_MAXSIZE	512
+#endif
+
+/* maximum number of empty pages kept by an arena */
+#if !defined(SLAB_MAXEMPTY)
+#define SLAB_MAXEMPTY	64
+#endif
+
+#define SLAB_GRAIN	16
+#define SLAB_NCLASSES	(SLAB_MAXSIZE / SLAB_GRAIN)
+
+#define sizeclass(s)	(((s) + SLAB_GRAIN - 1) / SLAB_GRAIN - 1)
+#define classsize(c)	(((c) + 1) * SLAB_GRAIN)
+#define issmall(s)	((s) <= SLAB_MAXSIZE)
+
+
+/*
+** {======================================================
+** System pages
+** =======================================================
+*/
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define l_newpage(r)	(*(r) = NULL, \
+  posix_memalign(r, SLAB_PAGESIZE, SLAB_PAGESIZE) == 0 ? *(r) : NULL)
+#define l_freepage(p,r)	((void)(r), free(p))
+
+/* release the physical memory of a page, except for its header */
+static void l_releasepage (void *p) {
+  size_t os = (size_t)sysconf(_SC_PAGESIZE);
+  if (os > 0 && os < SLAB_PAGESIZE)
+    madvise((char *)p + os, SLAB_PAGESIZE - os, MADV_DONTNEED);
+}
+
+#elif defined(LUA_WIN)		/* }{ */
+
+#include <malloc.h>
+
+#define l_newpage(r)	(*(r) = _aligned_malloc(SLAB_PAGESIZE, SLAB_PAGESIZE))
+#define l_freepage(p,r)	((void)(r), _aligned_free(p))
+#define l_releasepage(p)	((void)(p))
+
+#else				/* }{ */
+
+/* ANSI: over-allocate and align by hand */
+#define l_newpage(r) \
+  (*(r) = malloc(2 * SLAB_PAGESIZE), (*(r) == NULL) ? NULL : \
+   (void *)(((size_t)*(r) + SLAB_PAGESIZE - 1) & ~(size_t)(SLAB_PAGESIZE - 1)))
+#define l_freepage(p,r)	((void)(p), free(r))
+#define l_releasepage(p)	((void)(p))
+
+#endif				/* } */
+
+/* }====================================================== */
+
+
+typedef struct SlabPage {
+  struct SlabPage *next, *prev;  /* links in the arena list it belongs to */
+  void *freelist;  /* list of freed blocks */
+  char *bump;  /* first never-used block */
+  void *raw;  /* block returned by the system */
+  unsigned short sclass;  /* size class of this page */
+  unsigned short nused;  /* number of live blocks */
+  unsigned short nblocks;  /* capacity of the page */
+  unsigned short isfull;  /* true if page is in the 'full' list */
+} SlabPage;
+
+
+#define SLAB_HEADER	((sizeof(SlabPage) + SLAB_GRAIN - 1) & ~(SLAB_GRAIN - 1))
+
+#define pageof(b) \
+	((SlabPage *)((size_t)(b) & ~(size_t)(SLAB_PAGESIZE - 1)))
+
+
+/* header for large blocks */
+typedef union LargeBlock {
+  struct {
+    union LargeBlock *next, *prev;
+  } l;
+  char pad[SLAB_GRAIN];  /* keep blocks aligned */
+} LargeBlock;
+
+
+typedef struct SlabArena {
+  SlabPage *partial[SLAB_NCLASSES];  /* pages with free blocks, per class */
+  SlabPage *full;  /* pages with no free blocks */
+  SlabPage *empty;  /* pages with no live blocks */
+  LargeBlock large;  /* head of the (circular) list of large blocks */
+  LargeBlock kept;  /* head of the list of large blocks Lua sees as small */
+  size_t nempty;  /* number of pages in 'empty' */
+  size_t npages;  /* number of pages owned by the arena */
+} SlabArena;
+
+
+static void linkpage (SlabPage **list, SlabPage *p) {
+  p->prev = NULL;
+  p->next = *list;
+  if (*list) (*list)->prev = p;
+  *list = p;
+}
+
+
+static void unlinkpage (SlabPage **list, SlabPage *p) {
+  if (p->prev) p->prev->next = p->next;
+  else *list = p->next;
+  if (p->next) p->next->prev = p->prev;
+}
+
+
+static SlabPage *newpage (SlabArena *a, int c) {
+  SlabPage *p = a->empty;
+  if (p != NULL) {  /* reuse an empty page? */
+    unlinkpage(&a->empty, p);
+    a->nempty--;
+  }
+  else {
+    void *raw;
+    p = (SlabPage *)l_newpage(&raw);
+    if (p == NULL) return NULL;
+    p->raw = raw;
+    a->npages++;
+  }
+  p->freelist = NULL;
+  p->bump = (char *)p + SLAB_HEADER;
+  p->sclass = (unsigned short)c;
+  p->nused = 0;
+  p->nblocks = (unsigned short)((SLAB_PAGESIZE - SLAB_HEADER) / classsize(c));
+  p->isfull = 0;
+  linkpage(&a->partial[c], p);
+  return p;
+}
+
+
+static void *smallalloc (SlabArena *a, size_t size) {
+  int c = sizeclass(size);
+  SlabPage *p = a->partial[c];
+  void *b;
+  if (p == NULL && (p = newpage(a, c)) == NULL)
+    return NULL;
+  if (p->freelist != NULL) {  /* reuse a freed block? */
+    b = p->freelist;
+    p->freelist = *(void **)b;
+  }
+  else {  /* carve a new block */
+    b = p->bump;
+    p->bump += classsize(c);
+  }
+  if (++p->nused == p->nblocks) {  /* page is full? */
+    unlinkpage(&a->partial[c], p);
+    linkpage(&a->full, p);
+    p->isfull = 1;
+  }
+  return b;
+}
+
+
+static void smallfree (SlabArena *a, void *b) {
+  SlabPage *p = pageof(b);
+  int c = p->sclass;
+  *(void **)b = p->freelist;
+  p->freelist = b;
+  if (p->isfull) {  /* page was full? */
+    unlinkpage(&a->full, p);
+    linkpage(&a->partial[c], p);
+    p->isfull = 0;
+  }
+  if (--p->nused == 0 && (p->prev != NULL || p->next != NULL)) {
+    /* page is empty and is not the only one of its class */
+    unlinkpage(&a->partial[c], p);
+    if (a->nempty < SLAB_MAXEMPTY) {  /* keep it for later reuse */
+      l_releasepage(p);
+      linkpage(&a->empty, p);
+      a->nempty++;
+    }
+    else {
+      a->npages--;
+      l_freepage(p, p->raw);
+    }
+  }
+}
+
+
+static void *largealloc (SlabArena *a, void *ptr, size_t nsize) {
+  LargeBlock *b = (ptr != NULL) ? (LargeBlock *)ptr - 1 : NULL;
+  LargeBlock *nb = (LargeBlock *)realloc(b, sizeof(LargeBlock) + nsize);
+  if (nb == NULL) return NULL;
+  if (b == NULL) {  /* new block? */
+    nb->l.next = a->large.l.next;
+    nb->l.prev = &a->large;
+  }
+  nb->l.next->l.prev = nb;  /* (re)link block */
+  nb->l.prev->l.next = nb;
+  return nb + 1;
+}
+
+
+static void unlinklarge (LargeBlock *b) {
+  b->l.prev->l.next = b->l.next;
+  b->l.next->l.prev = b->l.prev;
+}
+
+
+static void linklarge (LargeBlock *list, LargeBlock *b) {
+  b->l.next = list->l.next;
+  b->l.prev = list;
+  b->l.next->l.prev = b;
+  list->l.next = b;
+}
+
+
+static void largefree (void *ptr) {
+  LargeBlock *b = (LargeBlock *)ptr - 1;
+  unlinklarge(b);
+  free(b);
+}
+
+
+/* if 'ptr' is a kept block, moves it back to the list of large blocks */
+static int unkeep (SlabArena *a, void *ptr) {
+  LargeBlock *b;
+  for (b = a->kept.l.next; b != &a->kept; b = b->l.next) {
+    if (b + 1 == ptr) {
+      unlinklarge(b);
+      linklarge(&a->large, b);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+static void freelarge (LargeBlock *list) {
+  LargeBlock *b, *bnext;
+  for (b = list->l.next; b != list; b = bnext) {
+    bnext = b->l.next;
+    free(b);
+  }
+}
+
+
+static void freepages (SlabPage *p) {
+  while (p != NULL) {
+    SlabPage *next = p->next;
+    l_freepage(p, p->raw);
+    p = next;
+  }
+}
+
+
+LUALIB_API void *luaL_newslab (void) {
+  SlabArena *a = (SlabArena *)malloc(sizeof(SlabArena));
+  if (a != NULL) {
+    memset(a, 0, sizeof(SlabArena));
+    a->large.l.next = a->large.l.prev = &a->large;
+    a->kept.l.next = a->kept.l.prev = &a->kept;
+  }
+  return a;
+}
+
+
+LUALIB_API void luaL_freeslab (void *slab) {
+  SlabArena *a = (SlabArena *)slab;
+  int c;
+  freelarge(&a->large);
+  freelarge(&a->kept);
+  for (c = 0; c < SLAB_NCLASSES; c++)
+    freepages(a->partial[c]);
+  freepages(a->full);
+  freepages(a->empty);
+  free(a);
+}
+
+
+/*
+** 'lua_Alloc' over a slab arena. The old size given by Lua tells
+** whether a block is small (lives in a page) or large (came from
+** 'realloc'). Freeing the last block does not release the arena; a
+** state built with 'lua_newstate' over it needs a 'luaL_freeslab'
+** after 'lua_close'.
+*/
+LUALIB_API void *luaL_slaballoc (void *ud, void *ptr, size_t osize,
+                                                      size_t nsize) {
+  SlabArena *a = (SlabArena *)ud;
+  void *nb;
+  if (ptr == NULL) {  /* new block? */
+    if (nsize == 0) return NULL;
+    return issmall(nsize) ? smallalloc(a, nsize) : largealloc(a, NULL, nsize);
+  }
+  if (issmall(osize) && a->kept.l.next != &a->kept && unkeep(a, ptr))
+    osize = SLAB_MAXSIZE + 1;  /* large block Lua believes small */
+  if (nsize == 0) {  /* free block? */
+    if (issmall(osize))
+      smallfree(a, ptr);
+    else
+      largefree(ptr);
+    return NULL;
+  }
+  if (issmall(osize)) {
+    int c = pageof(ptr)->sclass;  /* may be larger than the class of osize */
+    if (issmall(nsize) && sizeclass(nsize) == c)
+      return ptr;  /* same class; nothing to do */
+    nb = issmall(nsize) ? smallalloc(a, nsize) : largealloc(a, NULL, nsize);
+    if (nb == NULL)  /* keep a shrinking block where it is */
+      return (nsize <= classsize(c)) ? ptr : NULL;
+    memcpy(nb, ptr, (osize < nsize) ? osize : nsize);
+    smallfree(a, ptr);
+    return nb;
+  }
+  else if (issmall(nsize)) {  /* large block shrinking into a page? */
+    nb = smallalloc(a, nsize);
+    if (nb == NULL) {  /* no page available? keep the block */
+      LargeBlock *b = (LargeBlock *)ptr - 1;
+      unlinklarge(b);
+      linklarge(&a->kept, b);
+      return ptr;
+    }
+    memcpy(nb, ptr, nsize);
+    largefree(ptr);
+    return nb;
+  }
+  else
+    return largealloc(a, ptr, nsize);
+}
+
@@ -599,7 +599,8 @@ LUA_API const char *lua_pushsubstring (lua_State *L, int idx, size_t start, size
     }
     if (ss != NULL) break;
     if (nextsscluster(cluster) == NULL) {  /* need new cluster? */
-      next = luaM_newvector(L, SUBSTR_CLUSTER_SIZE, TString);
+      next = cast(TString *, luaM_newobject(L, LUA_TSUBSTR,
+                       SUBSTR_CLUSTER_SIZE * sizeof(TString)));
       memset(next, 0, SUBSTR_CLUSTER_SIZE * sizeof(TString));
       nextsscluster(cluster) = next;  /* chain next cluster in list */
       nextsscluster(next) = NULL;  /* ensure next pointer is NULL */
@@ -1085,14 +1086,27 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
 }
 
 
+/* compiles the functions in 'f' that a lazy load left as text */
+static void compileall (lua_State *L, Proto *f) {
+  int i;
+  if (f->lazytext != NULL)
+    luaD_compile(L, f);
+  for (i = 0; i < f->sizep; i++)
+    compileall(L, f->p[i]);
+}
+
+
 LUA_API int lua_dump53 (lua_State *L, lua_Writer writer, void *data, int strip) {
   int status;
   TValue *o;
   lua_lock(L);
   api_checknelems(L, 1);
   o = L->top - 1;
-  if (isLfunction(o) && !(G(L)->disabled & 1))
-    status = luaU_dump(L, getproto(o), writer, data, strip);
+  if (isLfunction(o) && !(G(L)->disabled & 1)) {
+    Proto *f = getproto(o);
+    compileall(L, f);
+    status = luaU_dump(L, f, writer, data, strip);
+  }
   else
     status = 1;
   lua_unlock(L);
@@ -1114,6 +1128,47 @@ LUA_API int lua_status (lua_State *L) {
 ** Garbage-collection function
 */
 
+/*
+** size of the rope or substring clusters in list 'c'
+*/
+static size_t clustersize (TString *c, size_t size) {
+  size_t n = 0;
+  for (; c != NULL; c = nextropecluster(c))
+    n += size * sizeof(TString);
+  return n;
+}
+
+
+LUA_API void lua_gcstats (lua_State *L, lua_GCStats *s) {
+  global_State *g;
+  lua_lock(L);
+  g = G(L);
+  *s = g->gcst.s;
+  s->ropeclusters = clustersize(g->ropeclusters, ROPE_CLUSTER_SIZE);
+  s->substrclusters = clustersize(g->ssclusters, SUBSTR_CLUSTER_SIZE);
+  s->strnuse = g->strt.nuse;
+  s->strsize = g->strt.size;
+  lua_unlock(L);
+}
+
+
+LUA_API int lua_setaccounting (lua_State *L, int on) {
+  int old;
+  lua_lock(L);
+  old = G(L)->accounting;
+  G(L)->accounting = cast_byte(on != 0);
+  lua_unlock(L);
+  return old;
+}
+
+
+LUA_API void lua_threadstats (lua_State *L, lua_ThreadStats *s) {
+  lua_lock(L);
+  luaD_threadstats(L, s);
+  lua_unlock(L);
+}
+
+
 LUA_API int lua_gc (lua_State *L, int what, int data) {
   int res = 0;
   global_State *g;
@@ -1185,6 +1240,21 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       luaC_changemode(L, KGC_NORMAL);
       break;
     }
+    case LUA_GCTHREADPOOL: {  /* set (if data >= 0) maximum pooled threads */
+      res = g->maxpooled;
+      if (data >= 0) {
+        g->maxpooled = data;
+        luaE_trimthreadpool(L, data);
+      }
+      break;
+    }
+    case LUA_GCSTACKSIZE: {  /* set (if data > 0) stack size of new threads */
+      res = g->stackinit;
+      if (data > 0)
+        g->stackinit = (data < BASIC_STACK_SIZE) ? BASIC_STACK_SIZE :
+                       (data > LUAI_MAXSTACK) ? LUAI_MAXSTACK : data;
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1264,6 +1334,18 @@ LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
   lua_lock(L);
   G(L)->ud = ud;
   G(L)->frealloc = f;
+  G(L)->frelease = NULL;  /* new allocator is not known to be a region */
+  lua_unlock(L);
+}
+
+
+/*
+** 'f' releases at once every block handed out by the allocator of
+** the state; 'lua_close' will then skip freeing objects one by one
+*/
+LUA_API void lua_setreleasef (lua_State *L, lua_Release f) {
+  lua_lock(L);
+  G(L)->frelease = f;
   lua_unlock(L);
 }
 
@@ -1297,7 +1379,9 @@ static const char *aux_upvalue (StkId fi, int n, TValue **val,
       Proto *p = f->p;
       if (!(1 <= n && n <= p->sizeupvalues)) return NULL;
       *val = f->upvals[n-1]->v;
-      if (owner) *owner = obj2gco(f->upvals[n - 1]);
+      if (owner)  /* upvalues kept in the closure have it as their owner */
+        *owner = isownupval(f, f->upvals[n - 1]) ? obj2gco(f)
+                                                 : obj2gco(f->upvals[n - 1]);
       name = p->upvalues[n-1].name;
       return (name == NULL) ? "" : getstr(name);
     }
@@ -1371,11 +1455,19 @@ LUA_API void *lua_upvalueid (lua_State *L, int fidx, int n) {
 
 LUA_API void lua_upvaluejoin (lua_State *L, int fidx1, int n1,
                                             int fidx2, int n2) {
-  LClosure *f1;
+  LClosure *f1, *f2;
   UpVal **up1 = getupvalref(L, fidx1, n1, &f1);
-  UpVal **up2 = getupvalref(L, fidx2, n2, NULL);
+  UpVal **up2 = getupvalref(L, fidx2, n2, &f2);
+  lua_lock(L);
+  if (isownupval(f2, *up2)) {  /* kept inside 'f2'? */
+    UpVal *uv = luaF_newupval(L);  /* move it to an upvalue both can share */
+    setobj(L, uv->v, (*up2)->v);
+    *up2 = uv;
+    luaC_objbarrier(L, f2, uv);
+  }
   *up1 = *up2;
   luaC_objbarrier(L, f1, *up2);
+  lua_unlock(L);
 }
 
 LUA_API void lua_halt(lua_State *L) {
@@ -1391,16 +1483,6 @@ LUA_API void lua_externalerror(lua_State *L, const char * message) {
   lua_unlock(L);
 }
 
-LUA_API void lua_setlockstate(lua_State *L, int enabled) {
-  lua_lock(L);
-  if (!enabled) {
-    G(L)->lockstate = G(L)->lockstate >= 2 ? 2 : 3;
-  } else {
-    G(L)->lockstate = G(L)->lockstate >= 2 ? 0 : 1;
-  }
-  lua_unlock(L);
-}
-
 LUA_API void lua_setdisableflags(lua_State *L, unsigned char flags) {
   lua_lock(L);
   G(L)->disabled = flags;
@@ -952,6 +952,23 @@ LUALIB_API lua_State *luaL_newstate (void) {
 }
 
 
+/*
+** state whose memory comes from its own slab arena (see lalloc.c)
+*/
+LUALIB_API lua_State *luaL_newslabstate (void) {
+  lua_State *L;
+  void *slab = luaL_newslab();
+  if (slab == NULL) return NULL;
+  L = lua_newstate(luaL_slaballoc, slab);
+  if (L) {
+    lua_atpanic(L, &panic);
+    lua_setreleasef(L, luaL_freeslab);  /* 'lua_close' frees the arena */
+  }
+  else luaL_freeslab(slab);
+  return L;
+}
+
+
 LUALIB_API void luaL_checkversion_ (lua_State *L, lua_Number ver) {
   const lua_Number *v = lua_version(L);
   if (v != lua_version(NULL))
@@ -83,6 +83,7 @@ LUALIB_API int (luaL_loadbufferx) (lua_State *L, const char *buff, size_t sz,
 LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s);
 
 LUALIB_API lua_State *(luaL_newstate) (void);
+LUALIB_API lua_State *(luaL_newslabstate) (void);
 
 LUALIB_API int (luaL_len) (lua_State *L, int idx);
 
@@ -171,6 +172,21 @@ LUALIB_API char *(luaL_buffinitsize) (lua_State *L, luaL_Buffer *B, size_t sz);
 
 
 
+/*
+** {======================================================
+** Slab allocator
+** =======================================================
+*/
+
+LUALIB_API void *(luaL_newslab) (void);
+LUALIB_API void (luaL_freeslab) (void *slab);
+LUALIB_API void *(luaL_slaballoc) (void *ud, void *ptr, size_t osize,
+                                                        size_t nsize);
+
+/* }====================================================== */
+
+
+
 /*
 ** {======================================================
 ** File handles for IO library
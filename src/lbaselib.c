@@ -157,16 +157,88 @@ static int luaB_rawset (lua_State *L) {
 }
 
 
+static const char *const gcphases[LUA_GCSTATPHASES] = {"propagate",
+  "atomic", "sweepstring", "sweepudata", "sweep", "pause"};
+
+static const char *const gckinds[LUA_GCSTATKINDS] = {"string", "rope",
+  "substring", "table", "luafunction", "cfunction", "userdata", "thread",
+  "proto", "upvalue"};
+
+
+static void setkinds (lua_State *L, const char *name, const size_t *v) {
+  int i;
+  lua_createtable(L, 0, LUA_GCSTATKINDS);
+  for (i = 0; i < LUA_GCSTATKINDS; i++) {
+    lua_pushnumber(L, (lua_Number)v[i]);
+    lua_setfield(L, -2, gckinds[i]);
+  }
+  lua_setfield(L, -2, name);
+}
+
+
+#define setnumfield(L,k,v)	(lua_pushnumber(L, (lua_Number)(v)), \
+                                 lua_setfield(L, -2, k))
+
+
+static int gcstats (lua_State *L) {
+  lua_GCStats s;
+  int i;
+  lua_gcstats(L, &s);
+  lua_createtable(L, 0, 10);
+  setnumfield(L, "cycles", s.cycles);
+  lua_createtable(L, 0, LUA_GCSTATPHASES);  /* phase timings */
+  for (i = 0; i < LUA_GCSTATPHASES; i++) {
+    lua_createtable(L, 0, 2);
+    setnumfield(L, "total", s.phasetime[i]);
+    setnumfield(L, "last", s.lastphasetime[i]);
+    lua_setfield(L, -2, gcphases[i]);
+  }
+  lua_setfield(L, -2, "phases");
+  lua_createtable(L, LUA_GCSTATBUCKETS, 0);  /* pause histogram */
+  for (i = 0; i < LUA_GCSTATBUCKETS; i++) {
+    lua_pushnumber(L, (lua_Number)s.pauses[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "pauses");
+  setnumfield(L, "maxpause", s.maxpause);
+  setkinds(L, "live", s.live);
+  setkinds(L, "freed", s.freed);
+  lua_createtable(L, 0, 2);
+  setnumfield(L, "rope", s.ropeclusters);
+  setnumfield(L, "substring", s.substrclusters);
+  lua_setfield(L, -2, "clusters");
+  lua_createtable(L, 0, 2);
+  setnumfield(L, "called", s.finalized);
+  setnumfield(L, "errors", s.finalizererrors);
+  lua_setfield(L, -2, "finalizers");
+  lua_createtable(L, 0, 2);
+  setnumfield(L, "nuse", s.strnuse);
+  setnumfield(L, "size", s.strsize);
+  lua_setfield(L, -2, "strings");
+  lua_createtable(L, 0, 2);
+  setnumfield(L, "grows", s.stackgrows);
+  setnumfield(L, "shrinks", s.stackshrinks);
+  lua_setfield(L, -2, "stack");
+  return 1;
+}
+
+
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "setmajorinc", "isrunning", "generational", "incremental", NULL};
+    "setmajorinc", "isrunning", "generational", "incremental", "stats", "threadpool",
+    "stacksize", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCSETMAJORINC, LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC};
+    LUA_GCSETMAJORINC, LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC, -1, LUA_GCTHREADPOOL,
+    LUA_GCSTACKSIZE};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
-  int ex = luaL_optint(L, 2, 0);
-  int res = lua_gc(L, o, ex);
+  int ex = luaL_optint(L, 2,
+                       (o == LUA_GCTHREADPOOL || o == LUA_GCSTACKSIZE) ? -1 : 0);
+  int res;
+  if (o == -1)  /* "stats"? */
+    return gcstats(L);
+  res = lua_gc(L, o, ex);
   switch (o) {
     case LUA_GCCOUNT: {
       int b = lua_gc(L, LUA_GCCOUNTB, 0);
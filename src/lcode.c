@@ -209,18 +209,58 @@ void luaK_concat (FuncState *fs, int *l1, int l2) {
 }
 
 
+/*
+** Saves the line of the last instruction coded: its distance from the
+** line before, or an absolute line when that does not fit in a byte or
+** when there has been none for MAXIWTHABS instructions.
+*/
+static void savelineinfo (FuncState *fs, Proto *f, int line) {
+  int linedif = line - fs->previousline;
+  int pc = fs->pc - 1;
+  if (abs(linedif) >= LIMLINEDIFF || fs->iwthabs++ >= MAXIWTHABS) {
+    luaM_growvector(fs->ls->L, f->abslineinfo, fs->nabslineinfo,
+                    f->sizeabslineinfo, AbsLineInfo, MAX_INT, "lines");
+    f->abslineinfo[fs->nabslineinfo].pc = pc;
+    f->abslineinfo[fs->nabslineinfo++].line = line;
+    linedif = ABSLINEINFO;
+    fs->iwthabs = 1;
+  }
+  luaM_growvector(fs->ls->L, f->lineinfo, pc, f->sizelineinfo, ls_byte,
+                  MAX_INT, "opcodes");
+  f->lineinfo[pc] = cast(ls_byte, linedif);
+  fs->previousline = line;
+}
+
+
+/*
+** Undoes the line of the last instruction coded. After an absolute
+** line, the next one is absolute too, as the count since the one
+** before is lost.
+*/
+static void removelastlineinfo (FuncState *fs) {
+  Proto *f = fs->f;
+  int pc = fs->pc - 1;
+  if (f->lineinfo[pc] != ABSLINEINFO) {
+    fs->previousline -= f->lineinfo[pc];
+    fs->iwthabs--;
+  }
+  else {
+    lua_assert(f->abslineinfo[fs->nabslineinfo - 1].pc == pc);
+    fs->nabslineinfo--;
+    fs->iwthabs = MAXIWTHABS + 1;
+  }
+}
+
+
 static int luaK_code (FuncState *fs, Instruction i) {
   Proto *f = fs->f;
   dischargejpc(fs);  /* `pc' will change */
   /* put new instruction in code array */
   luaM_growvector(fs->ls->L, f->code, fs->pc, f->sizecode, Instruction,
                   MAX_INT, "opcodes");
-  f->code[fs->pc] = i;
-  /* save corresponding line information */
-  luaM_growvector(fs->ls->L, f->lineinfo, fs->pc, f->sizelineinfo, int,
-                  MAX_INT, "opcodes");
-  f->lineinfo[fs->pc] = fs->ls->lastline;
-  return fs->pc++;
+  f->code[fs->pc++] = i;
+  savelineinfo(fs, f, fs->ls->lastline);
+  return fs->pc - 1;
 }
 
 
@@ -607,6 +647,7 @@ static int jumponcond (FuncState *fs, expdesc *e, int cond) {
   if (e->k == VRELOCABLE) {
     Instruction ie = getcode(fs, e);
     if (GET_OPCODE(ie) == OP_NOT) {
+      removelastlineinfo(fs);
       fs->pc--;  /* remove previous OP_NOT */
       return condjump(fs, OP_TEST, GETARG_B(ie), 0, !cond);
     }
@@ -729,10 +770,32 @@ static int constfolding (OpCode op, expdesc *e1, expdesc *e2) {
 }
 
 
+/*
+** Is 'e' a numeral that fits in the sC argument of OP_ADDI/OP_SUBI?
+** (Zero is left out, as 'x + 0' and 'x + -0' differ for x = -0.)
+*/
+static int isimmediate (expdesc *e) {
+  lua_Number n;
+  if (!isnumeral(e)) return 0;
+  n = e->u.nval;
+  return (n >= -MAXARG_sC && n <= MAXARG_sC && n != 0 &&
+          cast_num(cast_int(n)) == n);
+}
+
+
 static void codearith (FuncState *fs, OpCode op,
                        expdesc *e1, expdesc *e2, int line) {
   if (constfolding(op, e1, e2))
     return;
+  else if ((op == OP_ADD || op == OP_SUB) && e1->k == VNONRELOC &&
+           isimmediate(e2)) {  /* register plus or minus small integer? */
+    int o1 = e1->u.info;
+    freeexp(fs, e1);
+    e1->u.info = luaK_codeABC(fs, (op == OP_ADD) ? OP_ADDI : OP_SUBI, 0, o1,
+                              cast_int(e2->u.nval) + MAXARG_sC);
+    e1->k = VRELOCABLE;
+    luaK_fixline(fs, line);
+  }
   else {
     int o2 = (op != OP_UNM && op != OP_LEN) ? luaK_exp2RK(fs, e2) : 0;
     int o1 = luaK_exp2RK(fs, e1);
@@ -868,7 +931,8 @@ void luaK_posfix (FuncState *fs, BinOpr op,
 
 
 void luaK_fixline (FuncState *fs, int line) {
-  fs->f->lineinfo[fs->pc - 1] = line;
+  removelastlineinfo(fs);
+  savelineinfo(fs, fs->f, line);
 }
 
 
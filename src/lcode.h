@@ -79,5 +79,9 @@ LUAI_FUNC void luaK_posfix (FuncState *fs, BinOpr op, expdesc *v1,
                             expdesc *v2, int line);
 LUAI_FUNC void luaK_setlist (FuncState *fs, int base, int nelems, int tostore);
 
+/* optimize a compiled chunk, and fuse its superinstructions; from lopt.c */
+LUAI_FUNC void luaK_optimize (lua_State *L, Proto *f);
+LUAI_FUNC void luaK_fuse (lua_State *L, Proto *f);
+
 
 #endif
@@ -6,6 +6,7 @@
 
 
 #include <stdlib.h>
+#include <string.h>
 
 
 #define lcorolib_c
@@ -81,8 +82,11 @@ static int luaB_auxwrap (lua_State *L) {
 
 static int luaB_cocreate (lua_State *L) {
   lua_State *NL;
+  int size = luaL_optint(L, 2, 0);  /* stack slots to reserve */
   luaL_checktype(L, 1, LUA_TFUNCTION);
   NL = lua_newthread(L);
+  luaL_argcheck(L, size <= 0 || lua_checkstack(NL, size), 2,
+                "stack size too large");
   lua_pushvalue(L, 1);  /* move function to top */
   lua_xmove(L, NL, 1);  /* move function from L to NL */
   return 1;
@@ -143,6 +147,284 @@ static int luaB_yieldable (lua_State *L) {
 }
 
 
+/*
+** stats([co]): accounting of 'co' (default: the running coroutine);
+** stats(on): turns accounting on or off, returning the old setting
+*/
+static int luaB_costats (lua_State *L) {
+  lua_ThreadStats s;
+  lua_State *co;
+  if (lua_isboolean(L, 1)) {
+    lua_pushboolean(L, lua_setaccounting(L, lua_toboolean(L, 1)));
+    return 1;
+  }
+  co = lua_isnone(L, 1) ? L : lua_tothread(L, 1);
+  luaL_argcheck(L, co, 1, "coroutine expected");
+  lua_threadstats(co, &s);
+  lua_createtable(L, 0, 5);
+  lua_pushnumber(L, s.walltime);
+  lua_setfield(L, -2, "wall");
+  lua_pushnumber(L, s.cputime);
+  lua_setfield(L, -2, "cpu");
+  lua_pushnumber(L, (lua_Number)s.instructions);
+  lua_setfield(L, -2, "instructions");
+  lua_pushnumber(L, (lua_Number)s.allocated);
+  lua_setfield(L, -2, "allocated");
+  lua_pushnumber(L, (lua_Number)s.resumes);
+  lua_setfield(L, -2, "resumes");
+  return 1;
+}
+
+
+/*
+** {======================================================
+** Scheduler: a set of coroutines, each waiting for an event name.
+** The slots array (a userdata) is scanned in C, comparing the event
+** with each filter by address first, so that coroutines waiting for
+** other events cost no Lua work. The scheduler's user value anchors
+** the slots array (at index 0) and the coroutine and filter string
+** of slot 'i' (at indices 2i+1 and 2i+2).
+** =======================================================
+*/
+
+#define SCHEDULER	"coroutine.scheduler"
+
+typedef struct Slot {
+  lua_State *co;  /* NULL if removed or finished */
+  const char *filter;  /* event waited for (NULL for any event) */
+  size_t lfilter;
+} Slot;
+
+
+typedef struct Scheduler {
+  Slot *slots;
+  int n;  /* number of slots in use */
+  int size;  /* size of 'slots' */
+  int dispatching;  /* number of active calls to 'dispatch' */
+} Scheduler;
+
+
+#define toscheduler(L)	((Scheduler *)luaL_checkudata(L, 1, SCHEDULER))
+
+#define matches(sl,e,le) ((sl)->filter == NULL || ((sl)->lfilter == (le) && \
+  ((sl)->filter == (e) || memcmp((sl)->filter, (e), (le)) == 0)))
+
+
+/* true if 'co' is a suspended coroutine (yielded or not started) */
+static int resumable (lua_State *co) {
+  lua_Debug ar;
+  if (lua_status(co) == LUA_YIELD) return 1;
+  return (lua_status(co) == LUA_OK && lua_getstack(co, 0, &ar) == 0 &&
+          lua_gettop(co) > 0);
+}
+
+
+/* set filter of slot 'i' to the value on the top (popped) */
+static void setfilter (lua_State *L, Scheduler *s, int set, int i) {
+  Slot *sl = &s->slots[i];
+  if (lua_type(L, -1) == LUA_TSTRING)
+    sl->filter = lua_tolstring(L, -1, &sl->lfilter);
+  else {
+    lua_pop(L, 1);
+    lua_pushboolean(L, 0);
+    sl->filter = NULL;
+  }
+  lua_rawseti(L, set, 2*i + 2);
+}
+
+
+/* remove finished and removed coroutines from the set at 'set' */
+static void compact (lua_State *L, Scheduler *s, int set) {
+  int i, j = 0;
+  for (i = 0; i < s->n; i++) {
+    if (s->slots[i].co != NULL) {
+      if (i != j) {  /* move it down */
+        s->slots[j] = s->slots[i];
+        lua_rawgeti(L, set, 2*i + 1);
+        lua_rawseti(L, set, 2*j + 1);
+        lua_rawgeti(L, set, 2*i + 2);
+        lua_rawseti(L, set, 2*j + 2);
+      }
+      j++;
+    }
+  }
+  for (i = j; i < s->n; i++) {  /* release freed slots */
+    lua_pushnil(L);
+    lua_rawseti(L, set, 2*i + 1);
+    lua_pushnil(L);
+    lua_rawseti(L, set, 2*i + 2);
+  }
+  s->n = j;
+}
+
+
+static int sched_new (lua_State *L) {
+  Scheduler *s = (Scheduler *)lua_newuserdata(L, sizeof(Scheduler));
+  s->slots = NULL;
+  s->n = s->size = 0;
+  s->dispatching = 0;
+  luaL_setmetatable(L, SCHEDULER);
+  lua_newtable(L);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+
+/*
+** scheduler:add(co [, filter]) adds a coroutine (or a function, which
+** is wrapped in a new coroutine) and returns the coroutine
+*/
+static int sched_add (lua_State *L) {
+  Scheduler *s = toscheduler(L);
+  lua_State *co;
+  if (lua_type(L, 2) == LUA_TFUNCTION) {
+    lua_State *NL = lua_newthread(L);
+    lua_pushvalue(L, 2);
+    lua_xmove(L, NL, 1);
+    lua_replace(L, 2);
+  }
+  co = lua_tothread(L, 2);
+  luaL_argcheck(L, co, 2, "coroutine expected");
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TSTRING);
+  lua_settop(L, 3);
+  lua_getuservalue(L, 1);  /* set at index 4 */
+  if (s->n == s->size) {  /* grow slots array */
+    int size = (s->size == 0) ? 8 : 2 * s->size;
+    Slot *slots = (Slot *)lua_newuserdata(L, size * sizeof(Slot));
+    if (s->n > 0) memcpy(slots, s->slots, s->n * sizeof(Slot));
+    lua_rawseti(L, 4, 0);
+    s->slots = slots;
+    s->size = size;
+  }
+  s->slots[s->n].co = co;
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, 4, 2*s->n + 1);
+  lua_pushvalue(L, 3);
+  setfilter(L, s, 4, s->n);
+  s->n++;
+  lua_settop(L, 2);
+  return 1;
+}
+
+
+static int sched_remove (lua_State *L) {
+  Scheduler *s = toscheduler(L);
+  lua_State *co = lua_tothread(L, 2);
+  int i;
+  luaL_argcheck(L, co, 2, "coroutine expected");
+  for (i = 0; i < s->n; i++) {
+    if (s->slots[i].co == co) {
+      s->slots[i].co = NULL;
+      if (!s->dispatching) {
+        lua_getuservalue(L, 1);
+        compact(L, s, lua_gettop(L));
+      }
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+  }
+  lua_pushboolean(L, 0);
+  return 1;
+}
+
+
+static int sched_len (lua_State *L) {
+  Scheduler *s = toscheduler(L);
+  int i, n = 0;
+  for (i = 0; i < s->n; i++)
+    n += (s->slots[i].co != NULL);
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+
+/*
+** resumes the coroutines for 'dispatch' and leaves its results; runs
+** under lua_pcall, so that an error cannot leave 'dispatching' set
+*/
+static int dispatch (lua_State *L) {
+  Scheduler *s = toscheduler(L);
+  int nargs = lua_gettop(L) - 1;
+  int set = nargs + 2;  /* index of the user value */
+  int n = s->n;
+  int i, a, ndead = 0;
+  size_t lev;
+  const char *ev;
+  ev = (lua_type(L, 2) == LUA_TSTRING) ? lua_tolstring(L, 2, &lev) : NULL;
+  lua_getuservalue(L, 1);
+  for (i = 0; i < n; i++) {
+    lua_State *co = s->slots[i].co;
+    int status;
+    if (co == NULL || (ev == NULL ? s->slots[i].filter != NULL :
+                                    !matches(&s->slots[i], ev, lev)))
+      continue;  /* removed, or waiting for another event */
+    if (!resumable(co))
+      continue;  /* running or dead */
+    if (!lua_checkstack(co, nargs) || !lua_checkstack(L, nargs + 2))
+      return luaL_error(L, "too many arguments to resume");
+    for (a = 2; a <= nargs + 1; a++)  /* copy event and arguments */
+      lua_pushvalue(L, a);
+    lua_xmove(L, co, nargs);
+    status = lua_resume(co, L, nargs);
+    if (status == LUA_YIELD) {  /* keep its new filter */
+      if (lua_gettop(co) > 0) {
+        lua_settop(co, 1);
+        lua_xmove(co, L, 1);
+      }
+      else lua_pushnil(L);
+      setfilter(L, s, set, i);
+    }
+    else {  /* finished: leave it and its status as results */
+      lua_rawgeti(L, set, 2*i + 1);
+      if (status == LUA_OK) lua_pushboolean(L, 0);
+      else lua_xmove(co, L, 1);  /* error message */
+      s->slots[i].co = NULL;  /* free its slot */
+      ndead++;
+    }
+    lua_settop(co, 0);
+  }
+  return 2*ndead;
+}
+
+
+/*
+** scheduler:dispatch(event, ...) resumes, in order, each coroutine
+** whose filter is 'event' or that accepts any event, passing it the
+** event and its arguments, and sets its filter to the first value
+** it yields (if a string). Coroutines added while dispatching wait
+** for the next event; coroutines that are running are skipped.
+** Returns, for each coroutine that finished, the coroutine and its
+** error message (or false if it returned).
+*/
+static int sched_dispatch (lua_State *L) {
+  Scheduler *s = toscheduler(L);
+  int status;
+  luaL_checkany(L, 2);
+  lua_getuservalue(L, 1);
+  lua_insert(L, 1);  /* keep the set at index 1 */
+  lua_pushcfunction(L, dispatch);  /* (may allocate, so before counting) */
+  lua_insert(L, 2);  /* call it with all the arguments */
+  s->dispatching++;  /* keep slots in place until the outermost returns */
+  status = lua_pcall(L, lua_gettop(L) - 2, LUA_MULTRET, 0);
+  if (--s->dispatching == 0)  /* (also after an error) */
+    compact(L, s, 1);
+  if (status != LUA_OK)
+    return lua_error(L);  /* error message is on the top */
+  return lua_gettop(L) - 1;  /* all but the set */
+}
+
+
+static const luaL_Reg sched_methods[] = {
+  {"add", sched_add},
+  {"remove", sched_remove},
+  {"dispatch", sched_dispatch},
+  {"__len", sched_len},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+
 static const luaL_Reg co_funcs[] = {
   {"create", luaB_cocreate},
   {"resume", luaB_coresume},
@@ -151,12 +433,19 @@ static const luaL_Reg co_funcs[] = {
   {"wrap", luaB_cowrap},
   {"yield", luaB_yield},
   {"isyieldable", luaB_yieldable},
+  {"stats", luaB_costats},
+  {"scheduler", sched_new},
   {NULL, NULL}
 };
 
 
 
 LUAMOD_API int luaopen_coroutine (lua_State *L) {
+  luaL_newmetatable(L, SCHEDULER);  /* metatable for schedulers */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, sched_methods, 0);
+  lua_pop(L, 1);
   luaL_newlib(L, co_funcs);
   return 1;
 }
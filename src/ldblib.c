@@ -404,6 +404,111 @@ static int db_traceback (lua_State *L) {
 }
 
 
+static int filewriter (lua_State *L, const void *b, size_t size, void *f) {
+  (void)L;
+  return (fwrite(b, 1, size, (FILE *)f) != size);
+}
+
+
+static int bufwriter (lua_State *L, const void *b, size_t size, void *B) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer *)B, (const char *)b, size);
+  return 0;
+}
+
+
+/*
+** heapsnapshot([filename]): writes a snapshot of the heap to the given
+** file, or returns it as a string
+*/
+static int db_heapsnapshot (lua_State *L) {
+  const char *fname = luaL_optstring(L, 1, NULL);
+  if (fname == NULL) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    if (lua_heapsnapshot(L, bufwriter, &b) != 0)
+      return luaL_error(L, "unable to take heap snapshot");
+    luaL_pushresult(&b);
+    return 1;
+  }
+  else {
+    FILE *f = fopen(fname, "wb");
+    int status;
+    if (f == NULL)
+      return luaL_fileresult(L, 0, fname);
+    status = lua_heapsnapshot(L, filewriter, f);
+    if (fclose(f) != 0) status = 1;
+    if (status != 0)
+      return luaL_fileresult(L, 0, fname);
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+}
+
+
+/* default number of bytes allocated between samples */
+#if !defined(LUAI_SAMPLERATE)
+#define LUAI_SAMPLERATE		(256 * 1024)
+#endif
+
+
+/*
+** allocsampler([rate]): samples one allocation every 'rate' bytes;
+** a rate of 0 stops sampling and discards the samples
+*/
+static int db_allocsampler (lua_State *L) {
+  lua_Number rate = luaL_optnumber(L, 1, LUAI_SAMPLERATE);
+  luaL_argcheck(L, rate >= 0, 1, "negative rate");
+  lua_pushboolean(L, lua_setallocsampler(L, (size_t)rate));
+  return 1;
+}
+
+
+/*
+** allocsamples(["table" | "folded"]): returns the samples taken so far
+** as a list of tables, or as folded stacks ("stack;(type) bytes" lines)
+** for flame-graph tools
+*/
+static int db_allocsamples (lua_State *L) {
+  static const char *const fmts[] = {"table", "folded", NULL};
+  int folded = luaL_checkoption(L, 1, "table", fmts);
+  lua_AllocSample s;
+  int n;
+  if (folded) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (n = 1; lua_getallocsample(L, n, &s); n++) {
+      char num[LUAI_MAXNUMBER2STR];
+      luaL_addstring(&b, s.stack);
+      luaL_addstring(&b, ";(");
+      luaL_addstring(&b, s.type);
+      sprintf(num, ") %lu\n", (unsigned long)s.bytes);
+      luaL_addstring(&b, num);
+    }
+    luaL_pushresult(&b);
+    return 1;
+  }
+  lua_newtable(L);
+  for (n = 1; lua_getallocsample(L, n, &s); n++) {
+    lua_createtable(L, 0, 6);
+    lua_pushstring(L, s.stack);
+    lua_setfield(L, -2, "stack");
+    lua_pushstring(L, s.type);
+    lua_setfield(L, -2, "type");
+    lua_pushstring(L, s.func);
+    lua_setfield(L, -2, "func");
+    lua_pushinteger(L, s.line);
+    lua_setfield(L, -2, "line");
+    lua_pushnumber(L, (lua_Number)s.count);
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, (lua_Number)s.bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_rawseti(L, -2, n);
+  }
+  return 1;
+}
+
+
 static int aux_fenv(lua_State *L, int idx, int setidx) {
   int i;
   const char *name;
@@ -443,12 +548,15 @@ static int db_setfenv (lua_State *L) {
 
 
 static luaL_Reg dblib[] = {
+  {"allocsampler", db_allocsampler},
+  {"allocsamples", db_allocsamples},
   {"debug", db_debug},
   {"getuservalue", db_getuservalue},
   {"gethook", db_gethook},
   {"getinfo", db_getinfo},
   {"getlocal", db_getlocal},
   {"getregistry", db_getregistry},
+  {"heapsnapshot", db_heapsnapshot},
   {"getmetatable", db_getmetatable},
   {"getupvalue", db_getupvalue},
   {"setbreakpoint", NULL},
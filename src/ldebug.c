@@ -42,8 +42,74 @@ static int currentpc (CallInfo *ci) {
 }
 
 
+/*
+** Finds the last absolute line at or before 'pc' and its position
+** ('basepc'); with none, counts from 'linedefined' before the first
+** instruction. As there is one at least every MAXIWTHABS instructions,
+** 'pc / MAXIWTHABS - 1' is never past the right one.
+*/
+static int getbaseline (const Proto *f, int pc, int *basepc) {
+  if (f->sizeabslineinfo == 0 || pc < f->abslineinfo[0].pc) {
+    *basepc = -1;
+    return f->linedefined;
+  }
+  else {
+    int i = pc / MAXIWTHABS - 1;
+    lua_assert(i < 0 ||
+              (i < f->sizeabslineinfo && f->abslineinfo[i].pc <= pc));
+    while (i + 1 < f->sizeabslineinfo && pc >= f->abslineinfo[i + 1].pc)
+      i++;
+    *basepc = f->abslineinfo[i].pc;
+    return f->abslineinfo[i].line;
+  }
+}
+
+
+/*
+** Line of instruction 'pc' (0 without debug information): the line of
+** the absolute line before it plus the deltas from there.
+*/
+int luaG_getfuncline (const Proto *f, int pc) {
+  if (f->lineinfo == NULL)
+    return 0;
+  else {
+    int basepc;
+    int line = getbaseline(f, pc, &basepc);
+    while (basepc++ < pc) {
+      lua_assert(f->lineinfo[basepc] != ABSLINEINFO);
+      line += f->lineinfo[basepc];
+    }
+    return line;
+  }
+}
+
+
+/*
+** Do instructions 'oldpc' and 'newpc' (after it) have different lines?
+** Near ones add the deltas between them, which is all the line hook
+** needs most of the time.
+*/
+int luaG_changedline (const Proto *f, int oldpc, int newpc) {
+  if (f->lineinfo == NULL)
+    return 0;
+  if (newpc - oldpc < MAXIWTHABS / 2) {
+    int delta = 0;
+    int pc = oldpc;
+    for (;;) {
+      int d = f->lineinfo[++pc];
+      if (d == ABSLINEINFO)
+        break;  /* count from the absolute lines */
+      delta += d;
+      if (pc == newpc)
+        return (delta != 0);
+    }
+  }
+  return (luaG_getfuncline(f, oldpc) != luaG_getfuncline(f, newpc));
+}
+
+
 static int currentline (CallInfo *ci) {
-  return getfuncline(ci_func(ci)->p, currentpc(ci));
+  return luaG_getfuncline(ci_func(ci)->p, currentpc(ci));
 }
 
 
@@ -70,7 +136,8 @@ LUA_API int lua_sethook (lua_State *L, lua_Hook func, int mask, int count) {
   L->hook = func;
   L->basehookcount = count;
   resethookcount(L);
-  L->hookmask = cast_byte(mask);
+  L->hookmask = cast(unsigned short, (mask & ~LUAI_MASKINTERNAL) |
+                                     (L->hookmask & LUAI_MASKINTERNAL));
   return 1;
 }
 
@@ -81,7 +148,7 @@ LUA_API lua_Hook lua_gethook (lua_State *L) {
 
 
 LUA_API int lua_gethookmask (lua_State *L) {
-  return L->hookmask;
+  return L->hookmask & ~LUAI_MASKINTERNAL;
 }
 
 
@@ -151,9 +218,21 @@ static const char *findlocal (lua_State *L, CallInfo *ci, int n,
 }
 
 
+/*
+** Compiles the function at 'o' if a lazy load left it as text, so that
+** it has the debug information of a function loaded as usual
+*/
+static void compilelazy (lua_State *L, StkId o) {
+  if (isLfunction(o) && clLvalue(o)->p->lazytext != NULL)
+    luaD_compile(L, clLvalue(o)->p);
+}
+
+
 LUA_API const char *lua_getlocal (lua_State *L, const lua_Debug *ar, int n) {
   const char *name;
   lua_lock(L);
+  if (ar == NULL && isLfunction(L->top - 1))
+    compilelazy(L, L->top - 1);  /* parameters need its debug information */
   swapextra(L);
   if (ar == NULL) {  /* information about non-active function? */
     if (!isLfunction(L->top - 1))  /* not a Lua function? */
@@ -214,15 +293,21 @@ static void collectvalidlines (lua_State *L, Closure *f) {
     api_incr_top(L);
   }
   else {
-    int i;
+    int i, a = 0;
     TValue v;
-    int *lineinfo = f->l.p->lineinfo;
+    Proto *p = f->l.p;
+    int line = p->linedefined;
     Table *t = luaH_new(L);  /* new table to store active lines */
     sethvalue(L, L->top, t);  /* push it on stack */
     api_incr_top(L);
     setbvalue(&v, 1);  /* boolean 'true' to be the value of all indices */
-    for (i = 0; i < f->l.p->sizelineinfo; i++)  /* for all lines with code */
-      luaH_setint(L, t, lineinfo[i], &v);  /* table[line] = true */
+    for (i = 0; i < p->sizelineinfo; i++) {  /* for all lines with code */
+      if (p->lineinfo[i] == ABSLINEINFO)
+        line = p->abslineinfo[a++].line;
+      else
+        line += p->lineinfo[i];
+      luaH_setint(L, t, line, &v);  /* table[line] = true */
+    }
   }
 }
 
@@ -288,6 +373,8 @@ LUA_API int lua_getinfo (lua_State *L, const char *what, lua_Debug *ar) {
   CallInfo *ci;
   StkId func;
   lua_lock(L);
+  if (*what == '>' && strchr(what, 'L'))
+    compilelazy(L, L->top - 1);  /* its lines are in its code */
   swapextra(L);
   if (*what == '>') {
     ci = NULL;
@@ -384,8 +471,9 @@ static int findsetreg (Proto *p, int lastpc, int reg) {
           setreg = filterpc(pc, jmptarget);
         break;
       }
-      case OP_JMP: {
-        int b = GETARG_sBx(i);
+      case OP_JMP: case OP_JEQ: case OP_JNE: case OP_JLT: case OP_JNLT:
+      case OP_JLE: case OP_JNLE: case OP_JLTN: case OP_JNLTN: {
+        int b = (op == OP_JMP) ? GETARG_sBx(i) : GETARG_sA(i);
         int dest = pc + 1 + b;
         /* jump is forward and do not skip `lastpc'? */
         if (pc < dest && dest <= lastpc) {
@@ -399,6 +487,14 @@ static int findsetreg (Proto *p, int lastpc, int reg) {
           setreg = filterpc(pc, jmptarget);
         break;
       }
+      case OP_JTRUE: case OP_JFALSE: {
+        int dest = pc + 1 + GETARG_sBx(i);
+        if (reg == a)  /* jumped code can change 'a' */
+          setreg = filterpc(pc, jmptarget);
+        if (pc < dest && dest <= lastpc && dest > jmptarget)
+          jmptarget = dest;
+        break;
+      }
       default:
         if (testAMode(op) && reg == a)  /* any instruction that set A */
           setreg = filterpc(pc, jmptarget);
@@ -482,17 +578,18 @@ static const char *getfuncname (lua_State *L, CallInfo *ci, const char **name) {
     case OP_GETTABLE: tm = TM_INDEX; break;
     case OP_SETTABUP:
     case OP_SETTABLE: tm = TM_NEWINDEX; break;
-    case OP_EQ: tm = TM_EQ; break;
-    case OP_ADD: tm = TM_ADD; break;
-    case OP_SUB: tm = TM_SUB; break;
-    case OP_MUL: tm = TM_MUL; break;
+    case OP_EQ: case OP_JEQ: case OP_JNE: tm = TM_EQ; break;
+    case OP_ADD: case OP_ADDI: case OP_ADDN: tm = TM_ADD; break;
+    case OP_SUB: case OP_SUBI: case OP_SUBN: tm = TM_SUB; break;
+    case OP_MUL: case OP_MULN: tm = TM_MUL; break;
     case OP_DIV: tm = TM_DIV; break;
     case OP_MOD: tm = TM_MOD; break;
     case OP_POW: tm = TM_POW; break;
     case OP_UNM: tm = TM_UNM; break;
     case OP_LEN: tm = TM_LEN; break;
-    case OP_LT: tm = TM_LT; break;
-    case OP_LE: tm = TM_LE; break;
+    case OP_LT: case OP_JLT: case OP_JNLT:
+    case OP_LTN: case OP_JLTN: case OP_JNLTN: tm = TM_LT; break;
+    case OP_LE: case OP_JLE: case OP_JNLE: tm = TM_LE; break;
     case OP_CONCAT: tm = TM_CONCAT; break;
     default:
       return NULL;  /* else no useful name can be found */
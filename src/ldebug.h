@@ -13,7 +13,14 @@
 
 #define pcRel(pc, p)	(cast(int, (pc) - (p)->code) - 1)
 
-#define getfuncline(f,pc)	(((f)->lineinfo) ? (f)->lineinfo[pc] : 0)
+/* mark in 'lineinfo' of an instruction with an absolute line */
+#define ABSLINEINFO	(-0x80)
+
+/* largest line delta kept in 'lineinfo' is LIMLINEDIFF - 1 */
+#define LIMLINEDIFF	0x80
+
+/* most instructions between two absolute lines */
+#define MAXIWTHABS	128
 
 #define resethookcount(L)	(L->hookcount = L->basehookcount)
 
@@ -21,6 +28,8 @@
 #define ci_func(ci)		(clLvalue((ci)->func))
 
 
+LUAI_FUNC int luaG_getfuncline (const Proto *f, int pc);
+LUAI_FUNC int luaG_changedline (const Proto *f, int oldpc, int newpc);
 LUAI_FUNC l_noret luaG_typeerror (lua_State *L, const TValue *o,
                                                 const char *opname);
 LUAI_FUNC l_noret luaG_concaterror (lua_State *L, StkId p1, StkId p2);
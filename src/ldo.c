@@ -15,6 +15,7 @@
 #include "lua.h"
 
 #include "lapi.h"
+#include "lcode.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -159,6 +160,11 @@ static void correctstack (lua_State *L, TValue *oldstack) {
 /* some space for error handling */
 #define ERRORSTACKSIZE	(LUAI_MAXSTACK + 200)
 
+/* each shrink lowers the stack high-water mark by 1/LUAI_STACKDECAY */
+#if !defined(LUAI_STACKDECAY)
+#define LUAI_STACKDECAY	8
+#endif
+
 
 void luaD_reallocstack (lua_State *L, int newsize) {
   TValue *oldstack = L->stack;
@@ -181,14 +187,17 @@ void luaD_growstack (lua_State *L, int n) {
   else {
     int needed = cast_int(L->top - L->stack) + n + EXTRA_STACK;
     int newsize = 2 * size;
+    if (needed > L->stackhwm) L->stackhwm = needed;
     if (newsize > LUAI_MAXSTACK) newsize = LUAI_MAXSTACK;
     if (newsize < needed) newsize = needed;
     if (newsize > LUAI_MAXSTACK) {  /* stack overflow? */
       luaD_reallocstack(L, ERRORSTACKSIZE);
       luaG_runerror(L, "stack overflow");
     }
-    else
+    else {
       luaD_reallocstack(L, newsize);
+      G(L)->gcst.s.stackgrows++;
+    }
   }
 }
 
@@ -204,15 +213,37 @@ static int stackinuse (lua_State *L) {
 }
 
 
+/*
+** The stack is sized for its high-water mark 'stackhwm', not for what
+** is in use right now. The mark is raised when the stack grows and by
+** the collector, which sees how far the stack was used since the last
+** cycle when it clears the dead part of it ('traversestack'). Each
+** call (once per collection cycle and after errors) then lowers the
+** mark by 1/LUAI_STACKDECAY, so that a stack used less deeply shrinks
+** after a few cycles; the stack is only reallocated when it is at least
+** twice as large as the mark asks for. A coroutine that keeps going
+** back to the same depth keeps its stack instead of shrinking it at
+** every cycle and growing it again right after.
+*/
 void luaD_shrinkstack (lua_State *L) {
   int inuse = stackinuse(L);
-  int goodsize = inuse + (inuse / 8) + 2*EXTRA_STACK;
+  int hwm = L->stackhwm;
+  int goodsize;
+  luaE_freeCI(L);  /* free unused blocks of CallInfo entries */
+  if (hwm < inuse || L->stacksize > LUAI_MAXSTACK)  /* (after overflow, */
+    hwm = inuse;  /* drop the error stack at once) */
+  L->stackhwm = hwm - hwm / LUAI_STACKDECAY;  /* decay for next time */
+  goodsize = hwm + (hwm / 4) + 2*EXTRA_STACK;
+  if (goodsize < G(L)->stackinit) goodsize = G(L)->stackinit;
   if (goodsize > LUAI_MAXSTACK) goodsize = LUAI_MAXSTACK;
   if (inuse > LUAI_MAXSTACK ||  /* handling stack overflow? */
-      goodsize >= L->stacksize)  /* would grow instead of shrink? */
+      (2 * goodsize > L->stacksize &&  /* not worth shrinking? */
+       L->stacksize <= LUAI_MAXSTACK))
     condmovestack(L);  /* don't change stack (change only for debugging) */
-  else
+  else {
     luaD_reallocstack(L, goodsize);  /* shrink it */
+    G(L)->gcst.s.stackshrinks++;
+  }
 }
 
 
@@ -338,6 +369,8 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
       lua_unlock(L);
       n = (*f)(L);  /* do the actual call */
       lua_lock(L);
+      if (L->status == LUA_YIELD)  /* function yielded (see 'lua_yieldk')? */
+        return 1;  /* leave its frame for 'lua_resume' */
       api_checknelems(L, n);
       luaD_poscall(L, L->top - n);
       return 1;
@@ -345,6 +378,10 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
     case LUA_TLCL: {  /* Lua function: prepare its call */
       StkId base;
       Proto *p = clLvalue(func)->p;
+      if (p->lazytext != NULL) {  /* not compiled yet? */
+        luaD_compile(L, p);
+        func = restorestack(L, funcr);
+      }
       n = cast_int(L->top - func) - 1;  /* number of real arguments */
       luaD_checkstack(L, p->maxstacksize);
       for (; n < p->numparams; n++)
@@ -447,7 +484,8 @@ static void finishCcall (lua_State *L) {
         lua_unlock(L);
         n = (*f)(L);  /* do the actual call */
         lua_lock(L);
-        luaD_poscall(L, L->top - n);
+        if (L->status != LUA_YIELD)
+          luaD_poscall(L, L->top - n);
         break;
       }
       case LUA_HOOKRET:
@@ -475,6 +513,8 @@ static void finishCcall (lua_State *L) {
   lua_unlock(L);
   n = (*ci->u.c.k)(L);
   lua_lock(L);
+  if (L->status == LUA_YIELD)  /* continuation yielded again? */
+    return;
   api_checknelems(L, n);
   /* finish 'luaD_precall' */
   luaD_poscall(L, L->top - n);
@@ -486,6 +526,8 @@ static void unroll (lua_State *L, void *ud) {
   for (;;) {
     if (L->ci == &L->base_ci)  /* stack is empty? */
       return;  /* coroutine finished normally */
+    if (L->status == LUA_YIELD)  /* yielded without a C boundary? */
+      return;
     if ((L->ci->callstatus & CIST_ERRH) || G(L)->haltstate)  /* error handler yielded? */
       luaD_throw(L, LUA_ERRRUN);  /* finish throwing error */
     if (!isLua(L->ci))  /* C function? */
@@ -564,8 +606,10 @@ static void resume (lua_State *L, void *ud) {
   else {  /* resuming from previous yield */
     L->status = LUA_OK;
     ci->func = restorestack(L, ci->extra);
-    if (isLua(ci))  /* yielded inside a hook? */
+    if (isLua(ci)) {  /* yielded inside a hook or preempted? */
+      L->top = firstArg;  /* such yields take no values */
       luaV_execute(L);  /* just continue running Lua code */
+    }
     else {  /* 'common' yield */
       if (ci->u.c.k != NULL) {  /* does it have a continuation? */
         int n;
@@ -574,6 +618,8 @@ static void resume (lua_State *L, void *ud) {
         lua_unlock(L);
         n = (*ci->u.c.k)(L);  /* call continuation */
         lua_lock(L);
+        if (L->status == LUA_YIELD)  /* continuation yielded again? */
+          return;
         api_checknelems(L, n);
         firstArg = L->top - n;  /* yield results come from continuation */
       }
@@ -585,10 +631,83 @@ static void resume (lua_State *L, void *ud) {
 }
 
 
+/*
+** {======================================================
+** Accounting of resumes
+** =======================================================
+*/
+
+/*
+** clocks used to account resumes, in seconds. POSIX systems use a
+** monotonic clock and the CPU time of the calling OS thread; other
+** systems use 'clock' for both.
+*/
+#if !defined(luai_wallclock)
+#include <time.h>
+#if defined(LUA_USE_POSIX)
+static double luai_wallclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static double luai_cpuclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+#else
+#define luai_wallclock()	((double)clock() / CLOCKS_PER_SEC)
+#define luai_cpuclock()	((double)clock() / CLOCKS_PER_SEC)
+#endif
+#endif
+
+
+/*
+** charge the time and memory used since the last switch to the thread
+** being charged, and start charging 'L1' (if not NULL); returns the
+** thread that was being charged
+*/
+static lua_State *acctswitch (global_State *g, lua_State *L1) {
+  lua_State *old = g->acctthread;
+  double wall = luai_wallclock();
+  double cpu = luai_cpuclock();
+  if (old != NULL) {
+    old->acct.walltime += wall - g->acctwall;
+    old->acct.cputime += cpu - g->acctcpu;
+    old->acct.allocated += g->allocated - g->acctbytes;
+  }
+  g->acctthread = L1;
+  g->acctwall = wall;
+  g->acctcpu = cpu;
+  g->acctbytes = g->allocated;
+  return old;
+}
+
+
+/*
+** statistics of 'L', including the interval it is being charged now
+*/
+void luaD_threadstats (lua_State *L, lua_ThreadStats *s) {
+  global_State *g = G(L);
+  *s = L->acct;
+  if (g->acctthread == L) {
+    s->walltime += luai_wallclock() - g->acctwall;
+    s->cputime += luai_cpuclock() - g->acctcpu;
+    s->allocated += g->allocated - g->acctbytes;
+  }
+}
+
+/* }====================================================== */
+
+
 LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   int status;
   int oldnny = L->nny;  /* save 'nny' */
+  int accounted;
+  lua_State *charged = NULL;  /* thread charged before this resume */
   lua_lock(L);
+  accounted = G(L)->accounting;
   if (L->hookmask & LUA_MASKRESUME) {
     status = L->status;
     L->status = 0;
@@ -596,16 +715,29 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
     L->status = status;
   }
   luai_userstateresume(L, nargs);
+  if (accounted) {
+    charged = acctswitch(G(L), L);
+    L->acct.resumes++;
+    L->hookmask |= LUAI_MASKACCOUNT;
+  }
   L->nCcalls = (from) ? from->nCcalls + 1 : 1;
+  L->baseCcalls = L->nCcalls;
+  if (from != NULL && (from->hookmask & LUAI_MASKBUDGET))
+    L->hookmask |= LUAI_MASKBUDGET;  /* its instructions count too */
   L->nny = 0;  /* allow yields */
   api_checknelems(L, (L->status == LUA_OK) ? nargs + 1 : nargs);
   status = luaD_rawrunprotected(L, resume, L->top - nargs);
+  if (status == LUA_OK && L->status == LUA_YIELD)  /* yield by return? */
+    status = LUA_YIELD;
   if (status == -1)  /* error calling 'lua_resume'? */
     status = LUA_ERRRUN;
   else {  /* yield or regular error */
     while (status != LUA_OK && status != LUA_YIELD && !G(L)->haltstate) {  /* error? */
-      if (recover(L, status))  /* recover point? */
+      if (recover(L, status)) {  /* recover point? */
         status = luaD_rawrunprotected(L, unroll, NULL);  /* run continuation */
+        if (status == LUA_OK && L->status == LUA_YIELD)
+          status = LUA_YIELD;
+      }
       else {  /* unrecoverable error */
         L->status = cast_byte(status);  /* mark thread as `dead' */
         seterrorobj(L, status, L->top);
@@ -616,6 +748,12 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
     lua_assert(status == L->status);
   }
   L->nny = oldnny;  /* restore 'nny' */
+  if (L != G(L)->budgetthread)
+    L->hookmask &= ~LUAI_MASKBUDGET;
+  if (accounted) {
+    L->hookmask &= ~LUAI_MASKACCOUNT;
+    acctswitch(G(L), charged);
+  }
   L->nCcalls--;
   lua_assert(L->nCcalls == ((from) ? from->nCcalls : 0));
   lua_unlock(L);
@@ -623,6 +761,59 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
 }
 
 
+/*
+** Resume 'L' for at most 'budget' VM instructions, counting those run
+** by the coroutines it resumes. When the budget runs out, 'L' is
+** suspended before its next instruction (once it is not inside a C
+** call or another coroutine) and LUA_PREEMPT is returned; the thread
+** then looks like a coroutine that yielded no values, and a later
+** resume (of any kind, with no arguments) continues its execution.
+*/
+LUA_API int lua_resumebudget (lua_State *L, lua_State *from, int nargs,
+                              int budget) {
+  global_State *g = G(L);
+  l_mem oldbudget;
+  lua_State *oldthread;
+  int status;
+  lua_lock(L);
+  oldbudget = g->budget;
+  oldthread = g->budgetthread;
+  g->budget = budget;
+  g->budgetthread = L;
+  g->preempted = 0;
+  L->hookmask |= LUAI_MASKBUDGET;
+  lua_unlock(L);
+  status = lua_resume(L, from, nargs);
+  lua_lock(L);
+  L->hookmask &= ~LUAI_MASKBUDGET;
+  if (status == LUA_YIELD && g->preempted)
+    status = LUA_PREEMPT;
+  g->preempted = 0;
+  g->budget = oldbudget;
+  g->budgetthread = oldthread;
+  lua_unlock(L);
+  return status;
+}
+
+
+/*
+** called by 'luaV_execute' at an instruction boundary when the budget
+** has run out; returns true if the thread was suspended
+*/
+int luaD_preempt (lua_State *L) {
+  CallInfo *ci = L->ci;
+  if (L != G(L)->budgetthread || L->nCcalls != L->baseCcalls ||
+      L->nny > 0 || !L->allowhook)
+    return 0;  /* cannot suspend here; try again at next instruction */
+  G(L)->preempted = 1;
+  L->status = LUA_YIELD;
+  ci->extra = savestack(L, ci->func);  /* as 'lua_yieldk' does */
+  ci->u.l.savedpc--;  /* instruction will be fetched again */
+  ci->func = L->top - 1;  /* protect stack below results */
+  return 1;
+}
+
+
 LUA_API int lua_isyieldable (lua_State *L) {
   return L->nny == 0;
 }
@@ -650,6 +841,12 @@ LUA_API int lua_yieldk (lua_State *L, int nresults, int ctx, lua_CFunction k) {
     if ((ci->u.c.k = k) != NULL)  /* is there a continuation? */
       ci->u.c.ctx = ctx;  /* save context */
     ci->func = L->top - nresults - 1;  /* protect stack below results */
+    if (L->nCcalls == L->baseCcalls && !(ci->callstatus & CIST_HOOKED)) {
+      /* no C calls between 'lua_resume' and this function: callers see
+         the status and return up to 'lua_resume' without a long jump */
+      lua_unlock(L);
+      return 0;
+    }
     luaD_throw(L, LUA_YIELD);
   }
   lua_assert(ci->callstatus & CIST_HOOKED);  /* must be inside a hook */
@@ -691,6 +888,7 @@ struct SParser {  /* data to `f_parser' */
   Dyndata dyd;  /* dynamic structures used by the parser */
   const char *mode;
   const char *name;
+  Proto *f;  /* function to compile (for 'f_compile') */
 };
 
 static void checkmode (lua_State *L, const char *mode, const char *x) {
@@ -712,8 +910,14 @@ static void f_parser (lua_State *L, void *ud) {
     cl = luaU_undump(L, p->z, &p->buff, p->name);
   }
   else {
+    int lazymode = 0;
     checkmode(L, p->mode, "text");
-    cl = luaY_parser(L, p->z, &p->buff, &p->dyd, p->name, c);
+    if (p->mode && strchr(p->mode, 'L'))  /* compile functions when called? */
+      lazymode = LAZY_TEXT | (strchr(p->mode, 'O') ? LAZY_OPTIMIZE : 0);
+    cl = luaY_parser(L, p->z, &p->buff, &p->dyd, p->name, c, lazymode);
+    if (p->mode && strchr(p->mode, 'O'))  /* optimize it? */
+      luaK_optimize(L, cl->l.p);
+    luaK_fuse(L, cl->l.p);
   }
   lua_assert(cl->l.nupvalues == cl->l.p->sizeupvalues);
   for (i = 0; i < cl->l.nupvalues; i++) {  /* initialize upvalues */
@@ -724,23 +928,55 @@ static void f_parser (lua_State *L, void *ud) {
 }
 
 
-int luaD_protectedparser (lua_State *L, ZIO *z, const char *name,
-                                        const char *mode) {
-  struct SParser p;
+/*
+** Compiles a function that a lazy load left as text, right before its
+** first call (see 'luaY_compile'), and optimizes it as its chunk was.
+*/
+static void f_compile (lua_State *L, void *ud) {
+  struct SParser *p = cast(struct SParser *, ud);
+  int lazymode = p->f->lazymode;
+  luaY_compile(L, p->f, &p->buff, &p->dyd);
+  if (lazymode & LAZY_OPTIMIZE)
+    luaK_optimize(L, p->f);
+  luaK_fuse(L, p->f);
+}
+
+
+static int runparser (lua_State *L, Pfunc func, struct SParser *p) {
   int status;
   L->nny++;  /* cannot yield during parsing */
-  p.z = z; p.name = name; p.mode = mode;
-  p.dyd.actvar.arr = NULL; p.dyd.actvar.size = 0;
-  p.dyd.gt.arr = NULL; p.dyd.gt.size = 0;
-  p.dyd.label.arr = NULL; p.dyd.label.size = 0;
-  luaZ_initbuffer(L, &p.buff);
-  status = luaD_pcall(L, f_parser, &p, savestack(L, L->top), L->errfunc);
-  luaZ_freebuffer(L, &p.buff);
-  luaM_freearray(L, p.dyd.actvar.arr, p.dyd.actvar.size);
-  luaM_freearray(L, p.dyd.gt.arr, p.dyd.gt.size);
-  luaM_freearray(L, p.dyd.label.arr, p.dyd.label.size);
+  p->dyd.actvar.arr = NULL; p->dyd.actvar.size = 0;
+  p->dyd.gt.arr = NULL; p->dyd.gt.size = 0;
+  p->dyd.label.arr = NULL; p->dyd.label.size = 0;
+  p->dyd.names.arr = NULL; p->dyd.names.size = 0;
+  luaZ_initbuffer(L, &p->buff);
+  status = luaD_pcall(L, func, p, savestack(L, L->top), L->errfunc);
+  luaZ_freebuffer(L, &p->buff);
+  luaM_freearray(L, p->dyd.actvar.arr, p->dyd.actvar.size);
+  luaM_freearray(L, p->dyd.gt.arr, p->dyd.gt.size);
+  luaM_freearray(L, p->dyd.label.arr, p->dyd.label.size);
+  luaM_freearray(L, p->dyd.names.arr, p->dyd.names.size);
   L->nny--;
   return status;
 }
 
 
+int luaD_protectedparser (lua_State *L, ZIO *z, const char *name,
+                                        const char *mode) {
+  struct SParser p;
+  p.z = z; p.name = name; p.mode = mode; p.f = NULL;
+  return runparser(L, f_parser, &p);
+}
+
+
+/* only fails for lack of memory (the text compiled once already) */
+void luaD_compile (lua_State *L, Proto *f) {
+  struct SParser p;
+  int status;
+  p.z = NULL; p.name = NULL; p.mode = NULL; p.f = f;
+  status = runparser(L, f_compile, &p);
+  if (status != LUA_OK)
+    luaD_throw(L, status);  /* error message is on the stack */
+}
+
+
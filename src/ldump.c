@@ -5,32 +5,43 @@
 */
 
 #include <stddef.h>
-#include <stdint.h>
+#include <string.h>
 
 #define ldump_c
 #define LUA_CORE
 
 #include "lua.h"
 
+#include "ldo.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 #include "lstring.h"
+#include "ltable.h"
 #include "lundump.h"
 
+/* bytes gathered before each call to the writer */
+#define DUMPBUFFER	1024
+
 typedef struct {
  lua_State* L;
  lua_Writer writer;
  void* data;
  int strip;
  int status;
+ Table* strings;		/* index in the chunk of each string written */
+ int nstrings;
+ lu_int32 sum;			/* checksum of what was written */
+ size_t n;			/* bytes in 'buff' */
+ lu_byte buff[DUMPBUFFER];
 } DumpState;
 
 #define DumpMem(b,n,size,D)	DumpBlock(b,(n)*(size),D)
 #define DumpVar(x,D)		DumpMem(&x,1,sizeof(x),D)
 
-static void DumpBlock(const void* b, size_t size, DumpState* D)
+static void DumpWrite(const void* b, size_t size, DumpState* D)
 {
- if (D->status==0)
+ if (D->status==0 && size>0)
  {
   lua_unlock(D->L);
   D->status=(*D->writer)(D->L,b,size,D->data);
@@ -38,15 +49,54 @@ static void DumpBlock(const void* b, size_t size, DumpState* D)
  }
 }
 
+static void DumpFlush(DumpState* D)
+{
+ D->sum=luaU_checksum(D->sum,D->buff,D->n);
+ DumpWrite(D->buff,D->n,D);
+ D->n=0;
+}
+
+static void DumpBlock(const void* b, size_t size, DumpState* D)
+{
+ if (D->n+size>DUMPBUFFER)
+ {
+  DumpFlush(D);
+  if (size>DUMPBUFFER)			/* too large to gather */
+  {
+   D->sum=luaU_checksum(D->sum,cast(const lu_byte*,b),size);
+   DumpWrite(b,size,D);
+   return;
+  }
+ }
+ memcpy(D->buff+D->n,b,size);
+ D->n+=size;
+}
+
 static void DumpChar(int y, DumpState* D)
 {
- char x=(char)y;
+ lu_byte x=(lu_byte)y;
  DumpVar(x,D);
 }
 
+/* sizes and other naturals go 7 bits a byte, lowest first */
+static void DumpSize(size_t x, DumpState* D)
+{
+ lu_byte b[(sizeof(size_t)*8+6)/7];
+ int n=0;
+ do
+ {
+  b[n]=cast_byte(x&0x7f);
+  x>>=7;
+  if (x!=0) b[n]|=0x80;
+  n++;
+ } while (x!=0);
+ DumpBlock(b,n,D);
+}
+
 static void DumpInt(int x, DumpState* D)
 {
- DumpVar(x,D);
+ lua_assert(x>=0);
+ DumpSize(cast(size_t,x),D);
 }
 
 static void DumpNumber(lua_Number x, DumpState* D)
@@ -60,64 +110,105 @@ static void DumpVector(const void* b, int n, size_t size, DumpState* D)
  DumpMem(b,n,size,D);
 }
 
+/*
+** strings go by their index in the chunk (0 for NULL); a string not
+** written before gets the next index and its contents follow
+*/
 static void DumpString(const TString* s, DumpState* D)
 {
+ TValue key;
+ const TValue* o;
  if (s==NULL)
  {
-  uint32_t size=0;
-  DumpVar(size,D);
- }
- else if ((s->tss.tt & 0x3F) == LUA_TROPSTR)
- {
-  TString *ss = luaS_build(D->L, s);
-  uint32_t size=ss->tsv.len+1;		/* include trailing '\0' */
-  DumpVar(size,D);
-  DumpBlock(getstr(ss),size*sizeof(char),D);
+  DumpSize(0,D);
+  return;
  }
+ if ((s->tss.tt & 0x3F) == LUA_TROPSTR)
+  s=luaS_build(D->L,cast(TString*,s));
  else if ((s->tss.tt & 0x3F) == LUA_TSUBSTR)
- {
-  uint8_t null = 0;
-  uint32_t size=s->tss.len+1;		/* include trailing '\0' */
-  DumpVar(size,D);
-  DumpBlock(getstr(s->tss.str)+s->tss.offset*sizeof(char),(size-1)*sizeof(char),D);
-  DumpBlock(&null, 1, D);
- }
+  s=luaS_newlstr(D->L,getstr(s->tss.str)+s->tss.offset,s->tss.len);
+ setsvalue(D->L,&key,cast(TString*,s));
+ o=luaH_get(D->L,D->strings,&key);
+ if (ttisnumber(o))
+  DumpSize(cast(size_t,nvalue(o)),D);
  else
  {
-  uint32_t size=s->tsv.len+1;		/* include trailing '\0' */
-  DumpVar(size,D);
-  DumpBlock(getstr(s),size*sizeof(char),D);
+  setnvalue(luaH_set(D->L,D->strings,&key),cast_num(++D->nstrings));
+  DumpInt(D->nstrings,D);
+  DumpSize(s->tsv.len,D);
+  DumpBlock(getstr(s),s->tsv.len*sizeof(char),D);
  }
 }
 
-#define DumpCode(f,D)	 DumpVector(f->code,f->sizecode,sizeof(Instruction),D)
-
-static void DumpFunction(const Proto* f, DumpState* D);
-
-static void DumpConstants(const Proto* f, DumpState* D)
+/* the VM quickens instructions in place; dump their generic opcodes */
+static void DumpCode(const Proto* f, DumpState* D)
 {
- int i,n=f->sizek;
+ int i,n=f->sizecode;
  DumpInt(n,D);
  for (i=0; i<n; i++)
  {
-  const TValue* o=&f->k[i];
-  DumpChar(ttypenv(o),D);
-  switch (ttypenv(o))
+  Instruction c=f->code[i];
+  switch (GET_OPCODE(c))
   {
-   case LUA_TNIL:
+   case OP_ADDN:  SET_OPCODE(c,OP_ADD); break;
+   case OP_SUBN:  SET_OPCODE(c,OP_SUB); break;
+   case OP_MULN:  SET_OPCODE(c,OP_MUL); break;
+   case OP_LTN:   SET_OPCODE(c,OP_LT); break;
+   case OP_JLTN:  SET_OPCODE(c,OP_JLT); break;
+   case OP_JNLTN: SET_OPCODE(c,OP_JNLT); break;
+   default: break;
+  }
+  DumpVar(c,D);
+ }
+}
+
+static void DumpFunction(const Proto* f, DumpState* D);
+
+/* is 'x' an integer small enough for LUAC_TINT (and not -0)? */
+static int isint(lua_Number x, int* i)
+{
+ if (!(x>=-(lua_Number)INT_MAX && x<=(lua_Number)INT_MAX)) return 0;
+ *i=cast_int(x);
+ return cast_num(*i)==x && (*i!=0 || 1/x>0);
+}
+
+static void DumpValue(const TValue* o, DumpState* D)
+{
+ int i;
+ switch (ttypenv(o))
+ {
+  case LUA_TNIL:
+	DumpChar(LUA_TNIL,D);
 	break;
-   case LUA_TBOOLEAN:
+  case LUA_TBOOLEAN:
+	DumpChar(LUA_TBOOLEAN,D);
 	DumpChar(bvalue(o),D);
 	break;
-   case LUA_TNUMBER:
-	DumpNumber(nvalue(o),D);
+  case LUA_TNUMBER:
+	if (isint(nvalue(o),&i))		/* zigzag, so small negatives stay small */
+	{
+	 DumpChar(LUAC_TINT,D);
+	 DumpSize((i<0) ? 2*(size_t)(-(i+1))+1 : 2*(size_t)i,D);
+	}
+	else
+	{
+	 DumpChar(LUA_TNUMBER,D);
+	 DumpNumber(nvalue(o),D);
+	}
 	break;
-   case LUA_TSTRING:
+  case LUA_TSTRING:
+	DumpChar(LUA_TSTRING,D);
 	DumpString(rawtsvalue(o),D);
 	break;
-    default: lua_assert(0);
-  }
+   default: lua_assert(0);
  }
+}
+
+static void DumpConstants(const Proto* f, DumpState* D)
+{
+ int i,n=f->sizek;
+ DumpInt(n,D);
+ for (i=0; i<n; i++) DumpValue(&f->k[i],D);
  n=f->sizep;
  DumpInt(n,D);
  for (i=0; i<n; i++) DumpFunction(f->p[i],D);
@@ -131,16 +222,53 @@ static void DumpUpvalues(const Proto* f, DumpState* D)
  {
   DumpChar(f->upvalues[i].instack,D);
   DumpChar(f->upvalues[i].idx,D);
+  DumpChar(f->upvalues[i].byvalue,D);
+ }
+}
+
+/*
+** a template is written as its contents; the loader builds the table
+** again, as the hashes of its keys depend on the state
+*/
+static void DumpTemplates(const Proto* f, DumpState* D)
+{
+ int i,j,n=f->sizetemplates;
+ DumpInt(n,D);
+ for (i=0; i<n; i++)
+ {
+  const Table* t=f->templates[i];
+  int size=sizenode(t);
+  int count=0;
+  DumpInt(t->sizearray,D);
+  for (j=0; j<t->sizearray; j++) DumpValue(&t->array[j],D);
+  for (j=0; j<size; j++) if (!ttisnil(gval(gnode(t,j)))) count++;
+  DumpInt((count>0) ? size : 0,D);
+  DumpInt(count,D);
+  for (j=0; j<size; j++)
+  {
+   const Node* node=gnode(t,j);
+   if (ttisnil(gval(node))) continue;
+   DumpValue(gkey(node),D);
+   DumpValue(gval(node),D);
+  }
  }
 }
 
+/* a stripped chunk has no debug section at all (see DumpHeader) */
 static void DumpDebug(const Proto* f, DumpState* D)
 {
  int i,n;
- DumpString((D->strip) ? NULL : f->source,D);
- n= (D->strip) ? 0 : f->sizelineinfo;
- DumpVector(f->lineinfo,n,sizeof(int),D);
- n= (D->strip) ? 0 : f->sizelocvars;
+ if (D->strip) return;
+ DumpString(f->source,D);
+ DumpVector(f->lineinfo,f->sizelineinfo,sizeof(ls_byte),D);
+ n=f->sizeabslineinfo;
+ DumpInt(n,D);
+ for (i=0; i<n; i++)			/* each pc after the one before */
+ {
+  DumpInt(f->abslineinfo[i].pc-((i>0) ? f->abslineinfo[i-1].pc : 0),D);
+  DumpInt(f->abslineinfo[i].line,D);
+ }
+ n=f->sizelocvars;
  DumpInt(n,D);
  for (i=0; i<n; i++)
  {
@@ -148,13 +276,12 @@ static void DumpDebug(const Proto* f, DumpState* D)
   DumpInt(f->locvars[i].startpc,D);
   DumpInt(f->locvars[i].endpc,D);
  }
- n= (D->strip) ? 0 : f->sizeupvalues;
- DumpInt(n,D);
- for (i=0; i<n; i++) DumpString(f->upvalues[i].name,D);
+ for (i=0; i<f->sizeupvalues; i++) DumpString(f->upvalues[i].name,D);
 }
 
 static void DumpFunction(const Proto* f, DumpState* D)
 {
+ lua_assert(f->lazytext==NULL);
  DumpInt(f->linedefined,D);
  DumpInt(f->lastlinedefined,D);
  DumpChar(f->numparams,D);
@@ -163,14 +290,29 @@ static void DumpFunction(const Proto* f, DumpState* D)
  DumpCode(f,D);
  DumpConstants(f,D);
  DumpUpvalues(f,D);
+ DumpTemplates(f,D);
  DumpDebug(f,D);
 }
 
+/* the checksum covers what follows the header */
 static void DumpHeader(DumpState* D)
 {
  lu_byte h[LUAC_HEADERSIZE];
  luaU_header(h);
- DumpBlock(h,LUAC_HEADERSIZE,D);
+ DumpWrite(h,LUAC_HEADERSIZE,D);
+ DumpChar(D->strip,D);
+}
+
+/* the checksum goes last, lowest byte first */
+static void DumpChecksum(DumpState* D)
+{
+ lu_byte b[4];
+ lu_int32 sum;
+ int i;
+ DumpFlush(D);
+ sum=D->sum;
+ for (i=0; i<4; i++, sum>>=8) b[i]=cast_byte(sum&0xff);
+ DumpWrite(b,4,D);
 }
 
 /*
@@ -179,12 +321,24 @@ static void DumpHeader(DumpState* D)
 int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip)
 {
  DumpState D;
+ ptrdiff_t slot=savestack(L,L->top);
+ StkId p;
  D.L=L;
  D.writer=w;
  D.data=data;
  D.strip=strip;
  D.status=0;
+ D.strings=luaH_new(L);
+ D.nstrings=0;
+ D.sum=1;
+ D.n=0;
+ sethvalue(L,L->top,D.strings);		/* anchor it */
+ incr_top(L);
  DumpHeader(&D);
  DumpFunction(f,&D);
+ DumpChecksum(&D);
+ /* the writer may leave values above the table (as a luaL_Buffer does) */
+ for (p=restorestack(L,slot); p+1<L->top; p++) setobjs2s(L,p,p+1);
+ L->top--;
  return D.status;
 }
@@ -0,0 +1,301 @@
+// Lock-free event queue for Lua
+extern "C" {
+#include "lua.h"
+#include "luaconf.h"
+#include "lstate.h"
+}
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// Events are built by the producer in its own memory (never the Lua
+// heap) as a byte string of tagged values:
+//   nil, false, true     tag only
+//   number               tag, lua_Number
+//   string               tag, length (varint), bytes
+//   table                tag, number of pairs (varint), 2n values
+// and are turned into Lua values only when the state drains them.
+enum { EV_NIL, EV_FALSE, EV_TRUE, EV_NUMBER, EV_STRING, EV_TABLE };
+
+struct lua_Event {
+    std::atomic<lua_Event*> next;
+    int nvalues;  // values at the top level of the event
+    size_t intable;  // keys and values still owed to the open table
+    int failed;  // a value could not be added (out of memory)
+    size_t len, size;
+    unsigned char *buff;
+};
+
+// Multi-producer single-consumer queue (Vyukov): a producer links its
+// node with one exchange on 'head'; the consumer, which holds the state
+// lock, unlinks from 'tail'. 'stub' keeps the list from ever being
+// empty.
+struct EventQueue {
+    std::atomic<lua_Event*> head;
+    lua_Event *tail;
+    lua_Event stub;
+    std::atomic<size_t> count;
+};
+
+#define toqueue(L) ((EventQueue*)G(L)->events)
+
+static void enqueue(EventQueue *q, lua_Event *ev) {
+    ev->next.store(NULL, std::memory_order_relaxed);
+    lua_Event *prev = q->head.exchange(ev, std::memory_order_acq_rel);
+    prev->next.store(ev, std::memory_order_release);
+}
+
+// returns NULL when the queue is empty or a producer is half-way
+// through 'enqueue' (its event is picked up by the next drain)
+static lua_Event *dequeue(EventQueue *q) {
+    lua_Event *tail = q->tail;
+    lua_Event *next = tail->next.load(std::memory_order_acquire);
+    if (tail == &q->stub) {
+        if (next == NULL) return NULL;
+        q->tail = tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != q->head.load(std::memory_order_acquire)) return NULL;
+    enqueue(q, &q->stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void freeevent(lua_Event *ev) {
+    free(ev->buff);
+    free(ev);
+}
+
+static unsigned char *reserve(lua_Event *ev, size_t n) {
+    if (ev->len + n > ev->size) {
+        size_t size = ev->size * 2;
+        unsigned char *buff;
+        if (size < ev->len + n) size = ev->len + n;
+        buff = (unsigned char*)realloc(ev->buff, size);
+        if (buff == NULL) return NULL;
+        ev->buff = buff;
+        ev->size = size;
+    }
+    unsigned char *p = ev->buff + ev->len;
+    ev->len += n;
+    return p;
+}
+
+static size_t putsize(unsigned char *p, size_t n) {
+    size_t i = 0;
+    while (n >= 0x80) {
+        p[i++] = (unsigned char)(n | 0x80);
+        n >>= 7;
+    }
+    p[i++] = (unsigned char)n;
+    return i;
+}
+
+// starts a value; returns where its payload goes, or NULL on failure
+static unsigned char *putvalue(lua_Event *ev, int tag, size_t payload) {
+    unsigned char *p = reserve(ev, 1 + payload);
+    if (p == NULL) {
+        ev->failed = 1;
+        return NULL;
+    }
+    *p = (unsigned char)tag;
+    if (ev->intable > 0) ev->intable--;
+    else ev->nvalues++;
+    return p + 1;
+}
+
+static size_t getsize(const unsigned char **p) {
+    size_t n = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+        c = *(*p)++;
+        n |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return n;
+}
+
+// pushes the value at '*p' (tables only hold scalars)
+static void getvalue(lua_State *L, const unsigned char **p) {
+    switch (*(*p)++) {
+        case EV_FALSE: lua_pushboolean(L, 0); break;
+        case EV_TRUE: lua_pushboolean(L, 1); break;
+        case EV_NUMBER: {
+            lua_Number n;
+            memcpy(&n, *p, sizeof(n));
+            *p += sizeof(n);
+            lua_pushnumber(L, n);
+            break;
+        }
+        case EV_STRING: {
+            size_t l = getsize(p);
+            lua_pushlstring(L, (const char*)*p, l);
+            *p += l;
+            break;
+        }
+        case EV_TABLE: {
+            size_t n = getsize(p);
+            lua_createtable(L, 0, (int)n);
+            while (n-- > 0) {
+                getvalue(L, p);
+                getvalue(L, p);
+                if (lua_isnil(L, -2) || lua_tonumber(L, -2) != lua_tonumber(L, -2))
+                    lua_pop(L, 2);  // nil or NaN key: drop the pair
+                else
+                    lua_rawset(L, -3);
+            }
+            break;
+        }
+        default: lua_pushnil(L); break;
+    }
+}
+
+struct Drain {
+    EventQueue *q;
+    lua_Event *ev;  // event being turned into Lua values
+    int max, n, i;
+};
+
+// builds the sequence of lua_drainevents; runs under lua_pcall, so a
+// memory error cannot leave the lock scope of its caller open
+static int drain(lua_State *L) {
+    Drain *d = (Drain*)lua_touserdata(L, 1);
+    lua_createtable(L, d->n, 0);
+    while (d->i != d->max && (d->ev = dequeue(d->q)) != NULL) {
+        const unsigned char *p = d->ev->buff;
+        int j;
+        d->q->count.fetch_sub(1, std::memory_order_relaxed);
+        lua_createtable(L, d->ev->nvalues, 1);
+        for (j = 1; j <= d->ev->nvalues; j++) {
+            getvalue(L, &p);
+            lua_rawseti(L, -2, j);
+        }
+        lua_pushinteger(L, d->ev->nvalues);
+        lua_setfield(L, -2, "n");
+        lua_rawseti(L, -2, ++d->i);
+        freeevent(d->ev);
+        d->ev = NULL;
+    }
+    return 1;
+}
+
+extern "C" {
+    void * _lua_neweventqueue() {
+        EventQueue *q = new EventQueue;
+        q->stub.next.store(NULL);
+        q->head.store(&q->stub);
+        q->tail = &q->stub;
+        q->count.store(0);
+        return q;
+    }
+
+    void _lua_freeeventqueue(void * p) {
+        EventQueue *q = (EventQueue*)p;
+        lua_Event *ev;
+        while ((ev = dequeue(q)) != NULL) freeevent(ev);
+        delete q;
+    }
+
+    LUA_API lua_Event * lua_newevent(void) {
+        lua_Event *ev = (lua_Event*)malloc(sizeof(lua_Event));
+        if (ev == NULL) return NULL;
+        new (&ev->next) std::atomic<lua_Event*>(NULL);
+        ev->nvalues = 0;
+        ev->intable = 0;
+        ev->failed = 0;
+        ev->len = ev->size = 0;
+        ev->buff = NULL;
+        return ev;
+    }
+
+    LUA_API void lua_eventnil(lua_Event *ev) {
+        putvalue(ev, EV_NIL, 0);
+    }
+
+    LUA_API void lua_eventboolean(lua_Event *ev, int b) {
+        putvalue(ev, b ? EV_TRUE : EV_FALSE, 0);
+    }
+
+    LUA_API void lua_eventnumber(lua_Event *ev, lua_Number n) {
+        unsigned char *p = putvalue(ev, EV_NUMBER, sizeof(n));
+        if (p != NULL) memcpy(p, &n, sizeof(n));
+    }
+
+    LUA_API void lua_eventstring(lua_Event *ev, const char *s, size_t l) {
+        unsigned char size[sizeof(size_t) * 8 / 7 + 1];
+        size_t n = putsize(size, l);
+        unsigned char *p = putvalue(ev, EV_STRING, n + l);
+        if (p == NULL) return;
+        memcpy(p, size, n);
+        memcpy(p + n, s, l);
+    }
+
+    // The next 2n values added are the keys and values of the table.
+    // Tables do not nest: returns 0 (adding nothing) inside a table.
+    LUA_API int lua_eventtable(lua_Event *ev, int n) {
+        unsigned char size[sizeof(size_t) * 8 / 7 + 1];
+        size_t l;
+        unsigned char *p;
+        if (ev->intable > 0 || n < 0) return 0;
+        l = putsize(size, (size_t)n);
+        p = putvalue(ev, EV_TABLE, l);
+        if (p == NULL) return 0;
+        memcpy(p, size, l);
+        ev->intable = (size_t)n * 2;
+        return 1;
+    }
+
+    // Hands the event over to the state; may be called from any thread
+    // without the state lock. Returns 0 (and frees the event) if it
+    // could not be built completely.
+    LUA_API int lua_postevent(lua_State *L, lua_Event *ev) {
+        EventQueue *q = toqueue(L);
+        if (ev->failed || ev->intable > 0) {  // incomplete event?
+            freeevent(ev);
+            return 0;
+        }
+        q->count.fetch_add(1, std::memory_order_relaxed);
+        enqueue(q, ev);
+        return 1;
+    }
+
+    LUA_API int lua_pendingevents(lua_State *L) {
+        return (int)toqueue(L)->count.load(std::memory_order_relaxed);
+    }
+
+    // Pushes a sequence with up to 'max' events (all of them if 'max' is
+    // negative) in the order they were posted; each event is a sequence
+    // of its values with their number in field 'n'. Returns the number
+    // of events drained. On a memory error the events taken so far are
+    // lost and the error is raised after the lock scope is closed.
+    LUA_API int lua_drainevents(lua_State *L, int max) {
+        Drain d;
+        int status;
+        d.q = toqueue(L);
+        d.ev = NULL;
+        d.max = max;
+        d.i = 0;
+        d.n = (int)d.q->count.load(std::memory_order_relaxed);
+        if (max >= 0 && max < d.n) d.n = max;
+        lua_pushcfunction(L, drain);  // (may allocate, so outside the scope)
+        lua_pushlightuserdata(L, &d);
+        lua_lockscope_begin(L);  // one acquisition for the whole batch
+        status = lua_pcall(L, 1, 1, 0);
+        lua_lockscope_end(L);
+        if (status != LUA_OK) {
+            if (d.ev != NULL) freeevent(d.ev);
+            lua_error(L);  // error message is on the top; relocks to throw
+        }
+        return d.i;
+    }
+}
@@ -27,10 +27,15 @@ Closure *luaF_newCclosure (lua_State *L, int n) {
 }
 
 
-Closure *luaF_newLclosure (lua_State *L, int n) {
-  Closure *c = &luaC_newobj(L, LUA_TLCL, sizeLclosure(n), NULL, 0)->cl;
+/*
+** creates a Lua closure with room for 'nv' of its 'n' upvalues to be
+** closed inside it (see 'ownupvals')
+*/
+Closure *luaF_newLclosure (lua_State *L, int n, int nv) {
+  Closure *c = &luaC_newobj(L, LUA_TLCL, sizeLclosure(n, nv), NULL, 0)->cl;
   c->l.p = NULL;
   c->l.nupvalues = cast_byte(n);
+  c->l.nvalues = cast_byte(nv);
   while (n--) c->l.upvals[n] = NULL;
   return c;
 }
@@ -118,6 +123,8 @@ Proto *luaF_newproto (lua_State *L) {
   f->sizecode = 0;
   f->lineinfo = NULL;
   f->sizelineinfo = 0;
+  f->abslineinfo = NULL;
+  f->sizeabslineinfo = 0;
   f->upvalues = NULL;
   f->sizeupvalues = 0;
   f->numparams = 0;
@@ -125,6 +132,14 @@ Proto *luaF_newproto (lua_State *L) {
   f->maxstacksize = 0;
   f->locvars = NULL;
   f->sizelocvars = 0;
+  f->switches = NULL;
+  f->sizeswitches = 0;
+  f->templates = NULL;
+  f->sizetemplates = 0;
+  f->lazytext = NULL;
+  f->lazypos = 0;
+  f->lazyline = 0;
+  f->lazymode = 0;
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
@@ -137,8 +152,11 @@ void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
   luaM_freearray(L, f->lineinfo, f->sizelineinfo);
+  luaM_freearray(L, f->abslineinfo, f->sizeabslineinfo);
   luaM_freearray(L, f->locvars, f->sizelocvars);
   luaM_freearray(L, f->upvalues, f->sizeupvalues);
+  luaM_freearray(L, f->switches, f->sizeswitches);
+  luaM_freearray(L, f->templates, f->sizetemplates);
   luaM_free(L, f);
 }
 
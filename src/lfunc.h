@@ -14,13 +14,29 @@
 #define sizeCclosure(n)	(cast(int, sizeof(CClosure)) + \
                          cast(int, sizeof(TValue)*((n)-1)))
 
-#define sizeLclosure(n)	(cast(int, sizeof(LClosure)) + \
+#define sizeLclosure(n,v)	(((v) == 0) ? upvalsoffset(n) : \
+                         valuesoffset(n) + cast(int, sizeof(UpVal)*(v)))
+
+#define upvalsoffset(n)	(cast(int, sizeof(LClosure)) + \
                          cast(int, sizeof(TValue *)*((n)-1)))
+#define valuesoffset(n)	cast(int, (upvalsoffset(n) + sizeof(L_Umaxalign) - 1) & \
+                                  ~(sizeof(L_Umaxalign) - 1))
+
+/*
+** Upvalues captured by value ('nvalues' of them) are closed upvalues
+** kept in the closure itself, after its list of upvalues. They are not
+** collectable objects: the collector marks their values through the
+** closure, and barriers for them go through the closure too.
+*/
+#define ownupvals(cl)	cast(UpVal *, cast(char *, (cl)) + \
+                                      valuesoffset((cl)->nupvalues))
+#define isownupval(cl,uv)	((uv) >= ownupvals(cl) && \
+                         (uv) < ownupvals(cl) + (cl)->nvalues)
 
 
 LUAI_FUNC Proto *luaF_newproto (lua_State *L);
 LUAI_FUNC Closure *luaF_newCclosure (lua_State *L, int nelems);
-LUAI_FUNC Closure *luaF_newLclosure (lua_State *L, int nelems);
+LUAI_FUNC Closure *luaF_newLclosure (lua_State *L, int nelems, int nvalues);
 LUAI_FUNC UpVal *luaF_newupval (lua_State *L);
 LUAI_FUNC UpVal *luaF_findupval (lua_State *L, StkId level);
 LUAI_FUNC void luaF_close (lua_State *L, StkId level);
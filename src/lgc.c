@@ -51,6 +51,25 @@
 #define PAUSEADJ		100
 
 
+/*
+** clock used to time collector phases and steps, in seconds. POSIX
+** systems use a monotonic clock, as 'clock' is too coarse to measure
+** single steps.
+*/
+#if !defined(luai_gcclock)
+#include <time.h>
+#if defined(LUA_USE_POSIX)
+static double luai_gcclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+#else
+#define luai_gcclock()	((double)clock() / CLOCKS_PER_SEC)
+#endif
+#endif
+
+
 /*
 ** 'makewhite' erases all color bits plus the old bit and then
 ** sets only the current white bit
@@ -78,6 +97,9 @@
 #define markobject(g,t) { if ((t) && iswhite(obj2gco(t))) \
 		reallymarkobject(g, obj2gco(t)); }
 
+/* count 'n' bytes of live objects of kind 'k' in current cycle */
+#define countlive(g,k,n)	((g)->gcst.live[k] += (n))
+
 static void reallymarkobject (global_State *g, GCObject *o);
 
 
@@ -212,7 +234,7 @@ void luaC_checkupvalcolor (global_State *g, UpVal *uv) {
 GCObject *luaC_newobj (lua_State *L, int tt, size_t sz, GCObject **list,
                        int offset) {
   global_State *g = G(L);
-  char *raw = cast(char *, luaM_newobject(L, novariant(tt), sz));
+  char *raw = cast(char *, luaM_newobject(L, tt, sz));
   GCObject *o = obj2gco(raw + offset);
   if (list == NULL)
     list = &g->allgc;  /* standard list for collectable objects */
@@ -247,14 +269,17 @@ static void reallymarkobject (global_State *g, GCObject *o) {
     case LUA_TSHRSTR:
     case LUA_TLNGSTR: {
       size = sizestring(gco2ts(o));
+      countlive(g, LUA_GCKSTRING, size);
       break;  /* nothing else to mark; make it black */
     }
     case LUA_TROPSTR: {
+      countlive(g, LUA_GCKROPE, sizeof(TString));
       gco2tr(o)->gclist = g->gray;
       g->gray = o;
       return;
     }
     case LUA_TSUBSTR: {
+      countlive(g, LUA_GCKSUBSTR, sizeof(TString));
       gco2ss(o)->gclist = g->gray;
       g->gray = o;
       return;
@@ -264,36 +289,44 @@ static void reallymarkobject (global_State *g, GCObject *o) {
       markobject(g, mt);
       markobject(g, gco2u(o)->env);
       size = sizeudata(gco2u(o));
+      countlive(g, LUA_GCKUDATA, size);
       break;
     }
     case LUA_TUPVAL: {
       UpVal *uv = gco2uv(o);
       markvalue(g, uv->v);
+      countlive(g, LUA_GCKUPVAL, sizeof(UpVal));
       if (uv->v != &uv->u.value)  /* open? */
         return;  /* open upvalues remain gray */
       size = sizeof(UpVal);
       break;
     }
     case LUA_TLCL: {
+      LClosure *cl = gco2lcl(o);
+      countlive(g, LUA_GCKLCL, sizeLclosure(cl->nupvalues, cl->nvalues));
       gco2lcl(o)->gclist = g->gray;
       g->gray = o;
       return;
     }
     case LUA_TCCL: {
+      countlive(g, LUA_GCKCCL, sizeCclosure(gco2ccl(o)->nupvalues));
       gco2ccl(o)->gclist = g->gray;
       g->gray = o;
       return;
     }
     case LUA_TTABLE: {
+      countlive(g, LUA_GCKTABLE, sizetable(gco2t(o)));
       linktable(gco2t(o), &g->gray);
       return;
     }
     case LUA_TTHREAD: {
+      countlive(g, LUA_GCKTHREAD, sizethread(gco2th(o)));
       gco2th(o)->gclist = g->gray;
       g->gray = o;
       return;
     }
     case LUA_TPROTO: {
+      countlive(g, LUA_GCKPROTO, sizeproto(gco2p(o)));
       gco2p(o)->gclist = g->gray;
       g->gray = o;
       return;
@@ -345,6 +378,7 @@ static void remarkupvals (global_State *g) {
 ** incremental (or full) collection
 */
 static void restartcollection (global_State *g) {
+  memset(g->gcst.live, 0, sizeof(g->gcst.live));
   g->gray = g->grayagain = NULL;
   g->weak = g->allweak = g->ephemeron = NULL;
   markobject(g, g->mainthread);
@@ -459,8 +493,7 @@ static lu_mem traversetable (global_State *g, Table *h) {
   }
   else  /* not weak */
     traversestrongtable(g, h);
-  return sizeof(Table) + sizeof(TValue) * h->sizearray +
-                         sizeof(Node) * cast(size_t, sizenode(h));
+  return sizetable(h);
 }
 
 
@@ -469,6 +502,7 @@ static int traverseproto (global_State *g, Proto *f) {
   if (f->cache && iswhite(obj2gco(f->cache)))
     f->cache = NULL;  /* allow cache to be collected */
   markobject(g, f->source);
+  markobject(g, f->lazytext);  /* text of a function not compiled yet */
   for (i = 0; i < f->sizek; i++)  /* mark literals */
     markvalue(g, &f->k[i]);
   for (i = 0; i < f->sizeupvalues; i++)  /* mark upvalue names */
@@ -477,12 +511,11 @@ static int traverseproto (global_State *g, Proto *f) {
     markobject(g, f->p[i]);
   for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
     markobject(g, f->locvars[i].varname);
-  return sizeof(Proto) + sizeof(Instruction) * f->sizecode +
-                         sizeof(Proto *) * f->sizep +
-                         sizeof(TValue) * f->sizek +
-                         sizeof(int) * f->sizelineinfo +
-                         sizeof(LocVar) * f->sizelocvars +
-                         sizeof(Upvaldesc) * f->sizeupvalues;
+  for (i = 0; i < f->sizeswitches; i++)  /* mark jump maps */
+    markobject(g, f->switches[i]);
+  for (i = 0; i < f->sizetemplates; i++)  /* mark table templates */
+    markobject(g, f->templates[i]);
+  return sizeproto(f);
 }
 
 
@@ -496,9 +529,13 @@ static lu_mem traverseCclosure (global_State *g, CClosure *cl) {
 static lu_mem traverseLclosure (global_State *g, LClosure *cl) {
   int i;
   markobject(g, cl->p);  /* mark its prototype */
-  for (i = 0; i < cl->nupvalues; i++)  /* mark its upvalues */
-    markobject(g, cl->upvals[i]);
-  return sizeLclosure(cl->nupvalues);
+  for (i = 0; i < cl->nupvalues; i++) {  /* mark its upvalues */
+    if (isownupval(cl, cl->upvals[i])) {  /* kept in the closure? */
+      markvalue(g, cl->upvals[i]->v);
+    }
+    else markobject(g, cl->upvals[i]);
+  }
+  return sizeLclosure(cl->nupvalues, cl->nvalues);
 }
 
 
@@ -511,16 +548,20 @@ static lu_mem traversestack (global_State *g, lua_State *th) {
     markvalue(g, o);
   if (g->gcstate == GCSatomic) {  /* final traversal? */
     StkId lim = th->stack + th->stacksize;  /* real end of stack */
-    for (; o < lim; o++)  /* clear not-marked stack slice */
+    StkId peak = o;  /* end of the slots used since the last clearing */
+    for (; o < lim; o++) {  /* clear not-marked stack slice */
+      if (!ttisnil(o)) peak = o + 1;
       setnilvalue(o);
+    }
+    if (cast_int(peak - th->stack) > th->stackhwm)  /* feed the high-water */
+      th->stackhwm = cast_int(peak - th->stack);  /* mark ('luaD_shrinkstack') */
   }
   else {  /* count call infos to compute size */
     CallInfo *ci;
     for (ci = &th->base_ci; ci != th->ci; ci = ci->next)
       n++;
   }
-  return sizeof(lua_State) + sizeof(TValue) * th->stacksize +
-         sizeof(CallInfo) * n;
+  return sizethread(th) + sizeof(CallInfo) * n;
 }
 
 
@@ -707,30 +748,70 @@ static void clearvalues (global_State *g, GCObject *l, GCObject *f) {
 }
 
 
+/* count 'n' bytes of freed objects of kind 'k' */
+#define countfreed(g,k,n)	((g)->gcst.s.freed[k] += (n))
+
 static void freeobj (lua_State *L, GCObject *o) {
+  global_State *g = G(L);
   switch (gch(o)->tt) {
-    case LUA_TPROTO: luaF_freeproto(L, gco2p(o)); break;
+    case LUA_TPROTO: {
+      countfreed(g, LUA_GCKPROTO, sizeproto(gco2p(o)));
+      luaF_freeproto(L, gco2p(o));
+      break;
+    }
     case LUA_TLCL: {
-      luaM_freemem(L, o, sizeLclosure(gco2lcl(o)->nupvalues));
+      LClosure *cl = gco2lcl(o);
+      lu_mem size = sizeLclosure(cl->nupvalues, cl->nvalues);
+      countfreed(g, LUA_GCKLCL, size);
+      luaM_freemem(L, o, size);
       break;
     }
     case LUA_TCCL: {
-      luaM_freemem(L, o, sizeCclosure(gco2ccl(o)->nupvalues));
+      lu_mem size = sizeCclosure(gco2ccl(o)->nupvalues);
+      countfreed(g, LUA_GCKCCL, size);
+      luaM_freemem(L, o, size);
+      break;
+    }
+    case LUA_TUPVAL: {
+      countfreed(g, LUA_GCKUPVAL, sizeof(UpVal));
+      luaF_freeupval(L, gco2uv(o));
+      break;
+    }
+    case LUA_TTABLE: {
+      countfreed(g, LUA_GCKTABLE, sizetable(gco2t(o)));
+      luaH_free(L, gco2t(o));
+      break;
+    }
+    case LUA_TTHREAD: {
+      countfreed(g, LUA_GCKTHREAD, sizethread(gco2th(o)));
+      luaE_freethread(L, gco2th(o));
+      break;
+    }
+    case LUA_TUSERDATA: {
+      lu_mem size = sizeudata(gco2u(o));
+      countfreed(g, LUA_GCKUDATA, size);
+      luaM_freemem(L, o, size);
       break;
     }
-    case LUA_TUPVAL: luaF_freeupval(L, gco2uv(o)); break;
-    case LUA_TTABLE: luaH_free(L, gco2t(o)); break;
-    case LUA_TTHREAD: luaE_freethread(L, gco2th(o)); break;
-    case LUA_TUSERDATA: luaM_freemem(L, o, sizeudata(gco2u(o))); break;
     case LUA_TSHRSTR:
-      G(L)->strt.nuse--;
+      g->strt.nuse--;
       /* go through */
     case LUA_TLNGSTR: {
-      luaM_freemem(L, o, sizestring(gco2ts(o)));
+      lu_mem size = sizestring(gco2ts(o));
+      countfreed(g, LUA_GCKSTRING, size);
+      luaM_freemem(L, o, size);
+      break;
+    }
+    case LUA_TROPSTR: {
+      countfreed(g, LUA_GCKROPE, sizeof(TString));
+      luaS_freerope(L, gco2tr(o));
+      break;
+    }
+    case LUA_TSUBSTR: {
+      countfreed(g, LUA_GCKSUBSTR, sizeof(TString));
+      luaS_freesubstr(L, gco2ss(o));
       break;
     }
-    case LUA_TROPSTR: luaS_freerope(L, gco2tr(o)); break;
-    case LUA_TSUBSTR: luaS_freesubstr(L, gco2ss(o)); break;
     default: lua_assert(0);
   }
 }
@@ -747,10 +828,11 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count);
 static void sweepthread (lua_State *L, lua_State *L1) {
   if (L1->stack == NULL) return;  /* stack not completely built yet */
   sweepwholelist(L, &L1->openupval);  /* sweep open upvalues */
-  luaE_freeCI(L1);  /* free extra CallInfo slots */
   /* should not change the stack during an emergency gc cycle */
   if (G(L)->gckind != KGC_EMERGENCY)
-    luaD_shrinkstack(L1);
+    luaD_shrinkstack(L1);  /* (also frees extra CallInfo slots) */
+  else
+    luaE_freeCI(L1);  /* free extra CallInfo slots */
 }
 
 
@@ -873,6 +955,9 @@ static void GCTM (lua_State *L, int propagateerrors) {
     status = luaD_pcall(L, dothecall, NULL, savestack(L, L->top - 2), 0);
     L->allowhook = oldah;  /* restore hooks */
     g->gcrunning = running;  /* restore state */
+    g->gcst.s.finalized++;
+    if (status != LUA_OK)
+      g->gcst.s.finalizererrors++;
     if (status != LUA_OK && propagateerrors) {  /* error while running __gc? */
       if (status == LUA_ERRRUN) {  /* is there an error object? */
         const char *msg = (ttisstring(L->top - 1))
@@ -955,6 +1040,63 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
 */
 
 
+/*
+** charge the time elapsed since last mark to the current phase
+*/
+static void phasetick (global_State *g) {
+  double now = luai_gcclock();
+  double dt = now - g->gcst.clock;
+  g->gcst.s.phasetime[g->gcstate] += dt;
+  g->gcst.cycletime[g->gcstate] += dt;
+  g->gcst.clock = now;
+}
+
+
+/*
+** change the collector phase, closing the accounting of the current
+** one; entering 'pause' completes a cycle
+*/
+static void setgcstate (global_State *g, lu_byte s) {
+  phasetick(g);
+  if (s == GCSpause) {
+    GCstats *st = &g->gcst;
+    int i;
+    for (i = 0; i < LUA_GCSTATPHASES; i++) {
+      st->s.lastphasetime[i] = st->cycletime[i];
+      st->cycletime[i] = 0;
+    }
+    st->s.cycles++;
+  }
+  g->gcstate = s;
+}
+
+
+/*
+** start measuring a collector step (returns its start time). Steps
+** are not nested, except for emergency collections; an inner step
+** only hides the time of the outer one spent before it started.
+*/
+static double startstep (global_State *g) {
+  return g->gcst.clock = luai_gcclock();
+}
+
+
+/*
+** finish measuring a collector step, counting it in the pause histogram
+*/
+static void endstep (global_State *g, double start) {
+  double dt, us;
+  int i = 0;
+  phasetick(g);
+  dt = g->gcst.clock - start;
+  for (us = dt * 1e6; us >= 2 && i < LUA_GCSTATBUCKETS - 1; us /= 2)
+    i++;
+  g->gcst.s.pauses[i]++;
+  if (dt > g->gcst.s.maxpause)
+    g->gcst.s.maxpause = dt;
+}
+
+
 /*
 ** set a reasonable "time" to wait before starting a new GC cycle;
 ** cycle will start when memory use hits threshold
@@ -985,7 +1127,7 @@ static void setpause (global_State *g, l_mem estimate) {
 static int entersweep (lua_State *L) {
   global_State *g = G(L);
   int n = 0;
-  g->gcstate = GCSsweepstring;
+  setgcstate(g, GCSsweepstring);
   lua_assert(g->sweepgc == NULL && g->sweepfin == NULL);
   /* prepare to sweep strings, finalizable objects, and regular objects */
   g->sweepstrgc = 0;
@@ -995,15 +1137,20 @@ static int entersweep (lua_State *L) {
 }
 
 
+static void runtilstate (lua_State *L, int statesmask);
+
+
 /*
 ** change GC mode
 */
 void luaC_changemode (lua_State *L, int mode) {
   global_State *g = G(L);
+  double start;
   if (mode == g->gckind) return;  /* nothing to change */
+  start = startstep(g);
   if (mode == KGC_GEN) {  /* change to generational mode */
     /* make sure gray lists are consistent */
-    luaC_runtilstate(L, bitmask(GCSpropagate));
+    runtilstate(L, bitmask(GCSpropagate));
     g->GCestimate = gettotalbytes(g);
     g->gckind = KGC_GEN;
   }
@@ -1012,8 +1159,9 @@ void luaC_changemode (lua_State *L, int mode) {
        (as white has not changed, nothing extra will be collected) */
     g->gckind = KGC_NORMAL;
     entersweep(L);
-    luaC_runtilstate(L, ~sweepphases);
+    runtilstate(L, ~sweepphases);
   }
+  endstep(g, start);
 }
 
 
@@ -1035,6 +1183,8 @@ void luaC_freeallobjects (lua_State *L) {
   separatetobefnz(L, 1);  /* separate all objects with finalizers */
   lua_assert(g->finobj == NULL);
   callallpendingfinalizers(L, 0);
+  if (g->frelease)  /* memory will be released as a whole? */
+    return;  /* no need to free objects (or rope clusters) one by one */
   g->currentwhite = WHITEBITS; /* this "white" makes all objects look dead */
   g->gckind = KGC_NORMAL;
   sweepwholelist(L, &g->finobj);  /* finalizers can create objs. in 'finobj' */
@@ -1049,6 +1199,7 @@ static l_mem atomic (lua_State *L) {
   global_State *g = G(L);
   l_mem work = -cast(l_mem, g->GCmemtrav);  /* start counting work */
   GCObject *origweak, *origall;
+  int i;
   lua_assert(!iswhite(obj2gco(g->mainthread)));
   markobject(g, L);  /* mark running thread */
   /* registry and global metatables may be changed by API */
@@ -1081,6 +1232,8 @@ static l_mem atomic (lua_State *L) {
   clearvalues(g, g->weak, origweak);
   clearvalues(g, g->allweak, origall);
   g->currentwhite = cast_byte(otherwhite(g));  /* flip current white */
+  for (i = 0; i < LUA_GCSTATKINDS; i++)  /* publish live counts */
+    g->gcst.s.live[i] = cast(size_t, g->gcst.live[i]);
   work += g->GCmemtrav;  /* complete counting */
   return work;  /* estimate of memory marked by 'atomic' */
 }
@@ -1098,7 +1251,7 @@ static lu_mem singlestep (lua_State *L) {
         SUBSTR_CLUSTER_SIZE * sizeof(TString);  /* "static" blocks */
       lua_assert(!isgenerational(g));
       restartcollection(g);
-      g->gcstate = GCSpropagate;
+      setgcstate(g, GCSpropagate);
       return g->GCmemtrav;
     }
     case GCSpropagate: {
@@ -1110,7 +1263,7 @@ static lu_mem singlestep (lua_State *L) {
       else {  /* no more `gray' objects */
         lu_mem work;
         int sw;
-        g->gcstate = GCSatomic;  /* finish mark phase */
+        setgcstate(g, GCSatomic);  /* finish mark phase */
         g->GCestimate = g->GCmemtrav;  /* save what was counted */;
         work = atomic(L);  /* add what was traversed by 'atomic' */
         g->GCestimate += work;  /* estimate of total memory traversed */ 
@@ -1124,7 +1277,7 @@ static lu_mem singlestep (lua_State *L) {
         sweepwholelist(L, &g->strt.hash[g->sweepstrgc + i]);
       g->sweepstrgc += i;
       if (g->sweepstrgc >= g->strt.size)  /* no more strings to sweep? */
-        g->gcstate = GCSsweepudata;
+        setgcstate(g, GCSsweepudata);
       return i * GCSWEEPCOST;
     }
     case GCSsweepudata: {
@@ -1133,7 +1286,7 @@ static lu_mem singlestep (lua_State *L) {
         return GCSWEEPMAX*GCSWEEPCOST;
       }
       else {
-        g->gcstate = GCSsweep;
+        setgcstate(g, GCSsweep);
         return 0;
       }
     }
@@ -1148,7 +1301,7 @@ static lu_mem singlestep (lua_State *L) {
         sweeplist(L, &mt, 1);
         checkSizes(L);
         luaS_freeclusters(L);
-        g->gcstate = GCSpause;  /* finish collection */
+        setgcstate(g, GCSpause);  /* finish collection */
         return GCSWEEPCOST;
       }
     }
@@ -1161,13 +1314,21 @@ static lu_mem singlestep (lua_State *L) {
 ** advances the garbage collector until it reaches a state allowed
 ** by 'statemask'
 */
-void luaC_runtilstate (lua_State *L, int statesmask) {
+static void runtilstate (lua_State *L, int statesmask) {
   global_State *g = G(L);
   while (!testbit(statesmask, g->gcstate))
     singlestep(L);
 }
 
 
+void luaC_runtilstate (lua_State *L, int statesmask) {
+  global_State *g = G(L);
+  double start = startstep(g);
+  runtilstate(L, statesmask);
+  endstep(g, start);
+}
+
+
 static void generationalcollection (lua_State *L) {
   global_State *g = G(L);
   lua_assert(g->gcstate == GCSpropagate);
@@ -1177,8 +1338,8 @@ static void generationalcollection (lua_State *L) {
   }
   else {
     lu_mem estimate = g->GCestimate;
-    luaC_runtilstate(L, bitmask(GCSpause));  /* run complete (minor) cycle */
-    g->gcstate = GCSpropagate;  /* skip restart */
+    runtilstate(L, bitmask(GCSpause));  /* run complete (minor) cycle */
+    setgcstate(g, GCSpropagate);  /* skip restart */
     if (gettotalbytes(g) > (estimate / 100) * g->gcmajorinc)
       g->GCestimate = 0;  /* signal for a major collection */
     else
@@ -1217,8 +1378,10 @@ static void incstep (lua_State *L) {
 void luaC_forcestep (lua_State *L) {
   global_State *g = G(L);
   int i;
+  double start = startstep(g);
   if (isgenerational(g)) generationalcollection(L);
   else incstep(L);
+  endstep(g, start);
   /* run a few finalizers (or all of them at the end of a collect cycle) */
   for (i = 0; g->tobefnz && (i < GCFINALIZENUM || g->gcstate == GCSpause); i++)
     GCTM(L, 1);  /* call one finalizer */
@@ -1243,6 +1406,7 @@ void luaC_step (lua_State *L) {
 void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   int origkind = g->gckind;
+  double start;
   lua_assert(origkind != KGC_EMERGENCY);
   if (isemergency)  /* do not run finalizers during emergency GC */
     g->gckind = KGC_EMERGENCY;
@@ -1250,20 +1414,24 @@ void luaC_fullgc (lua_State *L, int isemergency) {
     g->gckind = KGC_NORMAL;
     callallpendingfinalizers(L, 1);
   }
+  start = startstep(g);
   if (keepinvariant(g)) {  /* may there be some black objects? */
     /* must sweep all objects to turn them back to white
        (as white has not changed, nothing will be collected) */
     entersweep(L);
   }
   /* finish any pending sweep phase to start a new cycle */
-  luaC_runtilstate(L, bitmask(GCSpause));
-  luaC_runtilstate(L, ~bitmask(GCSpause));  /* start new collection */
-  luaC_runtilstate(L, bitmask(GCSpause));  /* run entire collection */
+  runtilstate(L, bitmask(GCSpause));
+  runtilstate(L, ~bitmask(GCSpause));  /* start new collection */
+  runtilstate(L, bitmask(GCSpause));  /* run entire collection */
   if (origkind == KGC_GEN) {  /* generational mode? */
     /* generational mode must be kept in propagate phase */
-    luaC_runtilstate(L, bitmask(GCSpropagate));
+    runtilstate(L, bitmask(GCSpropagate));
   }
+  endstep(g, start);
   g->gckind = origkind;
+  if (isemergency)  /* give back memory kept in the thread pool */
+    luaE_trimthreadpool(L, 0);
   setpause(g, gettotalbytes(g));
   if (!isemergency)   /* do not run finalizers during emergency GC */
     callallpendingfinalizers(L, 1);
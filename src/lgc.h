@@ -119,6 +119,25 @@
 #define luaC_white(g)	cast(lu_byte, (g)->currentwhite & WHITEBITS)
 
 
+/*
+** (approximate) sizes of objects, as counted by the collector
+*/
+#define sizetable(h)	(sizeof(Table) + sizeof(TValue) * (h)->sizearray + \
+                         sizeof(Node) * cast(size_t, sizenode(h)))
+
+#define sizeproto(f)	(sizeof(Proto) + sizeof(Instruction) * (f)->sizecode + \
+                         sizeof(Proto *) * (f)->sizep + \
+                         sizeof(TValue) * (f)->sizek + \
+                         sizeof(ls_byte) * (f)->sizelineinfo + \
+                         sizeof(AbsLineInfo) * (f)->sizeabslineinfo + \
+                         sizeof(LocVar) * (f)->sizelocvars + \
+                         sizeof(Upvaldesc) * (f)->sizeupvalues + \
+                         sizeof(Table *) * (f)->sizeswitches + \
+                         sizeof(Table *) * (f)->sizetemplates)
+
+#define sizethread(th)	(sizeof(lua_State) + sizeof(TValue) * (th)->stacksize)
+
+
 #define luaC_condGC(L,c) \
 	{if (G(L)->GCdebt > 0) {c;}; condchangemem(L);}
 #define luaC_checkGC(L)		luaC_condGC(L, luaC_step(L);)
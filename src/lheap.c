@@ -0,0 +1,698 @@
+/*
+** $Id: lheap.c $
+** Heap inspection: snapshots and allocation sampling
+** See Copyright Notice in lua.h
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#define lheap_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#include "ldebug.h"
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lheap.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
+#include "ltm.h"
+#include "lzio.h"
+
+
+/*
+** {======================================================
+** Heap snapshots
+** =======================================================
+*/
+
+
+/*
+** A snapshot is a text stream with one record per line:
+**   'n <id> <type> <size> <info>' describes an object;
+**   'e <from> <to> <label>' is a reference from one object to another.
+** Ids are object addresses. The pseudo-object 'root' holds references
+** to the registry, the main thread and the basic metatables. Labels
+** name the field, upvalue or slot holding each reference, so that the
+** path from 'root' to an object names it ("globals.x.y"). Rope and
+** substring clusters appear as objects whose size is their unused part
+** (the used part is counted by the ropes and substrings in them).
+*/
+
+#define SNAPSHOT_HEADER	"luaheap 1\n"
+
+/* bytes buffered before calling the writer */
+#define SNAPSHOT_FLUSH	4096
+
+/* maximum length of labels and string previews */
+#define MAXLABEL	40
+
+
+typedef struct SnapState {
+  lua_Writer writer;
+  void *data;
+  Mbuffer buff;
+  int status;
+} SnapState;
+
+
+static void addtext (lua_State *L, SnapState *S, const char *s, size_t l) {
+  size_t n = luaZ_bufflen(&S->buff);
+  if (n + l > luaZ_sizebuffer(&S->buff))
+    luaZ_resizebuffer(L, &S->buff, 2 * (n + l));
+  memcpy(luaZ_buffer(&S->buff) + n, s, l);
+  luaZ_bufflen(&S->buff) = n + l;
+}
+
+
+/*
+** hand buffered text to the writer. Only called between objects, as
+** the writer may use the API (and so change the object being walked).
+*/
+static void flush (lua_State *L, SnapState *S, size_t min) {
+  if (luaZ_bufflen(&S->buff) < min) return;
+  if (S->status == 0) {
+    lua_unlock(L);
+    S->status = (*S->writer)(L, luaZ_buffer(&S->buff),
+                                luaZ_bufflen(&S->buff), S->data);
+    lua_lock(L);
+  }
+  luaZ_resetbuffer(&S->buff);
+}
+
+
+/*
+** copy at most MAXLABEL characters of 's' into 'buff', replacing
+** control characters (which would break the line format)
+*/
+static const char *cleantext (char *buff, const char *s, size_t l) {
+  size_t i;
+  if (l > MAXLABEL) l = MAXLABEL;
+  for (i = 0; i < l; i++) {
+    unsigned char c = cast_uchar(s[i]);
+    buff[i] = (c < ' ' || c == 127) ? '?' : cast(char, c);
+  }
+  buff[l] = '\0';
+  return buff;
+}
+
+
+static void node (lua_State *L, SnapState *S, void *o, const char *type,
+                  lu_mem size, const char *info) {
+  char line[MAXLABEL + 64];
+  int l = sprintf(line, "n %p %s %lu %s\n", o, type,
+                        cast(unsigned long, size), info);
+  addtext(L, S, line, l);
+}
+
+
+static void edge (lua_State *L, SnapState *S, void *from, void *to,
+                  const char *label) {
+  char line[MAXLABEL + 64];
+  int l = (from == NULL)
+    ? sprintf(line, "e root %p %s\n", to, label)
+    : sprintf(line, "e %p %p %s\n", from, to, label);
+  addtext(L, S, line, l);
+}
+
+
+static void valueedge (lua_State *L, SnapState *S, void *from,
+                       const TValue *v, const char *label) {
+  if (iscollectable(v))
+    edge(L, S, from, gcvalue(v), label);
+}
+
+
+static void objectedge (lua_State *L, SnapState *S, void *from, void *to,
+                        const char *label) {
+  if (to != NULL)
+    edge(L, S, from, to, label);
+}
+
+
+/*
+** label for a reference held under key 'k' of a table
+*/
+static const char *keylabel (char *buff, const TValue *k) {
+  switch (ttype(k)) {
+    case LUA_TSHRSTR: case LUA_TLNGSTR:
+      return cleantext(buff, svalue(k), tsvalue(k)->len);
+    case LUA_TNUMBER:
+      buff[0] = '[';
+      lua_number2str(buff + 1, nvalue(k));
+      strcat(buff, "]");
+      return buff;
+    case LUA_TBOOLEAN:
+      return bvalue(k) ? "[true]" : "[false]";
+    default:
+      sprintf(buff, "[%s]", objtypename(k));
+      return buff;
+  }
+}
+
+
+static const char *funcinfo (char *buff, Proto *p) {
+  const char *src = (p->source) ? getstr(p->source) : "=?";
+  size_t l = (p->source) ? p->source->tsv.len : 2;
+  char line[16];
+  sprintf(line, ":%d", p->linedefined);
+  if (l > MAXLABEL - strlen(line)) l = MAXLABEL - strlen(line);
+  cleantext(buff, src, l);
+  strcat(buff, line);
+  return buff;
+}
+
+
+static void snaptable (lua_State *L, SnapState *S, Table *h, int isreg) {
+  char lbl[MAXLABEL + 64];
+  Node *n, *limit = gnode(h, cast(size_t, sizenode(h)));
+  int i;
+  node(L, S, h, "table", sizetable(h), "-");
+  objectedge(L, S, h, h->metatable, "metatable");
+  for (i = 0; i < h->sizearray; i++) {
+    if (iscollectable(&h->array[i])) {
+      if (isreg && i + 1 == LUA_RIDX_GLOBALS)
+        strcpy(lbl, "globals");
+      else if (isreg && i + 1 == LUA_RIDX_MAINTHREAD)
+        strcpy(lbl, "mainthread");
+      else
+        sprintf(lbl, "[%d]", i + 1);
+      edge(L, S, h, gcvalue(&h->array[i]), lbl);
+    }
+  }
+  for (n = gnode(h, 0); n < limit; n++) {
+    if (ttisnil(gval(n))) continue;  /* empty entry */
+    if (iscollectable(gkey(n)) && !ttisdeadkey(gkey(n)))
+      edge(L, S, h, gcvalue(gkey(n)), "(key)");
+    valueedge(L, S, h, gval(n), keylabel(lbl, gkey(n)));
+  }
+}
+
+
+static void snapthread (lua_State *L, SnapState *S, lua_State *th) {
+  char lbl[32];
+  StkId o;
+  GCObject *uv;
+  int i = 0;
+  node(L, S, th, "thread", sizethread(th),
+       (th == G(L)->mainthread) ? "main" : "-");
+  if (th->stack == NULL) return;  /* stack not completely built yet */
+  for (o = th->stack; o < th->top; o++, i++) {
+    if (iscollectable(o)) {
+      sprintf(lbl, "stack[%d]", i);
+      edge(L, S, th, gcvalue(o), lbl);
+    }
+  }
+  for (uv = th->openupval; uv != NULL; uv = gch(uv)->next) {
+    node(L, S, uv, "upvalue", sizeof(UpVal), "open");
+    edge(L, S, th, uv, "(openupval)");
+    valueedge(L, S, uv, gco2uv(uv)->v, "value");
+  }
+}
+
+
+static void snapobject (lua_State *L, SnapState *S, GCObject *o) {
+  char info[MAXLABEL + 16];
+  int i;
+  switch (gch(o)->tt) {
+    case LUA_TSHRSTR: case LUA_TLNGSTR: {
+      TString *ts = rawgco2ts(o);
+      node(L, S, o, "string", sizestring(&ts->tsv),
+           cleantext(info, getstr(ts), ts->tsv.len));
+      break;
+    }
+    case LUA_TROPSTR: {
+      TString *r = rawgco2tr(o);
+      node(L, S, o, "rope", sizeof(TString), "-");
+      objectedge(L, S, o, r->tsr.left, "left");
+      objectedge(L, S, o, r->tsr.right, "right");
+      objectedge(L, S, o, r->tsr.res, "result");
+      break;
+    }
+    case LUA_TSUBSTR: {
+      TString *ss = rawgco2ss(o);
+      node(L, S, o, "substring", sizeof(TString),
+           cleantext(info, getstr(ss->tss.str) + ss->tss.offset, ss->tss.len));
+      edge(L, S, o, ss->tss.str, "string");
+      break;
+    }
+    case LUA_TTABLE: {
+      snaptable(L, S, gco2t(o), o == gcvalue(&G(L)->l_registry));
+      break;
+    }
+    case LUA_TLCL: {
+      LClosure *cl = gco2lcl(o);
+      node(L, S, o, "function", sizeLclosure(cl->nupvalues, cl->nvalues),
+           funcinfo(info, cl->p));
+      edge(L, S, o, cl->p, "(proto)");
+      for (i = 0; i < cl->nupvalues; i++) {
+        TString *name = cl->p->upvalues[i].name;
+        char lbl[MAXLABEL + 1];
+        const char *l = (name) ?
+          cleantext(lbl, getstr(name), name->tsv.len) : "(upvalue)";
+        if (cl->upvals[i] == NULL) continue;
+        if (isownupval(cl, cl->upvals[i]))  /* value kept in the closure */
+          valueedge(L, S, o, cl->upvals[i]->v, l);
+        else
+          edge(L, S, o, cl->upvals[i], l);
+      }
+      break;
+    }
+    case LUA_TCCL: {
+      CClosure *cl = gco2ccl(o);
+      node(L, S, o, "cfunction", sizeCclosure(cl->nupvalues), "-");
+      for (i = 0; i < cl->nupvalues; i++) {
+        char lbl[32];
+        sprintf(lbl, "(upvalue %d)", i + 1);
+        valueedge(L, S, o, &cl->upvalue[i], lbl);
+      }
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Udata *u = rawgco2u(o);
+      node(L, S, o, "userdata", sizeudata(&u->uv), "-");
+      objectedge(L, S, o, u->uv.metatable, "metatable");
+      objectedge(L, S, o, u->uv.env, "(env)");
+      break;
+    }
+    case LUA_TUPVAL: {
+      node(L, S, o, "upvalue", sizeof(UpVal), "closed");
+      valueedge(L, S, o, gco2uv(o)->v, "value");
+      break;
+    }
+    case LUA_TTHREAD: {
+      snapthread(L, S, gco2th(o));
+      break;
+    }
+    case LUA_TPROTO: {
+      Proto *p = gco2p(o);
+      node(L, S, o, "proto", sizeproto(p), funcinfo(info, p));
+      objectedge(L, S, o, p->source, "(source)");
+      objectedge(L, S, o, p->lazytext, "(text)");
+      for (i = 0; i < p->sizek; i++)
+        valueedge(L, S, o, &p->k[i], "(constant)");
+      for (i = 0; i < p->sizep; i++)
+        objectedge(L, S, o, p->p[i], "(proto)");
+      for (i = 0; i < p->sizeupvalues; i++)
+        objectedge(L, S, o, p->upvalues[i].name, "(name)");
+      for (i = 0; i < p->sizelocvars; i++)
+        objectedge(L, S, o, p->locvars[i].varname, "(name)");
+      for (i = 0; i < p->sizetemplates; i++)
+        objectedge(L, S, o, p->templates[i], "(template)");
+      break;
+    }
+    default: lua_assert(0);
+  }
+  flush(L, S, SNAPSHOT_FLUSH);
+}
+
+
+static void snaplist (lua_State *L, SnapState *S, GCObject *o) {
+  for (; o != NULL; o = gch(o)->next)
+    snapobject(L, S, o);
+}
+
+
+/*
+** emit the clusters in list 'c'; their size is the part not used by
+** ropes or substrings (the first 16 entries, always marked as in use,
+** hold the cluster header)
+*/
+static void snapclusters (lua_State *L, SnapState *S, TString *c,
+                          size_t size, const char *type) {
+  for (; c != NULL; c = nextropecluster(c)) {
+    bitmap_unit *bitmap = (bitmap_unit *)c + BITMAP_SKIP;
+    size_t used = 0, i;
+    for (i = 0; i < size / BITMAP_UNIT_SIZE; i++) {
+      bitmap_unit b = bitmap[i];
+      for (; b != 0; b &= b - 1) used++;
+    }
+    node(L, S, c, type, (size - (used - 16)) * sizeof(TString), "-");
+    edge(L, S, NULL, c, type);
+  }
+}
+
+
+static void f_snapshot (lua_State *L, void *ud) {
+  SnapState *S = cast(SnapState *, ud);
+  global_State *g = G(L);
+  int i;
+  addtext(L, S, SNAPSHOT_HEADER, sizeof(SNAPSHOT_HEADER) - 1);
+  valueedge(L, S, NULL, &g->l_registry, "registry");
+  edge(L, S, NULL, g->mainthread, "mainthread");
+  for (i = 0; i < LUA_NUMTAGS; i++) {
+    if (g->mt[i] != NULL) {
+      char lbl[32];
+      sprintf(lbl, "(metatable %s)", ttypename(i));
+      edge(L, S, NULL, g->mt[i], lbl);
+    }
+  }
+  snapobject(L, S, obj2gco(g->mainthread));
+  snaplist(L, S, g->allgc);
+  snaplist(L, S, g->finobj);
+  snaplist(L, S, g->tobefnz);
+  for (i = 0; i < g->strt.size; i++)
+    snaplist(L, S, g->strt.hash[i]);
+  snapclusters(L, S, g->ropeclusters, ROPE_CLUSTER_SIZE, "ropecluster");
+  snapclusters(L, S, g->ssclusters, SUBSTR_CLUSTER_SIZE, "substrcluster");
+  flush(L, S, 1);
+}
+
+
+/*
+** Write a snapshot of the heap. Does a full collection first, so that
+** only live objects are written, and keeps the collector stopped while
+** walking the heap. Returns the first error of the writer, LUA_ERRMEM
+** if the output buffer could not grow, or 0.
+*/
+LUA_API int lua_heapsnapshot (lua_State *L, lua_Writer writer, void *data) {
+  SnapState S;
+  global_State *g;
+  int running, status;
+  lua_lock(L);
+  g = G(L);
+  luaC_fullgc(L, 0);
+  running = g->gcrunning;
+  g->gcrunning = 0;  /* objects must not move or die while walked */
+  S.writer = writer;
+  S.data = data;
+  S.status = 0;
+  luaZ_initbuffer(L, &S.buff);
+  luaZ_resetbuffer(&S.buff);
+  status = luaD_rawrunprotected(L, f_snapshot, &S);
+  luaZ_freebuffer(L, &S.buff);
+  g->gcrunning = running;
+  if (status == LUA_OK)
+    status = S.status;
+  lua_unlock(L);
+  return status;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Allocation sampling
+** =======================================================
+*/
+
+
+/*
+** The sampler counts the bytes allocated by 'luaM_realloc_' and, once
+** 'rate' bytes have accumulated, records the call stack of the next
+** allocation of a new block, weighted by the bytes accumulated. (Only
+** new blocks are sampled: while a block is being resized its owner may
+** be inconsistent; e.g., a stack being reallocated.) Samples with the
+** same stack and type of object are aggregated. The sampler uses the
+** allocation function directly, so its own memory is neither counted
+** nor sampled.
+*/
+
+/* maximum number of frames kept in a sample (innermost ones) */
+#define MAXFRAMES	64
+
+/* maximum length of a frame name ("source:linedefined@line") */
+#define FRAMELEN	(LUA_IDSIZE + 32)
+
+
+typedef struct SampleEntry {
+  struct SampleEntry *next;  /* next entry in hash chain */
+  unsigned int hash;
+  int kind;  /* LUA_GCK* kind of the objects allocated (-1 for others) */
+  int line;  /* current line of innermost Lua function */
+  size_t count;  /* number of samples */
+  size_t bytes;  /* bytes represented by the samples */
+  size_t len;  /* length of 'stack' */
+  char *func;  /* innermost Lua function (points into 'stack') */
+  char stack[1];  /* folded stack, then innermost function */
+} SampleEntry;
+
+
+typedef struct AllocSampler {
+  size_t rate;  /* bytes between samples */
+  size_t pending;  /* bytes allocated since last sample */
+  SampleEntry **hash;
+  int size;  /* size of 'hash' */
+  SampleEntry **entries;  /* entries, in order of creation */
+  int nentries;
+  int sizeentries;
+} AllocSampler;
+
+
+/* names of the kinds of objects, as in heap snapshots */
+static const char *const kindnames[LUA_GCSTATKINDS] = {"string", "rope",
+  "substring", "table", "function", "cfunction", "userdata", "thread",
+  "proto", "upvalue"};
+
+
+/* kind of the object of a new block with tag 'tag' (-1 if none) */
+static int samplekind (size_t tag) {
+  switch (tag) {
+    case LUA_TSHRSTR: case LUA_TLNGSTR: return LUA_GCKSTRING;
+    case LUA_TROPSTR: return LUA_GCKROPE;
+    case LUA_TSUBSTR: return LUA_GCKSUBSTR;
+    case LUA_TTABLE: return LUA_GCKTABLE;
+    case LUA_TLCL: return LUA_GCKLCL;
+    case LUA_TCCL: return LUA_GCKCCL;
+    case LUA_TUSERDATA: return LUA_GCKUDATA;
+    case LUA_TTHREAD: return LUA_GCKTHREAD;
+    case LUA_TPROTO: return LUA_GCKPROTO;
+    case LUA_TUPVAL: return LUA_GCKUPVAL;
+    default: return -1;  /* a block that is not an object */
+  }
+}
+
+
+#define samplerfree(g,b,s)	((void)(*(g)->frealloc)((g)->ud, (b), (s), 0))
+
+
+static void *samplerrealloc (global_State *g, void *b, size_t os, size_t ns) {
+  return (*g->frealloc)(g->ud, b, (b) ? os : 0, ns);
+}
+
+
+static void framename (char *buff, CallInfo *ci, int *line) {
+  if (isLua(ci)) {
+    Proto *p = ci_func(ci)->p;
+    int pc = pcRel(ci->u.l.savedpc, p);
+    char id[LUA_IDSIZE];
+    luaO_chunkid(id, (p->source) ? getstr(p->source) : "=?", LUA_IDSIZE);
+    *line = luaG_getfuncline(p, (pc < 0) ? 0 : pc);
+    sprintf(buff, "%s:%d", id, p->linedefined);
+  }
+  else {
+    *line = 0;
+    strcpy(buff, "[C]");
+  }
+}
+
+
+/*
+** build the folded stack ("outer;...;inner") of 'L' in 'buff', followed
+** by a '\0' and the name of the innermost Lua function; returns the
+** length of the stack part
+*/
+static size_t foldstack (lua_State *L, char *buff, int *line) {
+  CallInfo *frames[MAXFRAMES];
+  CallInfo *ci;
+  char leaf[FRAMELEN] = "[C]";
+  size_t len = 0;
+  int n = 0, i;
+  *line = 0;
+  for (ci = L->ci; ci != &L->base_ci && n < MAXFRAMES; ci = ci->previous)
+    if (ttisfunction(ci->func)) frames[n++] = ci;
+  for (i = 0; i < n; i++) {
+    if (isLua(frames[i])) {  /* innermost Lua function? */
+      framename(leaf, frames[i], line);
+      break;
+    }
+  }
+  for (i = n - 1; i >= 0; i--) {  /* outermost frame first */
+    char name[FRAMELEN];
+    int l;
+    framename(name, frames[i], &l);
+    if (isLua(frames[i]))
+      sprintf(name + strlen(name), "@%d", l);  /* add current line */
+    if (len > 0) buff[len++] = ';';
+    strcpy(buff + len, name);
+    len += strlen(name);
+  }
+  if (n == 0) {
+    strcpy(buff, "[C]");
+    len = 3;
+  }
+  strcpy(buff + len + 1, leaf);
+  return len;
+}
+
+
+/*
+** double the size of the hash part of the sampler (keeping its size
+** if there is no memory)
+*/
+static void growsampler (global_State *g, AllocSampler *s) {
+  int ns = 2 * s->size;
+  int i;
+  SampleEntry **h = cast(SampleEntry **,
+                  samplerrealloc(g, NULL, 0, ns * sizeof(SampleEntry *)));
+  if (h == NULL) return;
+  memset(h, 0, ns * sizeof(SampleEntry *));
+  for (i = 0; i < s->nentries; i++) {
+    SampleEntry *e = s->entries[i];
+    e->next = h[lmod(e->hash, ns)];
+    h[lmod(e->hash, ns)] = e;
+  }
+  samplerfree(g, s->hash, s->size * sizeof(SampleEntry *));
+  s->hash = h;
+  s->size = ns;
+}
+
+
+static void recordsample (lua_State *L, AllocSampler *s, int kind,
+                                        size_t bytes) {
+  global_State *g = G(L);
+  char buff[MAXFRAMES * (FRAMELEN + 1) + FRAMELEN + 1];
+  int line;
+  size_t len = foldstack(L, buff, &line);
+  size_t total = len + 1 + strlen(buff + len + 1) + 1;
+  unsigned int h = luaS_hash(buff, len, cast(unsigned int, kind));
+  SampleEntry *e;
+  for (e = s->hash[lmod(h, s->size)]; e != NULL; e = e->next) {
+    if (e->hash == h && e->kind == kind && e->len == len &&
+        memcmp(e->stack, buff, len) == 0)
+      break;
+  }
+  if (e == NULL) {  /* new entry */
+    if (s->nentries >= 2 * s->size)
+      growsampler(g, s);
+    if (s->nentries >= s->sizeentries) {
+      int ns = (s->sizeentries == 0) ? 64 : 2 * s->sizeentries;
+      SampleEntry **v = cast(SampleEntry **, samplerrealloc(g, s->entries,
+                   s->sizeentries * sizeof(SampleEntry *),
+                   ns * sizeof(SampleEntry *)));
+      if (v == NULL) return;  /* drop sample */
+      s->entries = v;
+      s->sizeentries = ns;
+    }
+    e = cast(SampleEntry *, samplerrealloc(g, NULL, 0,
+                                           sizeof(SampleEntry) + total));
+    if (e == NULL) return;  /* drop sample */
+    memcpy(e->stack, buff, total);
+    e->func = e->stack + len + 1;
+    e->hash = h;
+    e->kind = kind;
+    e->line = line;
+    e->len = len;
+    e->count = e->bytes = 0;
+    e->next = s->hash[lmod(h, s->size)];
+    s->hash[lmod(h, s->size)] = e;
+    s->entries[s->nentries++] = e;
+  }
+  e->count++;
+  e->bytes += bytes;
+}
+
+
+void luaW_sample (lua_State *L, int isnew, size_t tag, size_t n) {
+  AllocSampler *s = G(L)->sampler;
+  s->pending += n;
+  if (isnew && s->pending >= s->rate) {
+    size_t bytes = s->pending;
+    s->pending = 0;
+    recordsample(L, s, samplekind(tag), bytes);
+  }
+}
+
+
+void luaW_freesampler (lua_State *L) {
+  global_State *g = G(L);
+  AllocSampler *s = g->sampler;
+  int i;
+  if (s == NULL) return;
+  g->sampler = NULL;
+  for (i = 0; i < s->nentries; i++) {
+    SampleEntry *e = s->entries[i];
+    samplerfree(g, e, sizeof(SampleEntry) + e->len + strlen(e->func) + 2);
+  }
+  if (s->entries)
+    samplerfree(g, s->entries, s->sizeentries * sizeof(SampleEntry *));
+  samplerfree(g, s->hash, s->size * sizeof(SampleEntry *));
+  samplerfree(g, s, sizeof(AllocSampler));
+}
+
+
+/*
+** Start sampling one allocation every 'rate' bytes, or change the rate
+** of a running sampler (keeping its samples). A rate of 0 stops the
+** sampler and discards its samples. Returns 0 if there is not enough
+** memory to start the sampler.
+*/
+LUA_API int lua_setallocsampler (lua_State *L, size_t rate) {
+  global_State *g;
+  int res = 1;
+  lua_lock(L);
+  g = G(L);
+  if (rate == 0)
+    luaW_freesampler(L);
+  else if (g->sampler != NULL)
+    g->sampler->rate = rate;
+  else {
+    AllocSampler *s = cast(AllocSampler *,
+                           samplerrealloc(g, NULL, 0, sizeof(AllocSampler)));
+    SampleEntry **h = cast(SampleEntry **,
+                    samplerrealloc(g, NULL, 0, 256 * sizeof(SampleEntry *)));
+    if (s == NULL || h == NULL) {
+      if (s) samplerfree(g, s, sizeof(AllocSampler));
+      if (h) samplerfree(g, h, 256 * sizeof(SampleEntry *));
+      res = 0;
+    }
+    else {
+      memset(h, 0, 256 * sizeof(SampleEntry *));
+      s->rate = rate;
+      s->pending = 0;
+      s->hash = h;
+      s->size = 256;
+      s->entries = NULL;
+      s->nentries = s->sizeentries = 0;
+      g->sampler = s;
+    }
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Get the 'n'-th (from 1) aggregated sample. Returns 0 if there is
+** no such sample. The strings are valid until the sampler is stopped.
+*/
+LUA_API int lua_getallocsample (lua_State *L, int n, lua_AllocSample *as) {
+  AllocSampler *s;
+  int res = 0;
+  lua_lock(L);
+  s = G(L)->sampler;
+  if (s != NULL && 1 <= n && n <= s->nentries) {
+    SampleEntry *e = s->entries[n - 1];
+    as->stack = e->stack;
+    as->type = (e->kind < 0) ? "memory" : kindnames[e->kind];
+    as->func = e->func;
+    as->line = e->line;
+    as->count = e->count;
+    as->bytes = e->bytes;
+    res = 1;
+  }
+  lua_unlock(L);
+  return res;
+}
+
+/* }====================================================== */
+
@@ -0,0 +1,25 @@
+/*
+** $Id: lheap.h $
+** Heap inspection: snapshots and allocation sampling
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lheap_h
+#define lheap_h
+
+
+#include "lobject.h"
+#include "lstate.h"
+
+
+/*
+** account 'n' bytes allocated by 'luaM_realloc_'; 'isnew' tells
+** whether the block is a new one (whose type is given by 'tag')
+*/
+#define luaW_checksample(L,g,isnew,tag,n) \
+	{ if ((g)->sampler != NULL) luaW_sample(L, isnew, tag, n); }
+
+LUAI_FUNC void luaW_sample (lua_State *L, int isnew, size_t tag, size_t n);
+LUAI_FUNC void luaW_freesampler (lua_State *L);
+
+#endif
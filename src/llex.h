@@ -61,6 +61,8 @@ typedef struct LexState {
   struct Dyndata *dyd;  /* dynamic structures used by the parser */
   TString *source;  /* current source name */
   TString *envn;  /* environment variable name */
+  TString *text;  /* text of the chunk (in a lazy load) */
+  int lazymode;  /* LAZY_* flags of a lazy load */
   char decpoint;  /* locale decimal point */
 } LexState;
 
@@ -26,6 +26,7 @@ typedef LUAI_MEM l_mem;
 
 /* chars used as small naturals (so that `char' is reserved for characters) */
 typedef unsigned char lu_byte;
+typedef signed char ls_byte;
 
 
 #define MAX_SIZET	((size_t)(~(size_t)0)-2)
@@ -44,10 +45,12 @@ typedef unsigned char lu_byte;
 */
 #define IntPoint(p)  ((unsigned int)(lu_mem)(p))
 
+#if !defined(LUAI_NOLOCK)
 extern void _lua_lock(lua_State *L);
 extern void _lua_unlock(lua_State *L);
 #define lua_lock(L) _lua_lock(L)
 #define lua_unlock(L) _lua_unlock(L)
+#endif
 
 /* type to ensure maximum alignment */
 #if !defined(LUAI_USER_ALIGNMENT_T)
@@ -4,29 +4,171 @@ extern "C" {
 #include "luaconf.h"
 #include "lstate.h"
 }
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// default policy of new states; build with -DLUAI_NOLOCK to remove
+// the lock calls from the core altogether
+#if !defined(LUAI_LOCKPOLICY)
+#define LUAI_LOCKPOLICY LUA_LOCKFUTEX
+#endif
+
+// attempts made by LUA_LOCKSPIN before going to sleep
+#if !defined(LUAI_LOCKSPINS)
+#define LUAI_LOCKSPINS 100
+#endif
+
+// Lock word: 0 = free, 1 = held, 2 = held and other threads may be
+// sleeping on it. Taking a free lock is one compare-and-swap and
+// releasing it one exchange; the kernel is only entered when there
+// are sleepers. Statistics are updated only by the holder of the lock,
+// so they need no atomic operations.
+struct LuaLock {
+    std::atomic<int> word;
+    std::atomic<int> policy;
+    std::atomic<std::thread::id> owner;
+    int scope;  // nesting of lua_lockscope_begin (touched by owner only)
+    lua_LockStats stats;
+#if !defined(__linux__)
+    std::mutex m;  // emulates the futex
+    std::condition_variable cv;
+#endif
+};
+
+#define tolock(L) ((LuaLock*)G(L)->lock)
+
+#if defined(__linux__)
+static void park(LuaLock *l, int val) {
+    syscall(SYS_futex, (int*)&l->word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void wake(LuaLock *l) {
+    syscall(SYS_futex, (int*)&l->word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#else
+static void park(LuaLock *l, int val) {
+    std::unique_lock<std::mutex> lk(l->m);
+    if (l->word.load(std::memory_order_relaxed) == val) l->cv.wait(lk);
+}
+
+static void wake(LuaLock *l) {
+    { std::lock_guard<std::mutex> lk(l->m); }
+    l->cv.notify_one();
+}
+#endif
+
+static void acquireslow(LuaLock *l, int policy) {
+    unsigned long spins = 0, parks = 0;
+    int c;
+    if (policy == LUA_LOCKSPIN) {
+        for (; spins < LUAI_LOCKSPINS; spins++) {
+            c = 0;
+            if (l->word.load(std::memory_order_relaxed) == 0 &&
+                l->word.compare_exchange_weak(c, 1, std::memory_order_acquire))
+                goto done;
+            std::this_thread::yield();
+        }
+    }
+    while (l->word.exchange(2, std::memory_order_acquire) != 0) {
+        park(l, 2);
+        parks++;
+    }
+done:
+    l->stats.contended++;
+    l->stats.spins += spins;
+    l->stats.parks += parks;
+}
 
 extern "C" {
     void _lua_lock(lua_State *L) {
-        if (G(L)->lockstate == 2) return;
-        ((std::mutex*)G(L)->lock)->lock();
-        G(L)->lockstate = 1;
+        LuaLock *l = tolock(L);
+        int policy = l->policy.load(std::memory_order_relaxed);
+        std::thread::id me;
+        int c = 0;
+        if (policy == LUA_LOCKNONE) return;
+        me = std::this_thread::get_id();
+        if (l->owner.load(std::memory_order_relaxed) == me && l->scope > 0) {
+            l->stats.elided++;  // already held by a lock scope
+            return;
+        }
+        if (!l->word.compare_exchange_strong(c, 1, std::memory_order_acquire))
+            acquireslow(l, policy);
+        l->owner.store(me, std::memory_order_relaxed);
+        l->stats.acquisitions++;
     }
 
     void _lua_unlock(lua_State *L) {
-        if (G(L)->lockstate != 1 && G(L)->lockstate != 3) {
+        LuaLock *l = tolock(L);
+        if (l->owner.load(std::memory_order_relaxed) != std::this_thread::get_id()) {
             //fprintf(stderr, "Attempted to unlock a thread twice!\n");
             return;
         }
-        G(L)->lockstate--;
-        ((std::mutex*)G(L)->lock)->unlock();
+        if (l->scope > 0) return;  // released by lua_lockscope_end
+        l->owner.store(std::thread::id(), std::memory_order_relaxed);
+        if (l->word.exchange(0, std::memory_order_release) == 2)
+            wake(l);
     }
 
     void * _lua_newlock() {
-        return new std::mutex;
+        LuaLock *l = new LuaLock;
+        l->word.store(0);
+        l->policy.store(LUAI_LOCKPOLICY);
+        l->owner.store(std::thread::id());
+        l->scope = 0;
+        l->stats = lua_LockStats();
+        return l;
     }
 
     void _lua_freelock(void * l) {
-        delete (std::mutex*)l;
+        delete (LuaLock*)l;
+    }
+
+    // Changing the policy is only safe while no other thread uses the
+    // state. A lock held when locking is turned off is still released
+    // by the next unlock.
+    LUA_API int lua_setlockpolicy(lua_State *L, int policy) {
+        LuaLock *l = tolock(L);
+        int old;
+        _lua_lock(L);
+        old = l->policy.exchange(policy);
+        _lua_unlock(L);
+        return old;
+    }
+
+    LUA_API void lua_setlockstate(lua_State *L, int enabled) {
+        lua_setlockpolicy(L, enabled ? LUAI_LOCKPOLICY : LUA_LOCKNONE);
     }
-}
\ No newline at end of file
+
+    // Keep the lock from lua_lockscope_begin to the matching
+    // lua_lockscope_end; lock calls made by this thread in between
+    // (including those of the API) are elided. Scopes nest. A scope
+    // must not be left by an error: the lock would stay held for good,
+    // so code in it that may raise one runs under lua_pcall.
+    LUA_API void lua_lockscope_begin(lua_State *L) {
+        LuaLock *l = tolock(L);
+        _lua_lock(L);
+        if (l->owner.load(std::memory_order_relaxed) == std::this_thread::get_id())
+            l->scope++;  // (not when locking is off)
+    }
+
+    LUA_API void lua_lockscope_end(lua_State *L) {
+        LuaLock *l = tolock(L);
+        if (l->owner.load(std::memory_order_relaxed) == std::this_thread::get_id() &&
+            l->scope > 0)
+            l->scope--;
+        _lua_unlock(L);
+    }
+
+    LUA_API void lua_lockstats(lua_State *L, lua_LockStats *s) {
+        _lua_lock(L);
+        *s = tolock(L)->stats;
+        _lua_unlock(L);
+    }
+}
@@ -15,6 +15,7 @@
 #include "ldebug.h"
 #include "ldo.h"
 #include "lgc.h"
+#include "lheap.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
@@ -76,23 +77,28 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   void *newblock;
   global_State *g = G(L);
   size_t realosize = (block) ? osize : 0;
+  size_t aosize = (block) ? osize : novariant(osize);  /* what 'frealloc' sees */
   lua_assert((realosize == 0) == (block == NULL));
 #if defined(HARDMEMTESTS)
   if (nsize > realosize && g->gcrunning)
     luaC_fullgc(L, 1);  /* force a GC whenever possible */
 #endif
-  newblock = (*g->frealloc)(g->ud, block, osize, nsize);
+  newblock = (*g->frealloc)(g->ud, block, aosize, nsize);
   if (newblock == NULL && nsize > 0) {
     api_check(L, nsize > realosize,
                  "realloc cannot fail when shrinking a block");
     if (g->gcrunning) {
       luaC_fullgc(L, 1);  /* try to free some memory... */
-      newblock = (*g->frealloc)(g->ud, block, osize, nsize);  /* try again */
+      newblock = (*g->frealloc)(g->ud, block, aosize, nsize);  /* try again */
     }
     if (newblock == NULL)
       luaD_throw(L, LUA_ERRMEM);
   }
   lua_assert((nsize == 0) == (newblock == NULL));
+  if (nsize > realosize) {
+    g->allocated += nsize - realosize;
+    luaW_checksample(L, g, block == NULL, osize, nsize - realosize);
+  }
   g->GCdebt = (g->GCdebt + nsize) - realosize;
   return newblock;
 }
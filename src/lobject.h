@@ -482,6 +482,7 @@ typedef struct Upvaldesc {
   TString *name;  /* upvalue name (for debug information) */
   lu_byte instack;  /* whether it is in stack */
   lu_byte idx;  /* index of upvalue (in stack or in outer function's list) */
+  lu_byte byvalue;  /* whether closures get a copy (variable never changes) */
 } Upvaldesc;
 
 
@@ -496,6 +497,19 @@ typedef struct LocVar {
 } LocVar;
 
 
+/*
+** Absolute line of instruction 'pc'. 'lineinfo' keeps, for each
+** instruction, how many lines it is after the previous one (the first
+** one counts from 'linedefined'); an instruction whose delta does not
+** fit in a byte, and one every MAXIWTHABS instructions, have instead
+** ABSLINEINFO there and their line in 'abslineinfo' (see ldebug.c).
+*/
+typedef struct AbsLineInfo {
+  int pc;
+  int line;
+} AbsLineInfo;
+
+
 /*
 ** Function Prototypes
 */
@@ -504,23 +518,33 @@ typedef struct Proto {
   TValue *k;  /* constants used by the function */
   Instruction *code;
   struct Proto **p;  /* functions defined inside the function */
-  int *lineinfo;  /* map from opcodes to source lines (debug information) */
+  ls_byte *lineinfo;  /* line deltas of each opcode (debug information) */
+  struct AbsLineInfo *abslineinfo;  /* absolute lines (debug information) */
   LocVar *locvars;  /* information about local variables (debug information) */
   Upvaldesc *upvalues;  /* upvalue information */
   union Closure *cache;  /* last created closure with this prototype */
+  struct Table **switches;  /* jump maps of OP_SWITCH (built when run) */
+  struct Table **templates;  /* tables copied by OP_TEMPLATE */
   TString  *source;  /* used for debug information */
+  TString *lazytext;  /* text of its chunk while it is not compiled */
   int sizeupvalues;  /* size of 'upvalues' */
   int sizek;  /* size of `k' */
   int sizecode;
   int sizelineinfo;
+  int sizeabslineinfo;  /* size of 'abslineinfo' */
   int sizep;  /* size of `p' */
   int sizelocvars;
+  int sizeswitches;  /* size of 'switches' */
+  int sizetemplates;  /* size of 'templates' */
   int linedefined;
   int lastlinedefined;
+  int lazypos;  /* where its body starts in 'lazytext' */
+  int lazyline;  /* line where its body starts */
   GCObject *gclist;
   lu_byte numparams;  /* number of fixed parameters */
   lu_byte is_vararg;
   lu_byte maxstacksize;  /* maximum stack used by this function */
+  lu_byte lazymode;  /* how to compile it (LAZY_* in lparser.h) */
 } Proto;
 
 
@@ -557,6 +581,7 @@ typedef struct CClosure {
 
 typedef struct LClosure {
   ClosureHeader;
+  lu_byte nvalues;  /* number of upvalues closed inside the closure itself */
   struct Proto *p;
   UpVal *upvals[1];  /* list of upvalues */
 } LClosure;
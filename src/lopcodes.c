@@ -54,6 +54,24 @@ LUAI_DDEF const char *const luaP_opnames[NUM_OPCODES+1] = {
   "SETLIST",
   "CLOSURE",
   "VARARG",
+  "JEQ",
+  "JNE",
+  "JLT",
+  "JNLT",
+  "JLE",
+  "JNLE",
+  "JTRUE",
+  "JFALSE",
+  "ADDI",
+  "SUBI",
+  "ADDN",
+  "SUBN",
+  "MULN",
+  "LTN",
+  "JLTN",
+  "JNLTN",
+  "SWITCH",
+  "TEMPLATE",
   "EXTRAARG",
   NULL
 };
@@ -102,6 +120,24 @@ LUAI_DDEF const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(0, 0, OpArgU, OpArgU, iABC)		/* OP_SETLIST */
  ,opmode(0, 1, OpArgU, OpArgN, iABx)		/* OP_CLOSURE */
  ,opmode(0, 1, OpArgU, OpArgN, iABC)		/* OP_VARARG */
+ ,opmode(0, 0, OpArgK, OpArgK, iABC)		/* OP_JEQ */
+ ,opmode(0, 0, OpArgK, OpArgK, iABC)		/* OP_JNE */
+ ,opmode(0, 0, OpArgK, OpArgK, iABC)		/* OP_JLT */
+ ,opmode(0, 0, OpArgK, OpArgK, iABC)		/* OP_JNLT */
+ ,opmode(0, 0, OpArgK, OpArgK, iABC)		/* OP_JLE */
+ ,opmode(0, 0, OpArgK, OpArgK, iABC)		/* OP_JNLE */
+ ,opmode(0, 0, OpArgR, OpArgN, iAsBx)		/* OP_JTRUE */
+ ,opmode(0, 0, OpArgR, OpArgN, iAsBx)		/* OP_JFALSE */
+ ,opmode(0, 1, OpArgR, OpArgU, iABC)		/* OP_ADDI */
+ ,opmode(0, 1, OpArgR, OpArgU, iABC)		/* OP_SUBI */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_ADDN */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_SUBN */
+ ,opmode(0, 1, OpArgK, OpArgK, iABC)		/* OP_MULN */
+ ,opmode(1, 0, OpArgK, OpArgK, iABC)		/* OP_LTN */
+ ,opmode(0, 0, OpArgK, OpArgK, iABC)		/* OP_JLTN */
+ ,opmode(0, 0, OpArgK, OpArgK, iABC)		/* OP_JNLTN */
+ ,opmode(0, 0, OpArgR, OpArgK, iABC)		/* OP_SWITCH */
+ ,opmode(0, 1, OpArgU, OpArgN, iABx)		/* OP_TEMPLATE */
  ,opmode(0, 0, OpArgU, OpArgU, iAx)		/* OP_EXTRAARG */
 };
 
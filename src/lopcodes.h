@@ -20,6 +20,8 @@
 	'Ax' : 26 bits ('A', 'B', and 'C' together)
 	`Bx' : 18 bits (`B' and `C' together)
 	`sBx' : signed Bx
+	`sA' : signed A
+	`sC' : signed C
 
   A signed argument is represented in excess K; that is, the number
   value is the unsigned value minus K. K is exactly the maximum value
@@ -74,6 +76,8 @@ enum OpMode {iABC, iABx, iAsBx, iAx};  /* basic instruction format */
 #define MAXARG_A        ((1<<SIZE_A)-1)
 #define MAXARG_B        ((1<<SIZE_B)-1)
 #define MAXARG_C        ((1<<SIZE_C)-1)
+#define MAXARG_sA        (MAXARG_A>>1)         /* `sA' is signed */
+#define MAXARG_sC        (MAXARG_C>>1)         /* `sC' is signed */
 
 
 /* creates a mask with `n' 1 bits at position `p' */
@@ -112,6 +116,12 @@ enum OpMode {iABC, iABx, iAsBx, iAx};  /* basic instruction format */
 #define GETARG_sBx(i)	(GETARG_Bx(i)-MAXARG_sBx)
 #define SETARG_sBx(i,b)	SETARG_Bx((i),cast(unsigned int, (b)+MAXARG_sBx))
 
+#define GETARG_sA(i)	(GETARG_A(i)-MAXARG_sA)
+#define SETARG_sA(i,b)	SETARG_A((i),cast(unsigned int, (b)+MAXARG_sA))
+
+#define GETARG_sC(i)	(GETARG_C(i)-MAXARG_sC)
+#define SETARG_sC(i,b)	SETARG_C((i),cast(unsigned int, (b)+MAXARG_sC))
+
 
 #define CREATE_ABC(o,a,b,c)	((cast(Instruction, o)<<POS_OP) \
 			| (cast(Instruction, a)<<POS_A) \
@@ -221,6 +231,30 @@ OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx])			*/
 
 OP_VARARG,/*	A B	R(A), R(A+1), ..., R(A+B-2) = vararg		*/
 
+OP_JEQ,/*	sA B C	if (RK(B) == RK(C)) then pc+=sA			*/
+OP_JNE,/*	sA B C	if (RK(B) ~= RK(C)) then pc+=sA			*/
+OP_JLT,/*	sA B C	if (RK(B) <  RK(C)) then pc+=sA			*/
+OP_JNLT,/*	sA B C	if not (RK(B) <  RK(C)) then pc+=sA		*/
+OP_JLE,/*	sA B C	if (RK(B) <= RK(C)) then pc+=sA			*/
+OP_JNLE,/*	sA B C	if not (RK(B) <= RK(C)) then pc+=sA		*/
+
+OP_JTRUE,/*	A sBx	if R(A) then pc+=sBx				*/
+OP_JFALSE,/*	A sBx	if not R(A) then pc+=sBx			*/
+
+OP_ADDI,/*	A B sC	R(A) := R(B) + sC				*/
+OP_SUBI,/*	A B sC	R(A) := R(B) - sC				*/
+
+OP_ADDN,/*	A B C	R(A) := RK(B) + RK(C)		(numbers)	*/
+OP_SUBN,/*	A B C	R(A) := RK(B) - RK(C)		(numbers)	*/
+OP_MULN,/*	A B C	R(A) := RK(B) * RK(C)		(numbers)	*/
+OP_LTN,/*	A B C	if ((RK(B) <  RK(C)) ~= A) then pc++ (numbers)	*/
+OP_JLTN,/*	sA B C	if (RK(B) <  RK(C)) then pc+=sA	(numbers)	*/
+OP_JNLTN,/*	sA B C	if not (RK(B) <  RK(C)) then pc+=sA (numbers)	*/
+
+OP_SWITCH,/*	A B C	pc := SWITCH[A][R(B)] (if R(B) == RK(C) then pc++)	*/
+
+OP_TEMPLATE,/*	A Bx	R(A) := copy of TEMPLATE[Bx]			*/
+
 OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
 } OpCode;
 
@@ -250,6 +284,25 @@ OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
 
   (*) All `skips' (pc++) assume that next instruction is a jump.
 
+  (*) OP_JEQ to OP_JFALSE are a comparison or a test fused with the
+  jump that follows it (when that jump closes no upvalues). These opcodes
+  are only produced by 'luaK_fuse', after the code of a chunk is complete.
+
+  (*) In OP_ADDI and OP_SUBI, sC is a small non-zero integer.
+
+  (*) OP_ADDN to OP_JNLTN are quickened forms of OP_ADD, OP_SUB, OP_MUL,
+  OP_LT, OP_JLT and OP_JNLT: the VM rewrites an instruction into its
+  numbers-only form when it finds numbers, and back when it does not.
+  They never leave the VM ('luaU_dump' writes the generic opcodes).
+
+  (*) OP_SWITCH replaces the first 'OP_EQ 0' of a chain of equality tests
+  of register B against distinct string or number constants, and keeps
+  its jump and the rest of the chain. The jump map SWITCH[A] of the
+  prototype is built from the chain the first time the switch runs.
+
+  (*) OP_TEMPLATE replaces an OP_NEWTABLE and the constant stores that
+  follow it; TEMPLATE[Bx] of the prototype is the table they build.
+
 ===========================================================================*/
 
 
@@ -277,6 +330,10 @@ LUAI_DDEC const lu_byte luaP_opmodes[NUM_OPCODES];
 #define testAMode(m)	(luaP_opmodes[m] & (1 << 6))
 #define testTMode(m)	(luaP_opmodes[m] & (1 << 7))
 
+/* is 'o' a comparison fused with a jump (offset in sA)? */
+#define isjumpcmp(o)	((OP_JEQ <= (o) && (o) <= OP_JNLE) || \
+			 (o) == OP_JLTN || (o) == OP_JNLTN)
+
 
 LUAI_DDEC const char *const luaP_opnames[NUM_OPCODES+1];  /* opcode names */
 
@@ -0,0 +1,1418 @@
+/*
+** $Id: lopt.c $
+** Bytecode optimizer
+** See Copyright Notice in lua.h
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#define lopt_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#include "lcode.h"
+#include "ldebug.h"
+#include "ldo.h"
+#include "lgc.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
+#include "lvm.h"
+
+
+/*
+** The optimizer rewrites the prototypes of a chunk after the parser is
+** done with them and only relies on what the bytecode itself says.
+** Inlined functions ignore changes made through the debug library to
+** the locals and upvalues they use. Globals are never kept in registers
+** across instructions: other chunks, '_G', metamethods, hooks and the
+** coroutines a preempted thread yields to may all change them.
+*/
+
+/* minimum number of tests in a chain worth an OP_SWITCH */
+#if !defined(LUAI_MINSWITCH)
+#define LUAI_MINSWITCH	4
+#endif
+
+/* minimum number of entries in a constructor worth an OP_TEMPLATE */
+#if !defined(LUAI_MINTEMPLATE)
+#define LUAI_MINTEMPLATE	2
+#endif
+
+/* maximum length of a chain of jumps followed by 'threadjumps' */
+#define MAXCHAIN	100
+
+
+/* flags for each instruction */
+#define TARGET		1	/* a jump or a skip lands here */
+#define REACHED		2	/* reachable from the entry point */
+#define DELETED		4	/* removed by 'compact' */
+#define PINNED		8	/* skipped or used by the previous instruction */
+#define INCHAIN		16	/* test in a chain already turned into a switch */
+
+
+typedef struct OptState {
+  lua_State *L;
+  Proto *f;  /* function being optimized */
+  lu_byte *flags;  /* flags of each instruction */
+  int *aux;  /* work array, as large as the code plus one */
+  int *lines;  /* line of each instruction (see 'getlines') */
+  ptrdiff_t lineslot;  /* stack slot that keeps 'lines' */
+} OptState;
+
+
+#define target(pc,i)	((pc) + 1 + GETARG_sBx(i))
+
+#define isjump(op)	((op) == OP_JMP || (op) == OP_FORLOOP || \
+			 (op) == OP_FORPREP || (op) == OP_TFORLOOP || \
+			 (op) == OP_JTRUE || (op) == OP_JFALSE)
+
+/* does 'i' skip the next instruction or use it as an extra argument? */
+#define skipsnext(i)	(testTMode(GET_OPCODE(i)) || \
+	(GET_OPCODE(i) == OP_LOADBOOL && GETARG_C(i) != 0) || \
+	GET_OPCODE(i) == OP_LOADKX || \
+	(GET_OPCODE(i) == OP_SETLIST && GETARG_C(i) == 0))
+
+
+/*
+** (Re)allocates the work arrays for the current size of the code. They
+** live in a userdata in the stack slot reserved by 'optimize', so that
+** an error in the middle of the optimizer does not leak them.
+*/
+static void newscratch (OptState *os) {
+  lua_State *L = os->L;
+  size_t n = cast(size_t, os->f->sizecode) + 1;
+  Udata *u = luaS_newudata(L, n * (sizeof(int) + 1), NULL);
+  setuvalue(L, L->top - 1, u);
+  os->aux = cast(int *, u + 1);
+  os->flags = cast(lu_byte *, os->aux + n);
+}
+
+
+/*
+** Puts a new array for the lines of 'n' instructions in the stack slot
+** of the lines. The old one stays there until then, so it can be copied
+** from.
+*/
+static int *newlines (OptState *os, int n) {
+  lua_State *L = os->L;
+  Udata *u = luaS_newudata(L, cast(size_t, n) * sizeof(int), NULL);
+  setuvalue(L, restorestack(L, os->lineslot), u);
+  os->lines = cast(int *, u + 1);
+  return os->lines;
+}
+
+
+/*
+** Returns the line of each instruction (NULL for a function without
+** debug information). The lines are unpacked from 'lineinfo' when a
+** pass first moves instructions around, and 'packlines' packs them
+** back at the end.
+*/
+static int *getlines (OptState *os) {
+  Proto *f = os->f;
+  if (os->lines == NULL && f->lineinfo != NULL) {
+    int *lines = newlines(os, f->sizecode);
+    int pc, a = 0;
+    int line = f->linedefined;
+    for (pc = 0; pc < f->sizecode; pc++) {
+      if (f->lineinfo[pc] == ABSLINEINFO)
+        line = f->abslineinfo[a++].line;
+      else
+        line += f->lineinfo[pc];
+      lines[pc] = line;
+    }
+  }
+  return os->lines;
+}
+
+
+/* encodes the lines again, as 'savelineinfo' in lcode.c does */
+static void packlines (OptState *os) {
+  lua_State *L = os->L;
+  Proto *f = os->f;
+  int n = f->sizecode;
+  int pc, nabs = 0, iwthabs = 0;
+  int previous = f->linedefined;
+  if (os->lines == NULL) return;  /* nothing moved */
+  luaM_reallocvector(L, f->lineinfo, f->sizelineinfo, n, ls_byte);
+  f->sizelineinfo = n;
+  for (pc = 0; pc < n; pc++) {
+    int line = os->lines[pc];
+    int linedif = line - previous;
+    if (abs(linedif) >= LIMLINEDIFF || iwthabs++ >= MAXIWTHABS) {
+      luaM_growvector(L, f->abslineinfo, nabs, f->sizeabslineinfo,
+                      AbsLineInfo, MAX_INT, "lines");
+      f->abslineinfo[nabs].pc = pc;
+      f->abslineinfo[nabs++].line = line;
+      linedif = ABSLINEINFO;
+      iwthabs = 1;
+    }
+    f->lineinfo[pc] = cast(ls_byte, linedif);
+    previous = line;
+  }
+  luaM_reallocvector(L, f->abslineinfo, f->sizeabslineinfo, nabs,
+                     AbsLineInfo);
+  f->sizeabslineinfo = nabs;
+}
+
+
+/*
+** Fills 's' with the positions that may run after the instruction at
+** 'pc' and returns how many there are. The jump after a test and the
+** instruction skipped by a LOADBOOL count as successors, so that they
+** are never removed on their own.
+*/
+static int successors (const Proto *f, int pc, int *s) {
+  Instruction i = f->code[pc];
+  OpCode op = GET_OPCODE(i);
+  switch (op) {
+    case OP_JMP:
+      s[0] = target(pc, i);
+      return 1;
+    case OP_RETURN:
+      return 0;
+    case OP_FORLOOP: case OP_FORPREP: case OP_TFORLOOP:
+    case OP_JTRUE: case OP_JFALSE:
+      s[0] = pc + 1;
+      s[1] = target(pc, i);
+      return 2;
+    case OP_JEQ: case OP_JNE: case OP_JLT: case OP_JNLT: case OP_JLE:
+    case OP_JNLE:
+      s[0] = pc + 1;
+      s[1] = pc + 1 + GETARG_sA(i);
+      return 2;
+    default:
+      s[0] = pc + 1;
+      if (testTMode(op) || (op == OP_LOADBOOL && GETARG_C(i) != 0)) {
+        s[1] = pc + 2;
+        return 2;
+      }
+      return 1;
+  }
+}
+
+
+/* computes the flags TARGET, PINNED and REACHED of every instruction */
+static void analyze (OptState *os) {
+  const Proto *f = os->f;
+  int n = f->sizecode;
+  int *stack = os->aux;
+  int top = 0;
+  int pc, s[2], k, ns;
+  memset(os->flags, 0, n + 1);
+  for (pc = 0; pc < n; pc++) {
+    ns = successors(f, pc, s);
+    for (k = 0; k < ns; k++)
+      if (s[k] != pc + 1) os->flags[s[k]] |= TARGET;
+    if (skipsnext(f->code[pc])) os->flags[pc + 1] |= PINNED;
+  }
+  os->flags[0] |= REACHED;
+  stack[top++] = 0;
+  while (top > 0) {
+    ns = successors(f, stack[--top], s);
+    for (k = 0; k < ns; k++) {
+      if (s[k] < n && !(os->flags[s[k]] & REACHED)) {
+        os->flags[s[k]] |= REACHED;
+        stack[top++] = s[k];
+      }
+    }
+  }
+}
+
+
+/*
+** {======================================================
+** Registers used by instructions
+** =======================================================
+*/
+
+/* does closure 'p' capture register 'r' of the enclosing function? */
+static int captures (const Proto *p, int r) {
+  int i;
+  for (i = 0; i < p->sizeupvalues; i++)
+    if (p->upvalues[i].instack && p->upvalues[i].idx == r) return 1;
+  return 0;
+}
+
+
+/* may instruction 'i' read register 'r'? */
+static int reads (const Proto *f, Instruction i, int r) {
+  OpCode op = GET_OPCODE(i);
+  int a = GETARG_A(i);
+  int b = GETARG_B(i);
+  if (getOpMode(op) == iABC) {
+    int c = GETARG_C(i);
+    if (getBMode(op) == OpArgR || getBMode(op) == OpArgK) {
+      if (b == r) return 1;  /* (constants never equal a register) */
+    }
+    if (getCMode(op) == OpArgR || getCMode(op) == OpArgK) {
+      if (c == r) return 1;
+    }
+  }
+  switch (op) {
+    case OP_SETUPVAL: case OP_SETTABLE: case OP_TEST:
+    case OP_JTRUE: case OP_JFALSE:
+      return (r == a);
+    case OP_CONCAT:
+      return (b <= r && r <= GETARG_C(i));
+    case OP_CALL: case OP_TAILCALL:
+      return (r >= a && (b == 0 || r < a + b));
+    case OP_RETURN:
+      return (r >= a && (b == 0 || r < a + b - 1));
+    case OP_SETLIST:
+      return (r >= a && (b == 0 || r <= a + b));
+    case OP_FORLOOP: case OP_FORPREP: case OP_TFORCALL:
+      return (a <= r && r <= a + 2);
+    case OP_TFORLOOP:
+      return (r == a + 1);
+    case OP_CLOSURE:
+      return captures(f->p[GETARG_Bx(i)], r);
+    default:
+      return 0;
+  }
+}
+
+
+/* may instruction 'i' change register 'r'? */
+static int writes (Instruction i, int r) {
+  int a = GETARG_A(i);
+  switch (GET_OPCODE(i)) {
+    case OP_SETTABUP: case OP_SETUPVAL: case OP_SETTABLE: case OP_JMP:
+    case OP_EQ: case OP_LT: case OP_LE: case OP_TEST: case OP_RETURN:
+    case OP_SETLIST: case OP_EXTRAARG: case OP_JEQ: case OP_JNE: case OP_JLT:
+    case OP_JNLT: case OP_JLE: case OP_JNLE: case OP_JTRUE: case OP_JFALSE:
+      return 0;
+    case OP_LOADNIL:
+      return (a <= r && r <= a + GETARG_B(i));
+    case OP_SELF: case OP_TFORLOOP:
+      return (r == a || r == a + 1);
+    case OP_FORLOOP: case OP_FORPREP:
+      return (a <= r && r <= a + 3);
+    case OP_CALL: case OP_TAILCALL: case OP_VARARG:
+      return (r >= a);  /* (the frame of the callee starts above 'a') */
+    case OP_TFORCALL:
+      return (r >= a + 3);
+    default:
+      return (r == a);
+  }
+}
+
+
+/* does instruction 'i' always overwrite register 'r'? */
+static int kills (Instruction i, int r) {
+  int a = GETARG_A(i);
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: case OP_LOADK: case OP_LOADKX: case OP_LOADBOOL:
+    case OP_GETUPVAL: case OP_GETTABUP: case OP_GETTABLE: case OP_NEWTABLE:
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+    case OP_POW: case OP_UNM: case OP_NOT: case OP_LEN: case OP_CONCAT:
+    case OP_CLOSURE: case OP_ADDI: case OP_SUBI: case OP_TEMPLATE:
+      return (r == a);
+    case OP_LOADNIL:
+      return (a <= r && r <= a + GETARG_B(i));
+    case OP_SELF:
+      return (r == a || r == a + 1);
+    case OP_CALL:
+      return (GETARG_C(i) != 0 && a <= r && r <= a + GETARG_C(i) - 2);
+    case OP_VARARG:
+      return (GETARG_B(i) != 0 && a <= r && r <= a + GETARG_B(i) - 2);
+    default:
+      return 0;
+  }
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Local variables
+** =======================================================
+*/
+
+/* register of local 'v' (locals take registers in order of activation) */
+static int localreg (const Proto *f, int v) {
+  int pc = f->locvars[v].startpc;
+  int i, n = 0;
+  for (i = 0; i < v; i++)
+    if (f->locvars[i].startpc <= pc && pc < f->locvars[i].endpc) n++;
+  return n;
+}
+
+
+/* is upvalue 'u' of 'p' assigned by 'p' or by a function nested in it? */
+static int setsupval (const Proto *p, int u) {
+  int pc, i, j;
+  if (p->lazytext != NULL) return 1;  /* not compiled yet: assume it is */
+  for (pc = 0; pc < p->sizecode; pc++) {
+    Instruction ins = p->code[pc];
+    if (GET_OPCODE(ins) == OP_SETUPVAL && GETARG_B(ins) == u) return 1;
+  }
+  for (i = 0; i < p->sizep; i++) {
+    const Proto *c = p->p[i];
+    for (j = 0; j < c->sizeupvalues; j++)
+      if (!c->upvalues[j].instack && c->upvalues[j].idx == u &&
+          setsupval(c, j)) return 1;
+  }
+  return 0;
+}
+
+
+/* local active at 'pc' in register 'r' (-1 if there is none) */
+static int findlocal (const Proto *f, int pc, int r) {
+  int v;
+  for (v = 0; v < f->sizelocvars; v++) {
+    const LocVar *lv = &f->locvars[v];
+    if (lv->startpc <= pc && pc < lv->endpc && localreg(f, v) == r) return v;
+  }
+  return -1;
+}
+
+
+/*
+** Is register 'r' at 'pc' a local that nothing changes while it is
+** active (neither 'f' nor the closures that capture it)? A local
+** function is not active yet where its own closure is created, so it
+** never captures itself by value.
+*/
+static int isfixed (const Proto *f, int pc, int r) {
+  int v = findlocal(f, pc, r);
+  int i, j;
+  if (v < 0) return 0;  /* not an active local */
+  for (i = f->locvars[v].startpc; i < f->locvars[v].endpc; i++) {
+    Instruction ins = f->code[i];
+    if (writes(ins, r)) return 0;
+    if (GET_OPCODE(ins) == OP_CLOSURE) {
+      const Proto *c = f->p[GETARG_Bx(ins)];
+      for (j = 0; j < c->sizeupvalues; j++)
+        if (c->upvalues[j].instack && c->upvalues[j].idx == r &&
+            setsupval(c, j)) return 0;
+    }
+  }
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** Jump threading: a jump to a jump goes straight to the final target,
+** closing upvalues from the lowest level any jump of the chain closes;
+** a jump to a return that does not depend on 'top' becomes a copy of
+** the return (unless it is the jump of a test).
+*/
+static void threadjumps (OptState *os) {
+  Proto *f = os->f;
+  Instruction *code = f->code;
+  int pc;
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction i = code[pc];
+    if (GET_OPCODE(i) == OP_JMP) {
+      int a = GETARG_A(i);
+      int t = target(pc, i);
+      int chain = 0;
+      while (t != pc && GET_OPCODE(code[t]) == OP_JMP && chain++ < MAXCHAIN) {
+        int a1 = GETARG_A(code[t]);
+        if (a1 != 0 && (a == 0 || a1 < a)) a = a1;
+        t = target(t, code[t]);
+      }
+      if (GET_OPCODE(code[t]) == OP_RETURN && GETARG_B(code[t]) != 0 &&
+          !(os->flags[pc] & PINNED))
+        code[pc] = code[t];  /* (RETURN closes all upvalues anyway) */
+      else {
+        SETARG_A(code[pc], a);
+        SETARG_sBx(code[pc], t - (pc + 1));
+      }
+    }
+  }
+}
+
+
+/*
+** Unreachable code, and jumps that only skip removed code.
+*/
+static void unreachable (OptState *os) {
+  Proto *f = os->f;
+  int pc;
+  for (pc = 0; pc < f->sizecode; pc++)
+    if (!(os->flags[pc] & REACHED)) os->flags[pc] |= DELETED;
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    if (GET_OPCODE(i) == OP_JMP && GETARG_A(i) == 0 &&
+        !(os->flags[pc] & (DELETED | PINNED))) {
+      int t = target(pc, i);
+      int j = pc + 1;
+      while (j < t && (os->flags[j] & DELETED)) j++;
+      if (j == t) os->flags[pc] |= DELETED;
+    }
+  }
+}
+
+
+/*
+** Finds the LOADK that initializes register 'reg' for a local starting
+** at 'start', looking back over the other constant loads of the same
+** declaration. Returns -1 if there is none.
+*/
+static int findinit (OptState *os, int start, int reg) {
+  Proto *f = os->f;
+  int pc;
+  for (pc = start - 1; pc >= 0; pc--) {
+    Instruction i = f->code[pc];
+    OpCode op = GET_OPCODE(i);
+    if (os->flags[pc] & DELETED) continue;
+    if (op != OP_LOADK && op != OP_LOADNIL &&
+        !(op == OP_LOADBOOL && GETARG_C(i) == 0))
+      return -1;
+    if (writes(i, reg))
+      return (op == OP_LOADK) ? pc : -1;
+  }
+  return -1;
+}
+
+
+/*
+** Is register 'reg', loaded at 'init', left alone by [start, end)? Also
+** checks that nothing else enters the code between the load and the end
+** of the scope, as a jump around the load would not see the constant.
+*/
+static int isconstant (OptState *os, int init, int start, int end, int reg) {
+  Proto *f = os->f;
+  int pc, k, s[2];
+  if (start >= end) return 0;
+  for (pc = start; pc < end; pc++) {
+    if (!(os->flags[pc] & DELETED) && writes(f->code[pc], reg)) return 0;
+    if (GET_OPCODE(f->code[pc]) == OP_CLOSURE &&
+        captures(f->p[GETARG_Bx(f->code[pc])], reg))
+      return 0;  /* closure may change it */
+  }
+  for (pc = 0; pc < f->sizecode; pc++) {
+    int ns;
+    if ((init <= pc && pc < end) || (os->flags[pc] & DELETED)) continue;
+    ns = successors(f, pc, s);
+    for (k = 0; k < ns; k++)
+      if (init < s[k] && s[k] < end) return 0;
+  }
+  return 1;
+}
+
+
+/*
+** Propagation of constant locals: a local initialized by a LOADK and
+** never changed while it is active is replaced by the constant where
+** an RK operand or a MOVE reads it. The LOADK goes away when nothing
+** reads the register any more.
+*/
+static void propagate (OptState *os) {
+  Proto *f = os->f;
+  int v;
+  for (v = 0; v < f->sizelocvars; v++) {
+    int start = f->locvars[v].startpc;
+    int end = f->locvars[v].endpc;
+    int reg = localreg(f, v);
+    int init = findinit(os, start, reg);
+    int k, pc, used = 0;
+    if (init < 0 || !isconstant(os, init, start, end, reg)) continue;
+    k = GETARG_Bx(f->code[init]);
+    for (pc = start; pc < end; pc++) {
+      Instruction *i = &f->code[pc];
+      OpCode op = GET_OPCODE(*i);
+      if (os->flags[pc] & DELETED) continue;
+      if (op == OP_MOVE && GETARG_B(*i) == reg)
+        *i = CREATE_ABx(OP_LOADK, GETARG_A(*i), k);
+      else if (getOpMode(op) == iABC && k <= MAXINDEXRK) {
+        if (getBMode(op) == OpArgK && GETARG_B(*i) == reg)
+          SETARG_B(*i, RKASK(k));
+        if (getCMode(op) == OpArgK && GETARG_C(*i) == reg)
+          SETARG_C(*i, RKASK(k));
+      }
+      if (reads(f, *i, reg)) used = 1;
+    }
+    if (!used && !(os->flags[init] & PINNED))
+      os->flags[init] |= DELETED;
+  }
+}
+
+
+/*
+** Dead stores inside basic blocks: a MOVE or a load into a register
+** that is overwritten before anything reads it. Registers captured by
+** closures are left alone, as the closure may see every store.
+*/
+static void deadstores (OptState *os) {
+  Proto *f = os->f;
+  lu_byte captured[MAXARG_A + 1];
+  int pc, j;
+  memset(captured, 0, sizeof(captured));
+  for (pc = 0; pc < f->sizep; pc++) {
+    Proto *p = f->p[pc];
+    for (j = 0; j < p->sizeupvalues; j++)
+      if (p->upvalues[j].instack) captured[p->upvalues[j].idx] = 1;
+  }
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    OpCode op = GET_OPCODE(i);
+    int r = GETARG_A(i);
+    if ((os->flags[pc] & (DELETED | PINNED)) || captured[r]) continue;
+    if (!(op == OP_MOVE || op == OP_LOADK || op == OP_GETUPVAL ||
+          (op == OP_LOADBOOL && GETARG_C(i) == 0) ||
+          (op == OP_LOADNIL && GETARG_B(i) == 0)))
+      continue;
+    for (j = pc + 1; j < f->sizecode; j++) {
+      Instruction ij = f->code[j];
+      int s[2];
+      if (os->flags[j] & TARGET) break;  /* end of the basic block */
+      if (os->flags[j] & DELETED) continue;
+      if (reads(f, ij, r)) break;
+      if (kills(ij, r)) {
+        os->flags[pc] |= DELETED;
+        break;
+      }
+      if (successors(f, j, s) != 1 || s[0] != j + 1) break;
+    }
+  }
+}
+
+
+/*
+** MOVEs to the same register, and MOVEs undoing the MOVE just before.
+*/
+static void moves (OptState *os) {
+  Proto *f = os->f;
+  int last = -1;  /* previous instruction left in the code */
+  int entered = 0;  /* some jump lands between 'last' and 'pc' */
+  int pc;
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    if (os->flags[pc] & TARGET) entered = 1;
+    if (os->flags[pc] & DELETED) continue;
+    if (GET_OPCODE(i) == OP_MOVE && !(os->flags[pc] & PINNED)) {
+      int a = GETARG_A(i);
+      int b = GETARG_B(i);
+      if (a == b ||
+          (!entered && last >= 0 && !(os->flags[last] & PINNED) &&
+           GET_OPCODE(f->code[last]) == OP_MOVE &&
+           GETARG_A(f->code[last]) == b && GETARG_B(f->code[last]) == a)) {
+        os->flags[pc] |= DELETED;
+        continue;
+      }
+    }
+    last = pc;
+    entered = 0;
+  }
+}
+
+
+/*
+** Removes deleted instructions, retargeting jumps (a jump to a removed
+** instruction goes to the next one left) and moving the debug
+** information with the code.
+*/
+static void compact (OptState *os) {
+  lua_State *L = os->L;
+  Proto *f = os->f;
+  int *map = os->aux;
+  int *lines;
+  int n = f->sizecode;
+  int pc, k = 0;
+  for (pc = 0; pc < n; pc++) {
+    map[pc] = k;
+    if (!(os->flags[pc] & DELETED)) k++;
+  }
+  map[n] = k;
+  if (k == n) return;  /* nothing to remove */
+  lines = getlines(os);
+  for (pc = 0; pc < n; pc++) {
+    if (!(os->flags[pc] & DELETED)) {
+      Instruction i = f->code[pc];
+      if (isjump(GET_OPCODE(i)))
+        SETARG_sBx(i, map[target(pc, i)] - (map[pc] + 1));
+      else if (isjumpcmp(GET_OPCODE(i)))
+        SETARG_sA(i, map[pc + 1 + GETARG_sA(i)] - (map[pc] + 1));
+      f->code[map[pc]] = i;
+      if (lines != NULL)
+        lines[map[pc]] = lines[pc];
+    }
+  }
+  for (pc = 0; pc < f->sizelocvars; pc++) {
+    f->locvars[pc].startpc = map[f->locvars[pc].startpc];
+    f->locvars[pc].endpc = map[f->locvars[pc].endpc];
+  }
+  luaM_reallocvector(L, f->code, n, k, Instruction);
+  f->sizecode = k;
+}
+
+
+/*
+** {======================================================
+** Inlining of local functions
+** =======================================================
+*/
+
+/* largest function (in instructions) copied into its callers */
+#if !defined(LUAI_MAXINLINE)
+#define LUAI_MAXINLINE	16
+#endif
+
+
+/* shifts by 'm' the registers at or above 'base' used by 'i' */
+static Instruction shiftregs (Proto *f, Instruction i, int base, int m) {
+  OpCode op = GET_OPCODE(i);
+  int a = GETARG_A(i);
+  switch (op) {
+    case OP_SETTABUP: case OP_EQ: case OP_LT: case OP_LE: case OP_EXTRAARG:
+    case OP_JEQ: case OP_JNE: case OP_JLT: case OP_JNLT: case OP_JLE:
+    case OP_JNLE:
+      break;  /* A is not a register */
+    case OP_JMP:
+      if (a > 0 && a - 1 >= base) SETARG_A(i, a + m);
+      break;
+    default:
+      if (a >= base) SETARG_A(i, a + m);
+  }
+  if (getOpMode(op) == iABC) {
+    int b = GETARG_B(i);
+    int c = GETARG_C(i);
+    if ((getBMode(op) == OpArgR || (getBMode(op) == OpArgK && !ISK(b))) &&
+        b >= base)
+      SETARG_B(i, b + m);
+    if ((getCMode(op) == OpArgR || (getCMode(op) == OpArgK && !ISK(c))) &&
+        c >= base)
+      SETARG_C(i, c + m);
+  }
+  if (op == OP_CLOSURE) {
+    Proto *p = f->p[GETARG_Bx(i)];
+    int u;
+    for (u = 0; u < p->sizeupvalues; u++)
+      if (p->upvalues[u].instack && p->upvalues[u].idx >= base)
+        p->upvalues[u].idx += m;
+  }
+  return i;
+}
+
+
+/* are 'k1' and 'k2' the same constant? (zeros of different sign are not) */
+static int samek (const TValue *k1, const TValue *k2) {
+  if (ttisnumber(k1))
+    return ttisnumber(k2) && luai_numeq(nvalue(k1), nvalue(k2)) &&
+           (nvalue(k1) != 0 || luai_numeq(1 / nvalue(k1), 1 / nvalue(k2)));
+  return luaV_rawequalobj(k1, k2);
+}
+
+
+/* index of constant 'v' in 'f' (-1 if it has none) */
+static int findk (const Proto *f, const TValue *v) {
+  int i;
+  for (i = 0; i < f->sizek; i++)
+    if (samek(&f->k[i], v)) return i;
+  return -1;
+}
+
+
+/*
+** index that constant 'j' of 'c' gets in 'f' once 'mapk' adds the ones
+** 'f' lacks, in order, to its end
+*/
+static int newk (const Proto *f, const Proto *c, int j) {
+  int i, n = findk(f, &c->k[j]);
+  if (n >= 0) return n;
+  n = f->sizek;
+  for (i = 0; i < j; i++)
+    if (findk(f, &c->k[i]) < 0) n++;
+  return n;
+}
+
+
+static void mapk (lua_State *L, Proto *f, const Proto *c, int *kmap) {
+  int j;
+  for (j = 0; j < c->sizek; j++) {
+    int n = findk(f, &c->k[j]);
+    if (n < 0) {
+      n = f->sizek;
+      luaM_reallocvector(L, f->k, n, n + 1, TValue);
+      setobj(L, &f->k[n], &c->k[j]);
+      f->sizek++;
+      luaC_barrier(L, f, &c->k[j]);
+    }
+    kmap[j] = n;
+  }
+}
+
+
+/*
+** Can 'c', whose closure lives in register 'r', be copied into its
+** callers? It must be small, take a fixed number of arguments, create
+** no closures, not refer to itself, and return a fixed number of
+** values (or the results of a tail call).
+*/
+static int inlinable (const Proto *c, int r) {
+  int pc, u;
+  if (c->lazytext != NULL || c->is_vararg || c->sizep > 0 ||
+      c->sizecode > LUAI_MAXINLINE)
+    return 0;
+  for (u = 0; u < c->sizeupvalues; u++)
+    if (c->upvalues[u].instack && c->upvalues[u].idx == r)
+      return 0;  /* recursive */
+  for (pc = 0; pc < c->sizecode; pc++) {
+    Instruction i = c->code[pc];
+    switch (GET_OPCODE(i)) {
+      case OP_LOADKX: case OP_EXTRAARG: return 0;
+      case OP_JMP: if (GETARG_A(i) != 0) return 0; break;
+      case OP_SETLIST: if (GETARG_C(i) == 0) return 0; break;
+      case OP_RETURN:
+        if (GETARG_B(i) == 0 &&
+            (pc == 0 || GET_OPCODE(c->code[pc - 1]) != OP_TAILCALL))
+          return 0;
+        break;
+      default: break;
+    }
+  }
+  return 1;
+}
+
+
+/*
+** Can the call at 'call' of 'f' run the code of 'c' (created at
+** 'closure') instead? It must pass a fixed number of arguments and, if
+** it is not a tail call, want a fixed number of results. The locals 'c'
+** captures must never change and still be active at the call, and the
+** registers and constants of 'c' must fit in 'f'.
+*/
+static int caninline (const Proto *f, const Proto *c, int closure,
+                      int call) {
+  Instruction i = f->code[call];
+  int base = GETARG_A(i) + 1;
+  int pc, u;
+  if (GETARG_B(i) == 0 || (GET_OPCODE(i) == OP_CALL && GETARG_C(i) == 0) ||
+      base + c->maxstacksize > MAXSTACK ||
+      f->sizecode + c->sizecode * (GETARG_C(i) + 2) > MAXARG_sBx)
+    return 0;
+  for (u = 0; u < c->sizeupvalues; u++) {
+    int r = c->upvalues[u].idx;
+    int v = findlocal(f, closure, r);
+    if (!c->upvalues[u].instack) continue;
+    if (v < 0 || !isfixed(f, closure, r) || call < f->locvars[v].startpc ||
+        f->locvars[v].endpc <= call)
+      return 0;
+  }
+  for (pc = 0; pc < c->sizecode; pc++) {
+    Instruction ci = c->code[pc];
+    OpCode op = GET_OPCODE(ci);
+    if (getOpMode(op) != iABC) continue;
+    if ((getBMode(op) == OpArgK && ISK(GETARG_B(ci)) &&
+         newk(f, c, INDEXK(GETARG_B(ci))) > MAXINDEXRK) ||
+        (getCMode(op) == OpArgK && ISK(GETARG_C(ci)) &&
+         newk(f, c, INDEXK(GETARG_C(ci))) > MAXINDEXRK))
+      return 0;
+  }
+  return 1;
+}
+
+
+/*
+** instructions that replace instruction 'pc' of 'c' inlined into a call
+** wanting 'nres' results (-1 for a tail call)
+*/
+static int width (const Proto *c, int pc, int nres) {
+  Instruction i = c->code[pc];
+  int nret = GETARG_B(i) - 1;
+  if (GET_OPCODE(i) != OP_RETURN || nres < 0) return 1;
+  if (nret < 0) nret = nres;  /* results of a tail call */
+  return ((nres < nret) ? nres : nret) + (nres > nret) +
+         (pc + 1 < c->sizecode);  /* moves, nils, and jump to the end */
+}
+
+
+/* instruction 'i' of 'c' for a frame at 'base' of 'f' */
+static Instruction relocate (const Proto *c, Instruction i, int base,
+                             const int *kmap) {
+  OpCode op;
+  const Upvaldesc *uv;
+  i = shiftregs(cast(Proto *, c), i, 0, base);
+  op = GET_OPCODE(i);
+  switch (op) {
+    case OP_GETUPVAL: case OP_SETUPVAL:
+      uv = &c->upvalues[GETARG_B(i)];
+      if (uv->instack)  /* (only reads, see 'caninline') */
+        return CREATE_ABC(OP_MOVE, GETARG_A(i), uv->idx, 0);
+      SETARG_B(i, uv->idx);
+      return i;
+    case OP_GETTABUP:
+      uv = &c->upvalues[GETARG_B(i)];
+      if (uv->instack) i = CREATE_ABC(OP_GETTABLE, GETARG_A(i), uv->idx,
+                                      GETARG_C(i));
+      else SETARG_B(i, uv->idx);
+      break;
+    case OP_SETTABUP:
+      uv = &c->upvalues[GETARG_A(i)];
+      if (uv->instack) i = CREATE_ABC(OP_SETTABLE, uv->idx, GETARG_B(i),
+                                      GETARG_C(i));
+      else SETARG_A(i, uv->idx);
+      break;
+    case OP_LOADK:
+      SETARG_Bx(i, kmap[GETARG_Bx(i)]);
+      return i;
+    default: break;
+  }
+  op = GET_OPCODE(i);
+  if (getOpMode(op) == iABC) {
+    if (getBMode(op) == OpArgK && ISK(GETARG_B(i)))
+      SETARG_B(i, RKASK(kmap[INDEXK(GETARG_B(i))]));
+    if (getCMode(op) == OpArgK && ISK(GETARG_C(i)))
+      SETARG_C(i, RKASK(kmap[INDEXK(GETARG_C(i))]));
+  }
+  return i;
+}
+
+
+/*
+** Puts the code of 'c' in place of the call at 'call', which has the
+** function in register 'a'. The body runs with its frame right above,
+** where the arguments already are (missing ones are set to nil). Each
+** return moves the results down to 'a' and jumps to the end; in a tail
+** call, the returns and tail calls of 'c' stay as they are and return
+** from 'f'. The body keeps the lines of 'c'.
+*/
+static void expand (OptState *os, const Proto *c, int call) {
+  lua_State *L = os->L;
+  Proto *f = os->f;
+  Instruction ci = f->code[call];
+  int a = GETARG_A(ci);
+  int base = a + 1;
+  int nargs = GETARG_B(ci) - 1;
+  int nres = (GET_OPCODE(ci) == OP_TAILCALL) ? -1 : GETARG_C(ci) - 1;
+  int *flines = getlines(os);
+  int line = (flines != NULL) ? flines[call] : 0;
+  int n = f->sizecode;
+  int size = 1, pc, k, j, m, v;
+  Instruction *body, *code;
+  int *lines, *map, *kmap;
+  Udata *u;
+  for (pc = 0; pc < c->sizecode; pc++)
+    size += width(c, pc, nres);
+  u = luaS_newudata(L, size * (sizeof(Instruction) + sizeof(int)) +
+                       (c->sizecode + c->sizek + 1) * sizeof(int), NULL);
+  setuvalue(L, L->top, u);  /* anchor it */
+  incr_top(L);
+  body = cast(Instruction *, u + 1);
+  lines = cast(int *, body + size);
+  map = lines + size;
+  kmap = map + c->sizecode + 1;
+  mapk(L, f, c, kmap);
+  k = 0;
+  if (nargs < c->numparams) {  /* missing arguments are nil */
+    lines[k] = line;
+    body[k++] = CREATE_ABC(OP_LOADNIL, base + nargs,
+                           c->numparams - nargs - 1, 0);
+  }
+  for (pc = 0; pc < c->sizecode; pc++) {  /* where each instruction goes */
+    map[pc] = k;
+    k += width(c, pc, nres);
+  }
+  map[pc] = size = k;
+  for (pc = 0; pc < c->sizecode; pc++) {
+    Instruction i = c->code[pc];
+    OpCode op = GET_OPCODE(i);
+    int l = (c->lineinfo != NULL) ? luaG_getfuncline(c, pc) : line;
+    k = map[pc];
+    if (op == OP_RETURN && nres >= 0) {
+      int r = base + GETARG_A(i);
+      int nret = (GETARG_B(i) == 0) ? nres : GETARG_B(i) - 1;
+      for (j = 0; j < nres && j < nret; j++, k++) {
+        lines[k] = l;
+        body[k] = CREATE_ABC(OP_MOVE, a + j, r + j, 0);
+      }
+      if (nres > nret) {
+        lines[k] = l;
+        body[k++] = CREATE_ABC(OP_LOADNIL, a + nret, nres - nret - 1, 0);
+      }
+      if (k < map[pc + 1]) {
+        lines[k] = l;
+        body[k] = CREATE_ABx(OP_JMP, 0, size - (k + 1) + MAXARG_sBx);
+      }
+      continue;
+    }
+    if (op == OP_TAILCALL && nres >= 0)  /* now an ordinary call */
+      i = CREATE_ABC(OP_CALL, GETARG_A(i), GETARG_B(i), nres + 1);
+    else if (isjump(op))
+      SETARG_sBx(i, map[target(pc, i)] - (k + 1));
+    lines[k] = l;
+    body[k] = relocate(c, i, base, kmap);
+  }
+  /* splice the body in place of the call */
+  m = size - 1;
+  code = luaM_newvector(L, n + m, Instruction);
+  for (pc = 0; pc < n; pc++) {
+    Instruction i = f->code[pc];
+    int npc = (pc < call) ? pc : pc + m;
+    if (pc == call) continue;
+    if (isjump(GET_OPCODE(i))) {
+      int t = target(pc, i);
+      if (t > call) t += m;
+      SETARG_sBx(i, t - (npc + 1));
+    }
+    code[npc] = i;
+  }
+  memcpy(code + call, body, size * sizeof(Instruction));
+  luaM_freearray(L, f->code, n);
+  f->code = code;
+  f->sizecode = n + m;
+  if (flines != NULL) {
+    int *li = newlines(os, n + m);
+    memcpy(li, flines, call * sizeof(int));
+    memcpy(li + call, lines, size * sizeof(int));
+    memcpy(li + call + size, flines + call + 1,
+           (n - call - 1) * sizeof(int));
+  }
+  for (v = 0; v < f->sizelocvars; v++) {
+    LocVar *lv = &f->locvars[v];
+    if (lv->startpc > call) lv->startpc += m;
+    if (lv->endpc > call) lv->endpc += m;
+  }
+  if (f->maxstacksize < base + c->maxstacksize)
+    f->maxstacksize = cast_byte(base + c->maxstacksize);
+  L->top--;
+}
+
+
+/*
+** position of the call of the function loaded into register 'a' by the
+** MOVE at 'pc' (-1 if something else changes 'a' first). The MOVE and
+** the call must be in the same basic block: a jump or a test between
+** them, or another way into the call, could bring a different function.
+*/
+static int findcall (OptState *os, int pc, int a) {
+  const Proto *f = os->f;
+  int s[2];
+  for (pc++; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    if (os->flags[pc] & TARGET) return -1;
+    if ((GET_OPCODE(i) == OP_CALL || GET_OPCODE(i) == OP_TAILCALL) &&
+        GETARG_A(i) == a)
+      return pc;
+    if (writes(i, a) || successors(f, pc, s) != 1 || s[0] != pc + 1)
+      return -1;
+  }
+  return -1;
+}
+
+
+/*
+** Calls to small local functions that are never assigned run their
+** code in the caller instead. The MOVE that loaded the function becomes
+** a MOVE to itself, for 'moves' to remove. (Such calls do not show up
+** in tracebacks and hooks.)
+*/
+static void inlinecalls (OptState *os) {
+  Proto *f = os->f;
+  int pc, q;
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    const Proto *c;
+    int r, v;
+    if (GET_OPCODE(i) != OP_CLOSURE) continue;
+    c = f->p[GETARG_Bx(i)];
+    r = GETARG_A(i);
+    v = findlocal(f, pc + 1, r);
+    if (v < 0 || f->locvars[v].startpc != pc + 1 || !inlinable(c, r) ||
+        !isfixed(f, pc + 1, r))
+      continue;
+    for (q = pc + 1; q < f->locvars[v].endpc; q++) {
+      Instruction mv = f->code[q];
+      int call;
+      if (GET_OPCODE(mv) != OP_MOVE || GETARG_B(mv) != r ||
+          GETARG_A(mv) == r)
+        continue;
+      call = findcall(os, q, GETARG_A(mv));
+      if (call >= 0 && caninline(f, c, pc, call)) {
+        SETARG_B(f->code[q], GETARG_A(mv));
+        expand(os, c, call);
+        newscratch(os);  /* the code changed */
+        analyze(os);
+      }
+    }
+  }
+}
+
+/* }====================================================== */
+
+
+static void optimize (OptState *os, Proto *f) {
+  lua_State *L = os->L;
+  int i;
+  if (f->lazytext != NULL) return;  /* optimized when compiled */
+  for (i = 0; i < f->sizep; i++)
+    optimize(os, f->p[i]);
+  os->f = f;
+  os->lines = NULL;
+  os->lineslot = savestack(L, L->top);
+  setnilvalue(L->top);  /* slot for the lines */
+  incr_top(L);
+  setnilvalue(L->top);  /* slot for the work arrays */
+  incr_top(L);
+  newscratch(os);
+  analyze(os);
+  if (f->sizelocvars > 0)
+    inlinecalls(os);
+  threadjumps(os);
+  analyze(os);
+  unreachable(os);
+  propagate(os);
+  deadstores(os);
+  moves(os);
+  compact(os);
+  packlines(os);
+  L->top -= 2;
+}
+
+
+/*
+** Optimizes a chunk just compiled by the parser (which has all the
+** debug information) and all its functions.
+*/
+void luaK_optimize (lua_State *L, Proto *f) {
+  OptState os;
+  os.L = L;
+  optimize(&os, f);
+}
+
+
+/*
+** {======================================================
+** Superinstructions
+** =======================================================
+*/
+
+/*
+** If the instruction at 'pc' is an 'OP_EQ 0' of register 'r' (any
+** register if 'r' is -1) against a string or number constant followed
+** by a forward jump that closes nothing, returns the register; else
+** returns -1. (This is the first kind of test 'switchmap' in lvm.c
+** follows.)
+*/
+static int casetest (const Proto *f, int pc, int r) {
+  Instruction i = f->code[pc];
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+  int reg, k;
+  if (GET_OPCODE(i) != OP_EQ || GETARG_A(i) != 0 || pc + 1 >= f->sizecode)
+    return -1;
+  if (!ISK(b) && ISK(c)) { reg = b; k = INDEXK(c); }
+  else if (ISK(b) && !ISK(c)) { reg = c; k = INDEXK(b); }
+  else return -1;
+  i = f->code[pc + 1];
+  if ((r >= 0 && reg != r) ||
+      !(ttisstring(&f->k[k]) || ttisnumber(&f->k[k])) ||
+      GET_OPCODE(i) != OP_JMP || GETARG_A(i) != 0 || GETARG_sBx(i) < 0)
+    return -1;
+  return reg;
+}
+
+
+/*
+** Chains of 'if r == K1 then ... elseif r == K2 then ...' with at least
+** LUAI_MINSWITCH tests: the first test becomes an OP_SWITCH on 'r' (its
+** jump and the other tests stay, for the switch to build its map from).
+*/
+static void switches (OptState *os) {
+  Proto *f = os->f;
+  int pc, n = 0;
+  for (pc = 0; pc < f->sizecode && n <= MAXARG_A; pc++) {
+    int r = casetest(f, pc, -1);
+    int t = pc;
+    int len = 1;
+    Instruction i = f->code[pc];
+    if (r < 0 || (os->flags[pc] & (PINNED | INCHAIN))) continue;
+    while (t = target(t + 1, f->code[t + 1]), casetest(f, t, r) >= 0) {
+      os->flags[t] |= INCHAIN;
+      len++;
+    }
+    if (len >= LUAI_MINSWITCH)
+      f->code[pc] = CREATE_ABC(OP_SWITCH, n++, r,
+                               ISK(GETARG_C(i)) ? GETARG_C(i) : GETARG_B(i));
+  }
+}
+
+
+/* fused form of OP_EQ, OP_LT and OP_LE, by the condition in their A */
+static const lu_byte fusedcmp[3][2] = {
+  {OP_JNE, OP_JEQ}, {OP_JNLT, OP_JLT}, {OP_JNLE, OP_JLE}
+};
+
+
+/*
+** Fuses a comparison or a test with the jump that follows it, unless
+** the jump closes upvalues, something else jumps to it, or (for
+** comparisons) its target is out of reach of sA.
+*/
+static void fuse (OptState *os) {
+  Instruction *code = os->f->code;
+  int n = os->f->sizecode;
+  int pc;
+  for (pc = 0; pc + 1 < n; pc++) {
+    Instruction i = code[pc];
+    Instruction next = code[pc + 1];
+    OpCode op = GET_OPCODE(i);
+    if ((os->flags[pc] & PINNED) || (os->flags[pc + 1] & TARGET))
+      continue;
+    if (GET_OPCODE(next) == OP_JMP && GETARG_A(next) == 0) {
+      int d = target(pc + 1, next) - (pc + 1);  /* offset from 'pc' */
+      if (op == OP_TEST && d <= MAXARG_sBx)
+        code[pc] = CREATE_ABx(GETARG_C(i) ? OP_JTRUE : OP_JFALSE,
+                              GETARG_A(i), d + MAXARG_sBx);
+      else if ((op == OP_EQ || op == OP_LT || op == OP_LE) &&
+               -MAXARG_sA <= d && d <= MAXARG_sA)
+        code[pc] = CREATE_ABC(fusedcmp[op - OP_EQ][GETARG_A(i)],
+                              d + MAXARG_sA, GETARG_B(i), GETARG_C(i));
+      else continue;
+      os->flags[pc + 1] |= DELETED;  /* 'compact' fixes the offsets */
+    }
+  }
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Table templates
+** =======================================================
+*/
+
+/*
+** Follows the constructor of the OP_NEWTABLE at 'pc' over constant
+** loads into its list slots and stores of constants into the table,
+** and returns the position of the last store after which no loaded
+** slot is waiting for its OP_SETLIST ('pc' if there is none). Counts
+** the entries stored up to there in 'nstores'.
+*/
+static int constructor (OptState *os, int pc, int *nstores) {
+  const Proto *f = os->f;
+  int a = GETARG_A(f->code[pc]);
+  int end = pc;
+  int pending = 0, n = 0;
+  lu_byte loaded[LFIELDS_PER_FLUSH];
+  memset(loaded, 0, sizeof(loaded));
+  *nstores = 0;
+  for (pc++; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    int r = GETARG_A(i) - a - 1;  /* list slot it writes */
+    int j;
+    if (os->flags[pc] & (TARGET | PINNED | DELETED)) break;
+    switch (GET_OPCODE(i)) {
+      case OP_LOADBOOL:
+        if (GETARG_C(i) != 0) return end;
+        /* FALLTHROUGH */
+      case OP_LOADK: case OP_LOADNIL: {
+        int last = r + ((GET_OPCODE(i) == OP_LOADNIL) ? GETARG_B(i) : 0);
+        if (r < 0 || last >= LFIELDS_PER_FLUSH) return end;
+        for (j = r; j <= last; j++) {
+          if (!loaded[j]) { loaded[j] = 1; pending++; }
+        }
+        continue;
+      }
+      case OP_SETTABLE: {
+        int b = GETARG_B(i);
+        int c = GETARG_C(i);
+        int s = c - a - 1;
+        const TValue *k = &f->k[INDEXK(b)];
+        if (r != -1 || !ISK(b) || ttisnil(k) ||
+            (ttisnumber(k) && luai_numisnan(os->L, nvalue(k))))
+          return end;  /* (an invalid key is left to raise its error) */
+        if (!ISK(c)) {  /* value in a slot? it is consumed */
+          if (s < 0 || s >= LFIELDS_PER_FLUSH || !loaded[s]) return end;
+          loaded[s] = 0;
+          pending--;
+        }
+        n++;
+        break;
+      }
+      case OP_SETLIST: {
+        int b = GETARG_B(i);
+        if (r != -1 || b == 0 || GETARG_C(i) == 0) return end;
+        for (j = 0; j < b; j++)
+          if (!loaded[j]) return end;
+        memset(loaded, 0, sizeof(loaded));
+        pending = 0;
+        n += b;
+        break;
+      }
+      default:
+        return end;
+    }
+    if (pending == 0) {
+      end = pc;
+      *nstores = n;
+    }
+  }
+  return end;
+}
+
+
+/*
+** Builds the table that the constructor of the OP_NEWTABLE at 'pc'
+** has when it reaches 'end', running its stores on constants, and adds
+** it to the templates of the function.
+*/
+static void buildtemplate (OptState *os, int pc, int end) {
+  lua_State *L = os->L;
+  Proto *f = os->f;
+  Instruction i = f->code[pc];
+  int a = GETARG_A(i);
+  int n = f->sizetemplates;
+  TValue slots[LFIELDS_PER_FLUSH];
+  Table *t = luaH_new(L);
+  sethvalue(L, L->top, t);  /* anchor it */
+  incr_top(L);
+  luaH_resize(L, t, luaO_fb2int(GETARG_B(i)), luaO_fb2int(GETARG_C(i)));
+  for (pc++; pc <= end; pc++) {
+    int j, r;
+    i = f->code[pc];
+    r = GETARG_A(i) - a - 1;
+    switch (GET_OPCODE(i)) {
+      case OP_LOADK:
+        setobj(L, &slots[r], &f->k[GETARG_Bx(i)]);
+        break;
+      case OP_LOADBOOL:
+        setbvalue(&slots[r], GETARG_B(i));
+        break;
+      case OP_LOADNIL:
+        for (j = r; j <= r + GETARG_B(i); j++)
+          setnilvalue(&slots[j]);
+        break;
+      case OP_SETTABLE: {
+        int c = GETARG_C(i);
+        const TValue *v = ISK(c) ? &f->k[INDEXK(c)] : &slots[c - a - 1];
+        if (!ttisnil(v))
+          setobj2t(L, luaH_set(L, t, &f->k[INDEXK(GETARG_B(i))]), v);
+        break;
+      }
+      case OP_SETLIST: {
+        int b = GETARG_B(i);
+        int last = (GETARG_C(i) - 1) * LFIELDS_PER_FLUSH + b;
+        if (last > t->sizearray)  /* as OP_SETLIST does */
+          luaH_resizearray(L, t, last);
+        for (j = 0; j < b; j++) {
+          if (!ttisnil(&slots[j]))
+            luaH_setint(L, t, last - b + j + 1, &slots[j]);
+        }
+        break;
+      }
+      default: lua_assert(0);
+    }
+  }
+  luaM_reallocvector(L, f->templates, n, n + 1, Table *);
+  f->templates[n] = t;
+  f->sizetemplates = n + 1;
+  luaC_objbarrier(L, f, t);
+  L->top--;
+}
+
+
+/*
+** Constructors (or their leading parts) that only store constants into
+** the new table become an OP_TEMPLATE, which copies a table built here
+** with the same contents. The copy has the sizes the constructor would
+** have given it, so later stores into it do not rehash it.
+*/
+static void templates (OptState *os) {
+  Proto *f = os->f;
+  int pc, j;
+  for (pc = 0; pc < f->sizecode && f->sizetemplates <= MAXARG_Bx; pc++) {
+    int end, n;
+    if (GET_OPCODE(f->code[pc]) != OP_NEWTABLE) continue;
+    end = constructor(os, pc, &n);
+    if (n < LUAI_MINTEMPLATE) continue;
+    buildtemplate(os, pc, end);
+    f->code[pc] = CREATE_ABx(OP_TEMPLATE, GETARG_A(f->code[pc]),
+                             f->sizetemplates - 1);
+    for (j = pc + 1; j <= end; j++)
+      os->flags[j] |= DELETED;
+    pc = end;
+  }
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Upvalues captured by value
+** =======================================================
+*/
+
+/*
+** Marks the upvalues of the functions nested in 'f' that can be copied
+** into their closures: those of locals that never change after the
+** closure is created, and those of upvalues of 'f' that are copies
+** themselves. Each closure owns its copy, so the debug API sees them
+** apart: debug.setlocal on the local is not seen by the closures already
+** created, debug.setupvalue on one closure changes only that closure, and
+** debug.upvalueid differs between closures of the same local. (Sharing
+** whenever several closures capture a local would drop the copy for every
+** closure made in a loop, which is the case this is for.)
+*/
+static void byvalue (Proto *f) {
+  int pc, i;
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction ins = f->code[pc];
+    if (GET_OPCODE(ins) == OP_CLOSURE) {
+      Proto *c = f->p[GETARG_Bx(ins)];
+      for (i = 0; i < c->sizeupvalues; i++) {
+        Upvaldesc *uv = &c->upvalues[i];
+        uv->byvalue = cast_byte(uv->instack ? isfixed(f, pc, uv->idx)
+                                            : f->upvalues[uv->idx].byvalue);
+      }
+    }
+  }
+  for (i = 0; i < f->sizep; i++)
+    byvalue(f->p[i]);
+}
+
+/* }====================================================== */
+
+
+static void fusefunc (lua_State *L, Proto *f) {
+  OptState os;
+  int i;
+  if (f->lazytext != NULL) return;  /* fused when compiled */
+  for (i = 0; i < f->sizep; i++)
+    fusefunc(L, f->p[i]);
+  os.L = L;
+  os.f = f;
+  os.lines = NULL;
+  os.lineslot = savestack(L, L->top);
+  setnilvalue(L->top);  /* slot for the lines */
+  incr_top(L);
+  setnilvalue(L->top);  /* slot for the work arrays */
+  incr_top(L);
+  newscratch(&os);
+  analyze(&os);
+  switches(&os);
+  templates(&os);
+  fuse(&os);
+  compact(&os);
+  packlines(&os);
+  L->top -= 2;
+}
+
+
+/*
+** Replaces chains of equality tests by switches, constant constructors
+** by templates and common pairs of instructions by superinstructions,
+** in a chunk and all its functions, and then picks the upvalues to
+** capture by value. This runs on every
+** chunk the parser builds, after 'luaK_optimize' (which knows nothing
+** about them).
+*/
+void luaK_fuse (lua_State *L, Proto *f) {
+  fusefunc(L, f);
+  byvalue(f);
+}
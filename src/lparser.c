@@ -55,11 +55,14 @@ typedef struct BlockCnt {
 */
 static void statement (LexState *ls);
 static void expr (LexState *ls, expdesc *v);
+struct ScanState;  /* defined with the scan of function bodies */
+static void scanbody (LexState *ls, struct ScanState *prev, int ismethod,
+                      int line);
 
 
 static void anchor_token (LexState *ls) {
-  /* last token from outer function must be EOS */
-  lua_assert(ls->fs != NULL || ls->t.token == TK_EOS);
+  /* last token from outer function must be EOS (END in 'luaY_compile') */
+  lua_assert(ls->fs != NULL || ls->t.token == TK_EOS || ls->t.token == TK_END);
   if (ls->t.token == TK_NAME || ls->t.token == TK_STRING) {
     TString *ts = ls->t.seminfo.ts;
     luaX_newstring(ls, getstr(ts), ts->tsv.len);
@@ -80,21 +83,21 @@ static l_noret error_expected (LexState *ls, int token) {
 }
 
 
-static l_noret errorlimit (FuncState *fs, int limit, const char *what) {
-  lua_State *L = fs->ls->L;
+static l_noret errorlimit (LexState *ls, int line, int limit,
+                           const char *what) {
+  lua_State *L = ls->L;
   const char *msg;
-  int line = fs->f->linedefined;
   const char *where = (line == 0)
                       ? "main function"
                       : luaO_pushfstring(L, "function at line %d", line);
   msg = luaO_pushfstring(L, "too many %s (limit is %d) in %s",
                              what, limit, where);
-  luaX_syntaxerror(fs->ls, msg);
+  luaX_syntaxerror(ls, msg);
 }
 
 
 static void checklimit (FuncState *fs, int v, int l, const char *what) {
-  if (v > l) errorlimit(fs, l, what);
+  if (v > l) errorlimit(fs->ls, fs->f->linedefined, l, what);
 }
 
 
@@ -237,6 +240,7 @@ static int newupvalue (FuncState *fs, TString *name, expdesc *v) {
   while (oldsize < f->sizeupvalues) f->upvalues[oldsize++].name = NULL;
   f->upvalues[fs->nups].instack = (v->k == VLOCAL);
   f->upvalues[fs->nups].idx = cast_byte(v->u.info);
+  f->upvalues[fs->nups].byvalue = 0;  /* decided by 'luaK_fuse' */
   f->upvalues[fs->nups].name = name;
   luaC_objbarrier(fs->ls->L, f, name);
   return fs->nups++;
@@ -337,19 +341,22 @@ static void enterlevel (LexState *ls) {
 #define leavelevel(ls)	((ls)->L->nCcalls--)
 
 
+static l_noret jumpscopeerror (LexState *ls, Labeldesc *gt, TString *vname) {
+  const char *msg = luaO_pushfstring(ls->L,
+    "<goto %s> at line %d jumps into the scope of local " LUA_QS,
+    getstr(gt->name), gt->line, getstr(vname));
+  semerror(ls, msg);
+}
+
+
 static void closegoto (LexState *ls, int g, Labeldesc *label) {
   int i;
   FuncState *fs = ls->fs;
   Labellist *gl = &ls->dyd->gt;
   Labeldesc *gt = &gl->arr[g];
   lua_assert(luaS_eqstr(gt->name, label->name));
-  if (gt->nactvar < label->nactvar) {
-    TString *vname = getlocvar(fs, gt->nactvar)->varname;
-    const char *msg = luaO_pushfstring(ls->L,
-      "<goto %s> at line %d jumps into the scope of local " LUA_QS,
-      getstr(gt->name), gt->line, getstr(vname));
-    semerror(ls, msg);
-  }
+  if (gt->nactvar < label->nactvar)
+    jumpscopeerror(ls, gt, getlocvar(fs, gt->nactvar)->varname);
   luaK_patchlist(fs, gt->pc, label->pc);
   /* remove goto from pending list */
   for (i = g; i < gl->n - 1; i++)
@@ -542,6 +549,9 @@ static void open_func (LexState *ls, FuncState *fs, BlockCnt *bl) {
   fs->firstlocal = ls->dyd->actvar.n;
   fs->bl = NULL;
   f = fs->f;
+  fs->previousline = f->linedefined;
+  fs->nabslineinfo = 0;
+  fs->iwthabs = 0;
   f->source = ls->source;
   f->maxstacksize = 2;  /* registers 0/1 are always valid */
   fs->h = luaH_new(L);
@@ -560,8 +570,11 @@ static void close_func (LexState *ls) {
   leaveblock(fs);
   luaM_reallocvector(L, f->code, f->sizecode, fs->pc, Instruction);
   f->sizecode = fs->pc;
-  luaM_reallocvector(L, f->lineinfo, f->sizelineinfo, fs->pc, int);
+  luaM_reallocvector(L, f->lineinfo, f->sizelineinfo, fs->pc, ls_byte);
   f->sizelineinfo = fs->pc;
+  luaM_reallocvector(L, f->abslineinfo, f->sizeabslineinfo, fs->nabslineinfo,
+                     AbsLineInfo);
+  f->sizeabslineinfo = fs->nabslineinfo;
   luaM_reallocvector(L, f->k, f->sizek, fs->nk, TValue);
   f->sizek = fs->nk;
   luaM_reallocvector(L, f->p, f->sizep, fs->np, Proto *);
@@ -785,13 +798,39 @@ static void parlist (LexState *ls) {
 }
 
 
-static void body (LexState *ls, expdesc *e, int ismethod, int line) {
-  /* body ->  `(' parlist `)' block END */
-  FuncState new_fs;
-  BlockCnt bl;
-  new_fs.f = addprototype(ls);
-  new_fs.f->linedefined = line;
-  open_func(ls, &new_fs, &bl);
+/*
+** position in the text of the chunk of the '(' just read (the lexer has
+** also read the character after it)
+*/
+#define textpos(ls)	cast_int((ls)->z->p - getstr((ls)->text) - 2)
+
+
+/*
+** In a lazy load, the body of a function is only scanned ('scanbody'),
+** which finds its syntax errors and gives it its upvalues. It keeps
+** those, its parameters and where its body is in the text of the chunk
+** (dropping the final return 'close_func' coded), and it is compiled,
+** on its own, when it is first called ('luaY_compile').
+*/
+static void makestub (LexState *ls, Proto *f, int pos, int line,
+                      int ismethod) {
+  lua_State *L = ls->L;
+  luaM_freearray(L, f->code, f->sizecode);
+  f->code = NULL; f->sizecode = 0;
+  luaM_freearray(L, f->lineinfo, f->sizelineinfo);
+  f->lineinfo = NULL; f->sizelineinfo = 0;
+  luaM_freearray(L, f->abslineinfo, f->sizeabslineinfo);
+  f->abslineinfo = NULL; f->sizeabslineinfo = 0;
+  lua_assert(f->sizek == 0 && f->sizep == 0 && f->sizelocvars == 0);
+  f->lazytext = ls->text;
+  luaC_objbarrier(L, f, ls->text);
+  f->lazypos = pos;
+  f->lazyline = line;
+  f->lazymode = cast_byte(ls->lazymode | (ismethod ? LAZY_METHOD : 0));
+}
+
+
+static void funcbody (LexState *ls, int ismethod) {
   checknext(ls, '(');
   if (ismethod) {
     new_localvarliteral(ls, "self");  /* create 'self' parameter */
@@ -800,10 +839,30 @@ static void body (LexState *ls, expdesc *e, int ismethod, int line) {
   parlist(ls);
   checknext(ls, ')');
   statlist(ls);
-  new_fs.f->lastlinedefined = ls->linenumber;
-  check_match(ls, TK_END, TK_FUNCTION, line);
+  ls->fs->f->lastlinedefined = ls->linenumber;
+}
+
+
+static void body (LexState *ls, expdesc *e, int ismethod, int line) {
+  /* body ->  `(' parlist `)' block END */
+  FuncState new_fs;
+  BlockCnt bl;
+  int pos = (ls->text != NULL) ? textpos(ls) : 0;
+  int bodyline = ls->linenumber;
+  lua_assert(ls->lookahead.token == TK_EOS);
+  new_fs.f = addprototype(ls);
+  new_fs.f->linedefined = line;
+  open_func(ls, &new_fs, &bl);
+  if (ls->text != NULL)  /* lazy load? */
+    scanbody(ls, NULL, ismethod, line);
+  else {
+    funcbody(ls, ismethod);
+    check_match(ls, TK_END, TK_FUNCTION, line);
+  }
   codeclosure(ls, e);
   close_func(ls);
+  if (ls->text != NULL)
+    makestub(ls, new_fs.f, pos, bodyline, ismethod);
 }
 
 
@@ -1191,15 +1250,16 @@ static void gotostat (LexState *ls, int pc) {
 }
 
 
-/* check for repeated labels on the same block */
-static void checkrepeated (FuncState *fs, Labellist *ll, TString *label) {
+/* check for repeated labels on the same block (from label 'first') */
+static void checkrepeated (LexState *ls, int first, TString *label) {
+  Labellist *ll = &ls->dyd->label;
   int i;
-  for (i = fs->bl->firstlabel; i < ll->n; i++) {
+  for (i = first; i < ll->n; i++) {
     if (luaS_eqstr(label, ll->arr[i].name)) {
-      const char *msg = luaO_pushfstring(fs->ls->L,
+      const char *msg = luaO_pushfstring(ls->L,
                           "label " LUA_QS " already defined on line %d",
                           getstr(label), ll->arr[i].line);
-      semerror(fs->ls, msg);
+      semerror(ls, msg);
     }
   }
 }
@@ -1217,7 +1277,7 @@ static void labelstat (LexState *ls, TString *label, int line) {
   FuncState *fs = ls->fs;
   Labellist *ll = &ls->dyd->label;
   int l;  /* index of new label being created */
-  checkrepeated(fs, ll, label);  /* check for repeated labels */
+  checkrepeated(ls, fs->bl->firstlabel, label);  /* repeated label? */
   checknext(ls, TK_DBCOLON);  /* skip double colon */
   /* create new entry for this label */
   l = newlabelentry(ls, ll, label, line, fs->pc);
@@ -1623,24 +1683,787 @@ static void mainfunc (LexState *ls, FuncState *fs) {
 }
 
 
+/*
+** {======================================================
+** Scanning function bodies (lazy loads)
+** =======================================================
+*/
+
+/*
+** A scan follows the grammar as the rules above do, so it finds the
+** same syntax errors, but it generates no code: it only resolves the
+** names the body (or a function in it) uses from outside, so that the
+** function gets its upvalues and the functions around it learn which
+** of their locals are captured. Limits of code generation (registers,
+** constants, upvalues of inner functions) are checked when the function
+** is compiled.
+*/
+
+typedef struct ScanBlock {
+  struct ScanBlock *previous;  /* chain */
+  int firstlabel;  /* index of first label in this block */
+  int firstgoto;  /* index of first pending goto in this block */
+  int nactvar;  /* # active locals outside the block */
+  lu_byte isloop;  /* true if `block' is a loop */
+} ScanBlock;
+
+
+/* state of a function being scanned: the body or a function in it */
+typedef struct ScanState {
+  struct ScanState *prev;  /* enclosing function in the body */
+  ScanBlock *bl;  /* chain of current blocks */
+  int firstlocal;  /* index of first local var (in 'dyd->names') */
+  int nactvar;  /* number of active local variables */
+  int linedefined;  /* line of its 'function' */
+  lu_byte is_vararg;
+} ScanState;
+
+
+static void scanstat (LexState *ls, ScanState *ss);
+static void scanexpr (LexState *ls, ScanState *ss);
+
+
+static void scanenterlevel (LexState *ls, ScanState *ss) {
+  if (++ls->L->nCcalls > LUAI_MAXCCALLS)
+    errorlimit(ls, ss->linedefined, LUAI_MAXCCALLS, "C levels");
+}
+
+
+static void scanlocal (LexState *ls, ScanState *ss, TString *name) {
+  Dyndata *dyd = ls->dyd;
+  if (dyd->names.n + 1 - ss->firstlocal > MAXVARS)
+    errorlimit(ls, ss->linedefined, MAXVARS, "local variables");
+  luaM_growvector(ls->L, dyd->names.arr, dyd->names.n + 1, dyd->names.size,
+                  TString *, MAX_INT, "local variables");
+  dyd->names.arr[dyd->names.n++] = name;
+}
+
+#define scanlocalliteral(ls,ss,v) \
+	scanlocal(ls, ss, luaX_newstring(ls, "" v, (sizeof(v)/sizeof(char))-1))
+
+
+/* is 'n' an active local of the body or of a function in it? */
+static int scansearchvar (LexState *ls, ScanState *ss, TString *n) {
+  TString **names = ls->dyd->names.arr;
+  for (; ss != NULL; ss = ss->prev) {
+    int i;
+    for (i = ss->firstlocal + ss->nactvar - 1; i >= ss->firstlocal; i--) {
+      if (luaS_eqstr(n, names[i]))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+
+/* resolves a name as 'singlevar' does; names from outside the body
+   become upvalues of its function ('ls->fs') */
+static void scanvar (LexState *ls, ScanState *ss) {
+  TString *varname = str_checkname(ls);
+  expdesc var;
+  if (!scansearchvar(ls, ss, varname) &&
+      singlevaraux(ls->fs, varname, &var, 1) == VVOID &&  /* global name? */
+      !scansearchvar(ls, ss, ls->envn))
+    singlevaraux(ls->fs, ls->envn, &var, 1);  /* get environment variable */
+}
+
+
+static int scannewlabel (LexState *ls, ScanState *ss, Labellist *l,
+                         TString *name, int line) {
+  int n = newlabelentry(ls, l, name, line, 0);
+  l->arr[n].nactvar = cast_byte(ss->nactvar);
+  return n;
+}
+
+
+static void scanclosegoto (LexState *ls, ScanState *ss, int g,
+                           Labeldesc *label) {
+  int i;
+  Dyndata *dyd = ls->dyd;
+  Labellist *gl = &dyd->gt;
+  Labeldesc *gt = &gl->arr[g];
+  lua_assert(luaS_eqstr(gt->name, label->name));
+  if (gt->nactvar < label->nactvar)
+    jumpscopeerror(ls, gt, dyd->names.arr[ss->firstlocal + gt->nactvar]);
+  /* remove goto from pending list */
+  for (i = g; i < gl->n - 1; i++)
+    gl->arr[i] = gl->arr[i + 1];
+  gl->n--;
+}
+
+
+/* as 'findlabel' */
+static int scanfindlabel (LexState *ls, ScanState *ss, int g) {
+  int i;
+  Dyndata *dyd = ls->dyd;
+  for (i = ss->bl->firstlabel; i < dyd->label.n; i++) {
+    Labeldesc *lb = &dyd->label.arr[i];
+    if (luaS_eqstr(lb->name, dyd->gt.arr[g].name)) {
+      scanclosegoto(ls, ss, g, lb);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/* as 'findgotos' */
+static void scanfindgotos (LexState *ls, ScanState *ss, Labeldesc *lb) {
+  Labellist *gl = &ls->dyd->gt;
+  int i = ss->bl->firstgoto;
+  while (i < gl->n) {
+    if (luaS_eqstr(gl->arr[i].name, lb->name))
+      scanclosegoto(ls, ss, i, lb);
+    else
+      i++;
+  }
+}
+
+
+static void scanenterblock (LexState *ls, ScanState *ss, ScanBlock *bl,
+                            lu_byte isloop) {
+  bl->isloop = isloop;
+  bl->nactvar = ss->nactvar;
+  bl->firstlabel = ls->dyd->label.n;
+  bl->firstgoto = ls->dyd->gt.n;
+  bl->previous = ss->bl;
+  ss->bl = bl;
+}
+
+
+/* as 'leaveblock' */
+static void scanleaveblock (LexState *ls, ScanState *ss) {
+  ScanBlock *bl = ss->bl;
+  Dyndata *dyd = ls->dyd;
+  if (bl->isloop) {  /* close pending breaks */
+    int l = scannewlabel(ls, ss, &dyd->label, luaS_new(ls->L, "break"), 0);
+    scanfindgotos(ls, ss, &dyd->label.arr[l]);
+  }
+  ss->bl = bl->previous;
+  dyd->names.n -= ss->nactvar - bl->nactvar;  /* remove its locals */
+  ss->nactvar = bl->nactvar;
+  dyd->label.n = bl->firstlabel;  /* remove local labels */
+  if (bl->previous) {  /* inner block? update pending gotos to outer block */
+    int i = bl->firstgoto;
+    while (i < dyd->gt.n) {
+      Labeldesc *gt = &dyd->gt.arr[i];
+      if (gt->nactvar > bl->nactvar)
+        gt->nactvar = cast_byte(bl->nactvar);
+      if (!scanfindlabel(ls, ss, i))
+        i++;  /* move to next one */
+    }
+  }
+  else if (bl->firstgoto < dyd->gt.n)  /* pending gotos in outer block? */
+    undefgoto(ls, &dyd->gt.arr[bl->firstgoto]);  /* error */
+}
+
+
+static void scanstatlist (LexState *ls, ScanState *ss) {
+  while (!block_follow(ls, 1)) {
+    if (ls->t.token == TK_RETURN) {
+      scanstat(ls, ss);
+      return;  /* 'return' must be last statement */
+    }
+    scanstat(ls, ss);
+  }
+}
+
+
+static void scanblock (LexState *ls, ScanState *ss) {
+  ScanBlock bl;
+  scanenterblock(ls, ss, &bl, 0);
+  scanstatlist(ls, ss);
+  scanleaveblock(ls, ss);
+}
+
+
+static void scanexplist (LexState *ls, ScanState *ss) {
+  scanexpr(ls, ss);
+  while (testnext(ls, ','))
+    scanexpr(ls, ss);
+}
+
+
+static void scanconstructor (LexState *ls, ScanState *ss) {
+  int line = ls->linenumber;
+  checknext(ls, '{');
+  do {
+    if (ls->t.token == '}') break;
+    if (ls->t.token == '[') {  /* recfield -> `['exp1`]' = exp1 */
+      luaX_next(ls);
+      scanexpr(ls, ss);
+      checknext(ls, ']');
+      checknext(ls, '=');
+    }
+    else if (ls->t.token == TK_NAME && luaX_lookahead(ls) == '=') {
+      luaX_next(ls);  /* recfield -> NAME = exp1 */
+      luaX_next(ls);
+    }
+    scanexpr(ls, ss);
+  } while (testnext(ls, ',') || testnext(ls, ';'));
+  check_match(ls, '}', '{', line);
+}
+
+
+static void scanfuncargs (LexState *ls, ScanState *ss, int line) {
+  switch (ls->t.token) {
+    case '(': {
+      luaX_next(ls);
+      if (ls->t.token != ')')
+        scanexplist(ls, ss);
+      check_match(ls, ')', '(', line);
+      break;
+    }
+    case '{': {
+      scanconstructor(ls, ss);
+      break;
+    }
+    case TK_STRING: {
+      luaX_next(ls);
+      break;
+    }
+    default: {
+      luaX_syntaxerror(ls, "function arguments expected");
+    }
+  }
+}
+
+
+/* returns the kind of expression it is: a variable, a call or other */
+static expkind scansuffixedexp (LexState *ls, ScanState *ss) {
+  int line = ls->linenumber;
+  expkind k;
+  switch (ls->t.token) {
+    case '(': {
+      luaX_next(ls);
+      scanexpr(ls, ss);
+      check_match(ls, ')', '(', line);
+      k = VNONRELOC;
+      break;
+    }
+    case TK_NAME: {
+      scanvar(ls, ss);
+      k = VLOCAL;
+      break;
+    }
+    default: {
+      luaX_syntaxerror(ls, "unexpected symbol");
+    }
+  }
+  for (;;) {
+    switch (ls->t.token) {
+      case '.': {
+        luaX_next(ls);
+        str_checkname(ls);
+        k = VINDEXED;
+        break;
+      }
+      case '[': {
+        luaX_next(ls);
+        scanexpr(ls, ss);
+        checknext(ls, ']');
+        k = VINDEXED;
+        break;
+      }
+      case ':': {
+        luaX_next(ls);
+        str_checkname(ls);
+        scanfuncargs(ls, ss, line);
+        k = VCALL;
+        break;
+      }
+      case '(': case TK_STRING: case '{': {
+        scanfuncargs(ls, ss, line);
+        k = VCALL;
+        break;
+      }
+      default: return k;
+    }
+  }
+}
+
+
+static void scansimpleexp (LexState *ls, ScanState *ss) {
+  switch (ls->t.token) {
+    case TK_NUMBER: case TK_STRING: case TK_NIL: case TK_TRUE: case TK_FALSE:
+      break;
+    case TK_DOTS: {
+      check_condition(ls, ss->is_vararg,
+                      "cannot use " LUA_QL("...") " outside a vararg function");
+      break;
+    }
+    case '{': {
+      scanconstructor(ls, ss);
+      return;
+    }
+    case TK_FUNCTION: {
+      luaX_next(ls);
+      scanbody(ls, ss, 0, ls->linenumber);
+      return;
+    }
+    default: {
+      scansuffixedexp(ls, ss);
+      return;
+    }
+  }
+  luaX_next(ls);
+}
+
+
+static BinOpr scansubexpr (LexState *ls, ScanState *ss, int limit) {
+  BinOpr op;
+  scanenterlevel(ls, ss);
+  if (getunopr(ls->t.token) != OPR_NOUNOPR) {
+    luaX_next(ls);
+    scansubexpr(ls, ss, UNARY_PRIORITY);
+  }
+  else scansimpleexp(ls, ss);
+  op = getbinopr(ls->t.token);
+  while (op != OPR_NOBINOPR && priority[op].left > limit) {
+    luaX_next(ls);
+    op = scansubexpr(ls, ss, priority[op].right);
+  }
+  leavelevel(ls);
+  return op;
+}
+
+
+static void scanexpr (LexState *ls, ScanState *ss) {
+  scansubexpr(ls, ss, 0);
+}
+
+
+static void scanassignment (LexState *ls, ScanState *ss, expkind k,
+                            int nvars) {
+  check_condition(ls, vkisvar(k), "syntax error");
+  if (testnext(ls, ',')) {
+    k = scansuffixedexp(ls, ss);
+    if (nvars + ls->L->nCcalls > LUAI_MAXCCALLS)
+      errorlimit(ls, ss->linedefined, LUAI_MAXCCALLS, "C levels");
+    scanassignment(ls, ss, k, nvars + 1);
+  }
+  else {
+    checknext(ls, '=');
+    scanexplist(ls, ss);
+  }
+}
+
+
+static void scangotostat (LexState *ls, ScanState *ss) {
+  int line = ls->linenumber;
+  TString *label;
+  int g;
+  if (testnext(ls, TK_GOTO))
+    label = str_checkname(ls);
+  else {
+    luaX_next(ls);  /* skip break */
+    label = luaS_new(ls->L, "break");
+  }
+  g = scannewlabel(ls, ss, &ls->dyd->gt, label, line);
+  scanfindlabel(ls, ss, g);  /* close it if label already defined */
+}
+
+
+static void scanlabelstat (LexState *ls, ScanState *ss, TString *label,
+                           int line) {
+  Labellist *ll = &ls->dyd->label;
+  int l;
+  checkrepeated(ls, ss->bl->firstlabel, label);
+  checknext(ls, TK_DBCOLON);
+  l = scannewlabel(ls, ss, ll, label, line);
+  while (ls->t.token == ';' || ls->t.token == TK_DBCOLON)
+    scanstat(ls, ss);  /* skip other no-op statements */
+  if (block_follow(ls, 0))  /* label is last no-op statement in the block? */
+    ll->arr[l].nactvar = cast_byte(ss->bl->nactvar);
+  scanfindgotos(ls, ss, &ll->arr[l]);
+}
+
+
+static void scanwhilestat (LexState *ls, ScanState *ss, int line) {
+  ScanBlock bl;
+  luaX_next(ls);  /* skip WHILE */
+  scanexpr(ls, ss);
+  scanenterblock(ls, ss, &bl, 1);
+  checknext(ls, TK_DO);
+  scanblock(ls, ss);
+  check_match(ls, TK_END, TK_WHILE, line);
+  scanleaveblock(ls, ss);
+}
+
+
+static void scanrepeatstat (LexState *ls, ScanState *ss, int line) {
+  ScanBlock bl1, bl2;
+  scanenterblock(ls, ss, &bl1, 1);  /* loop block */
+  scanenterblock(ls, ss, &bl2, 0);  /* scope block */
+  luaX_next(ls);  /* skip REPEAT */
+  scanstatlist(ls, ss);
+  check_match(ls, TK_UNTIL, TK_REPEAT, line);
+  scanexpr(ls, ss);  /* read condition (inside scope block) */
+  scanleaveblock(ls, ss);  /* finish scope */
+  scanleaveblock(ls, ss);  /* finish loop */
+}
+
+
+static void scanforbody (LexState *ls, ScanState *ss, int nvars) {
+  ScanBlock bl;
+  ss->nactvar += 3;  /* control variables */
+  checknext(ls, TK_DO);
+  scanenterblock(ls, ss, &bl, 0);  /* scope for declared variables */
+  ss->nactvar += nvars;
+  scanblock(ls, ss);
+  scanleaveblock(ls, ss);
+}
+
+
+static void scanforstat (LexState *ls, ScanState *ss, int line) {
+  TString *varname;
+  ScanBlock bl;
+  scanenterblock(ls, ss, &bl, 1);  /* scope for loop and control variables */
+  luaX_next(ls);  /* skip `for' */
+  varname = str_checkname(ls);  /* first variable name */
+  switch (ls->t.token) {
+    case '=': {
+      scanlocalliteral(ls, ss, "(for index)");
+      scanlocalliteral(ls, ss, "(for limit)");
+      scanlocalliteral(ls, ss, "(for step)");
+      scanlocal(ls, ss, varname);
+      luaX_next(ls);  /* skip '=' */
+      scanexpr(ls, ss);  /* initial value */
+      checknext(ls, ',');
+      scanexpr(ls, ss);  /* limit */
+      if (testnext(ls, ','))
+        scanexpr(ls, ss);  /* optional step */
+      scanforbody(ls, ss, 1);
+      break;
+    }
+    case ',': case TK_IN: {
+      int nvars = 1;
+      scanlocalliteral(ls, ss, "(for generator)");
+      scanlocalliteral(ls, ss, "(for state)");
+      scanlocalliteral(ls, ss, "(for control)");
+      scanlocal(ls, ss, varname);
+      while (testnext(ls, ',')) {
+        scanlocal(ls, ss, str_checkname(ls));
+        nvars++;
+      }
+      checknext(ls, TK_IN);
+      scanexplist(ls, ss);
+      scanforbody(ls, ss, nvars);
+      break;
+    }
+    default: luaX_syntaxerror(ls, LUA_QL("=") " or " LUA_QL("in") " expected");
+  }
+  check_match(ls, TK_END, TK_FOR, line);
+  scanleaveblock(ls, ss);  /* loop scope (`break' jumps to this point) */
+}
+
+
+static void scanifstat (LexState *ls, ScanState *ss, int line) {
+  do {  /* [IF | ELSEIF] cond THEN block */
+    ScanBlock bl;
+    luaX_next(ls);  /* skip IF or ELSEIF */
+    scanexpr(ls, ss);
+    checknext(ls, TK_THEN);
+    scanenterblock(ls, ss, &bl, 0);
+    scanstatlist(ls, ss);
+    scanleaveblock(ls, ss);
+  } while (ls->t.token == TK_ELSEIF);
+  if (testnext(ls, TK_ELSE))
+    scanblock(ls, ss);  /* `else' part */
+  check_match(ls, TK_END, TK_IF, line);
+}
+
+
+static void scanlocalstat (LexState *ls, ScanState *ss) {
+  int nvars = 0;
+  if (testnext(ls, TK_FUNCTION)) {  /* local function? */
+    scanlocal(ls, ss, str_checkname(ls));
+    ss->nactvar++;  /* enter its scope */
+    scanbody(ls, ss, 0, ls->linenumber);
+    return;
+  }
+  do {
+    scanlocal(ls, ss, str_checkname(ls));
+    nvars++;
+  } while (testnext(ls, ','));
+  if (testnext(ls, '='))
+    scanexplist(ls, ss);
+  ss->nactvar += nvars;
+}
+
+
+static void scanfuncstat (LexState *ls, ScanState *ss, int line) {
+  int ismethod = 0;
+  luaX_next(ls);  /* skip FUNCTION */
+  scanvar(ls, ss);
+  while (ls->t.token == '.') {
+    luaX_next(ls);
+    str_checkname(ls);
+  }
+  if (ls->t.token == ':') {
+    ismethod = 1;
+    luaX_next(ls);
+    str_checkname(ls);
+  }
+  scanbody(ls, ss, ismethod, line);
+}
+
+
+static void scanstat (LexState *ls, ScanState *ss) {
+  int line = ls->linenumber;  /* may be needed for error messages */
+  scanenterlevel(ls, ss);
+  if (ls->t.token == TK_NAME && strcmp(getstr(ls->t.seminfo.ts), "goto") == 0
+      && luaX_lookahead(ls) == TK_NAME)
+    ls->t.token = TK_GOTO;
+  switch (ls->t.token) {
+    case ';': {
+      luaX_next(ls);  /* skip ';' */
+      break;
+    }
+    case TK_IF: {
+      scanifstat(ls, ss, line);
+      break;
+    }
+    case TK_WHILE: {
+      scanwhilestat(ls, ss, line);
+      break;
+    }
+    case TK_DO: {
+      luaX_next(ls);  /* skip DO */
+      scanblock(ls, ss);
+      check_match(ls, TK_END, TK_DO, line);
+      break;
+    }
+    case TK_FOR: {
+      scanforstat(ls, ss, line);
+      break;
+    }
+    case TK_REPEAT: {
+      scanrepeatstat(ls, ss, line);
+      break;
+    }
+    case TK_FUNCTION: {
+      scanfuncstat(ls, ss, line);
+      break;
+    }
+    case TK_LOCAL: {
+      luaX_next(ls);  /* skip LOCAL */
+      scanlocalstat(ls, ss);
+      break;
+    }
+    case TK_DBCOLON: {
+      luaX_next(ls);  /* skip double colon */
+      scanlabelstat(ls, ss, str_checkname(ls), line);
+      break;
+    }
+    case TK_RETURN: {
+      luaX_next(ls);  /* skip RETURN */
+      if (!block_follow(ls, 1) && ls->t.token != ';')
+        scanexplist(ls, ss);
+      testnext(ls, ';');  /* skip optional semicolon */
+      break;
+    }
+    case TK_BREAK:
+    case TK_GOTO: {
+      scangotostat(ls, ss);
+      break;
+    }
+    default: {  /* stat -> func | assignment */
+      expkind k = scansuffixedexp(ls, ss);
+      if (ls->t.token == '=' || ls->t.token == ',')
+        scanassignment(ls, ss, k, 1);
+      else
+        check_condition(ls, k == VCALL, "syntax error");
+      break;
+    }
+  }
+  leavelevel(ls);
+}
+
+
+/*
+** Scans a function body, from its '(' to its 'end'. 'prev' is the
+** function around it in the body being scanned; a body with no 'prev'
+** is that of the function 'ls->fs', which gets its parameters and its
+** last line from the scan.
+*/
+static void scanbody (LexState *ls, ScanState *prev, int ismethod,
+                      int line) {
+  ScanState ss;
+  ScanBlock bl;
+  int nparams = 0;
+  ss.prev = prev;
+  ss.bl = NULL;
+  ss.firstlocal = ls->dyd->names.n;
+  ss.nactvar = 0;
+  ss.linedefined = line;
+  ss.is_vararg = 0;
+  scanenterblock(ls, &ss, &bl, 0);
+  checknext(ls, '(');
+  if (ismethod) {
+    scanlocalliteral(ls, &ss, "self");  /* create 'self' parameter */
+    ss.nactvar++;
+  }
+  if (ls->t.token != ')') {  /* is `parlist' not empty? */
+    do {
+      switch (ls->t.token) {
+        case TK_NAME: {  /* param -> NAME */
+          scanlocal(ls, &ss, str_checkname(ls));
+          nparams++;
+          break;
+        }
+        case TK_DOTS: {  /* param -> `...' */
+          luaX_next(ls);
+          ss.is_vararg = 1;
+          break;
+        }
+        default: luaX_syntaxerror(ls, "<name> or " LUA_QL("...") " expected");
+      }
+    } while (!ss.is_vararg && testnext(ls, ','));
+  }
+  ss.nactvar += nparams;
+  checknext(ls, ')');
+  scanstatlist(ls, &ss);
+  if (prev == NULL) {  /* body of 'ls->fs'? */
+    Proto *f = ls->fs->f;
+    f->numparams = cast_byte(ss.nactvar);
+    f->is_vararg = ss.is_vararg;
+    f->lastlinedefined = ls->linenumber;
+  }
+  check_match(ls, TK_END, TK_FUNCTION, line);
+  scanleaveblock(ls, &ss);
+  lua_assert(ls->dyd->names.n == ss.firstlocal);
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Lazy loads
+** =======================================================
+*/
+
+typedef struct LoadText {
+  const char *s;
+  size_t size;
+} LoadText;
+
+
+static const char *readchunk (lua_State *L, void *ud, size_t *size) {
+  LoadText *lt = cast(LoadText *, ud);
+  UNUSED(L);
+  if (lt->size == 0) return NULL;
+  *size = lt->size;
+  lt->size = 0;
+  return lt->s;
+}
+
+
+/* reads the whole chunk (from its first character 'c') into a string */
+static TString *readtext (lua_State *L, ZIO *z, Mbuffer *buff, int c) {
+  size_t n = 0;
+  if (c == EOZ) return luaS_newliteral(L, "");
+  luaZ_openspace(L, buff, LUA_MINBUFFER)[n++] = cast(char, c);
+  for (;;) {
+    if (z->n == 0) {  /* no bytes in buffer? */
+      if (luaZ_fill(z) == EOZ) break;
+      z->n++;  /* luaZ_fill consumed first byte; put it back */
+      z->p--;
+    }
+    if (n + z->n > luaZ_sizebuffer(buff)) {
+      size_t size = luaZ_sizebuffer(buff) * 2;
+      luaZ_resizebuffer(L, buff, (size < n + z->n) ? n + z->n : size);
+    }
+    memcpy(luaZ_buffer(buff) + n, z->p, z->n);
+    n += z->n;
+    z->p += z->n;
+    z->n = 0;
+  }
+  return luaS_newlstr(L, luaZ_buffer(buff), n);
+}
+
+
+/*
+** Compiles 'f', a function left as text by a lazy load (see 'makestub'),
+** in place. Its text was scanned already, so it has no syntax errors
+** (it may still exceed a limit of code generation), and the upvalues 'f'
+** has are all the names from outside its body resolves to (those not
+** among them are globals). If it runs out of memory, 'f' is
+** still left as text, with some arrays a new try just reuses.
+*/
+void luaY_compile (lua_State *L, Proto *f, Mbuffer *buff, Dyndata *dyd) {
+  LexState lexstate;
+  FuncState funcstate;
+  BlockCnt bl;
+  LoadText lt;
+  ZIO z;
+  lt.s = getstr(f->lazytext) + f->lazypos;
+  lt.size = f->lazytext->tsv.len - f->lazypos;
+  luaZ_init(L, &z, readchunk, &lt);
+  lexstate.buff = buff;
+  lexstate.dyd = dyd;
+  dyd->actvar.n = dyd->gt.n = dyd->label.n = dyd->names.n = 0;
+  luaX_setinput(L, &lexstate, &z, f->source, zgetc(&z));
+  lexstate.linenumber = lexstate.lastline = f->lazyline;
+  lexstate.text = f->lazytext;
+  lexstate.lazymode = f->lazymode & (LAZY_TEXT | LAZY_OPTIMIZE);
+  funcstate.f = f;
+  open_func(&lexstate, &funcstate, &bl);
+  funcstate.nups = cast_byte(f->sizeupvalues);  /* all of them known */
+  luaX_next(&lexstate);  /* read '(' */
+  funcbody(&lexstate, f->lazymode & LAZY_METHOD);
+  check(&lexstate, TK_END);  /* (what follows belongs to another function) */
+  lexstate.lastline = lexstate.linenumber;  /* as reading past 'end' would */
+  close_func(&lexstate);
+  lua_assert(f->sizeupvalues == funcstate.nups);
+  f->lazytext = NULL;
+}
+
+/* }====================================================== */
+
+
+/*
+** Parses a chunk. In a lazy load ('lazymode' not 0), the lexer reads
+** from a string with the whole chunk, which the functions it leaves to
+** compile later keep.
+*/
 Closure *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff,
-                      Dyndata *dyd, const char *name, int firstchar) {
+                      Dyndata *dyd, const char *name, int firstchar,
+                      int lazymode) {
   LexState lexstate;
   FuncState funcstate;
-  Closure *cl = luaF_newLclosure(L, 1);  /* create main closure */
+  LoadText lt;
+  ZIO tz;
+  TString *text = NULL;
+  Closure *cl = luaF_newLclosure(L, 1, 0);  /* create main closure */
   /* anchor closure (to avoid being collected) */
   setclLvalue(L, L->top, cl);
   incr_top(L);
   funcstate.f = cl->l.p = luaF_newproto(L);
   funcstate.f->source = luaS_new(L, name);  /* create and anchor TString */
+  if (lazymode) {
+    text = readtext(L, z, buff, firstchar);
+    setsvalue2s(L, L->top, text);  /* anchor it */
+    incr_top(L);
+    lt.s = getstr(text);
+    lt.size = text->tsv.len;
+    luaZ_init(L, &tz, readchunk, &lt);
+    z = &tz;
+    firstchar = zgetc(z);
+  }
   lexstate.buff = buff;
   lexstate.dyd = dyd;
-  dyd->actvar.n = dyd->gt.n = dyd->label.n = 0;
+  dyd->actvar.n = dyd->gt.n = dyd->label.n = dyd->names.n = 0;
   luaX_setinput(L, &lexstate, z, funcstate.f->source, firstchar);
+  lexstate.text = text;
+  lexstate.lazymode = lazymode;
   mainfunc(&lexstate, &funcstate);
   lua_assert(!funcstate.prev && funcstate.nups == 1 && !lexstate.fs);
   /* all scopes should be correctly finished */
-  lua_assert(dyd->actvar.n == 0 && dyd->gt.n == 0 && dyd->label.n == 0);
+  lua_assert(dyd->actvar.n == 0 && dyd->gt.n == 0 && dyd->label.n == 0 &&
+             dyd->names.n == 0);
+  if (lazymode) L->top--;  /* remove 'text' */
   return cl;  /* it's on the stack too */
 }
 
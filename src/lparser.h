@@ -85,6 +85,11 @@ typedef struct Dyndata {
   } actvar;
   Labellist gt;  /* list of pending gotos */
   Labellist label;   /* list of active labels */
+  struct {  /* locals of a function body being scanned (lazy loads) */
+    TString **arr;
+    int n;
+    int size;
+  } names;
 } Dyndata;
 
 
@@ -105,6 +110,9 @@ typedef struct FuncState {
   int nk;  /* number of elements in `k' */
   int np;  /* number of elements in `p' */
   int firstlocal;  /* index of first local var (in Dyndata array) */
+  int previousline;  /* last line saved in 'lineinfo' */
+  int nabslineinfo;  /* number of elements in 'abslineinfo' */
+  int iwthabs;  /* instructions since the last absolute line */
   short nlocvars;  /* number of elements in 'f->locvars' */
   lu_byte nactvar;  /* number of active local variables */
   lu_byte nups;  /* number of upvalues */
@@ -112,8 +120,17 @@ typedef struct FuncState {
 } FuncState;
 
 
+/* flags of a lazy load, also kept by the functions it leaves as text */
+#define LAZY_TEXT	1	/* compile nested functions when first called */
+#define LAZY_OPTIMIZE	2	/* optimize them then (mode 'O') */
+#define LAZY_METHOD	4	/* the function has an implicit 'self' */
+
+
 LUAI_FUNC Closure *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff,
-                                Dyndata *dyd, const char *name, int firstchar);
+                                Dyndata *dyd, const char *name, int firstchar,
+                                int lazymode);
+LUAI_FUNC void luaY_compile (lua_State *L, Proto *f, Mbuffer *buff,
+                             Dyndata *dyd);
 
 
 #endif
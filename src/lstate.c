@@ -18,6 +18,7 @@
 #include "ldo.h"
 #include "lfunc.h"
 #include "lgc.h"
+#include "lheap.h"
 #include "llex.h"
 #include "lmem.h"
 #include "lstate.h"
@@ -38,6 +39,21 @@
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 #endif
 
+/* default number of dead threads kept for reuse by 'lua_newthread' */
+#if !defined(LUAI_THREADPOOL)
+#define LUAI_THREADPOOL	32
+#endif
+
+/* threads with bigger stacks are not kept in the pool */
+#if !defined(LUAI_POOLSTACK)
+#define LUAI_POOLSTACK	(4*BASIC_STACK_SIZE)
+#endif
+
+/* whether new states account the resumes of their threads */
+#if !defined(LUAI_ACCOUNTING)
+#define LUAI_ACCOUNTING	0
+#endif
+
 
 #define MEMERRMSG	"not enough memory"
 
@@ -78,6 +94,8 @@ typedef struct LG {
 /* forward declarations for lock creation/deletion */
 void * _lua_newlock();
 void _lua_freelock(void *);
+void * _lua_neweventqueue();
+void _lua_freeeventqueue(void *);
 
 
 
@@ -116,39 +134,74 @@ void luaE_setdebt (global_State *g, l_mem debt) {
 }
 
 
+/*
+** CallInfo entries are allocated in blocks, each block holding an
+** array of entries already linked among themselves, so that the 'ci'
+** list of a thread is mostly contiguous in memory. Block sizes double
+** (from MINCIBLOCK up to LUAI_MAXCIBLOCK entries) as the list grows,
+** so that shallow threads (most coroutines) stay small. Blocks never
+** move, so pointers to entries remain valid; the list is only shrunk
+** by releasing whole blocks past the current 'ci'.
+*/
+
+#define MINCIBLOCK	4
+
+#if !defined(LUAI_MAXCIBLOCK)
+#define LUAI_MAXCIBLOCK	64
+#endif
+
+#define sizeCIblock(n)	(offsetof(CIBlock, ci) + (n) * sizeof(CallInfo))
+
+#define inblock(b,c)	((b)->ci <= (c) && (c) < (b)->ci + (b)->size)
+
+
 CallInfo *luaE_extendCI (lua_State *L) {
-  CallInfo *ci = luaM_new(L, CallInfo);
+  CIBlock *last = L->ciblock;
+  int n = (last == NULL) ? MINCIBLOCK : last->size * 2;
+  CIBlock *b;
+  int i;
+  if (n > LUAI_MAXCIBLOCK) n = LUAI_MAXCIBLOCK;
+  b = cast(CIBlock *, luaM_malloc(L, sizeCIblock(n)));
+  b->previous = last;
+  b->size = n;
+  L->ciblock = b;
   lua_assert(L->ci->next == NULL);
-  L->ci->next = ci;
-  ci->previous = L->ci;
-  ci->next = NULL;
-  return ci;
+  L->ci->next = &b->ci[0];
+  b->ci[0].previous = L->ci;
+  for (i = 1; i < n; i++) {  /* link entries of the new block */
+    b->ci[i - 1].next = &b->ci[i];
+    b->ci[i].previous = &b->ci[i - 1];
+  }
+  b->ci[n - 1].next = NULL;
+  return &b->ci[0];
 }
 
 
+/*
+** free all blocks after the one holding the current 'ci'
+*/
 void luaE_freeCI (lua_State *L) {
-  CallInfo *ci = L->ci;
-  CallInfo *next = ci->next;
-  ci->next = NULL;
-  while ((ci = next) != NULL) {
-    next = ci->next;
-    luaM_free(L, ci);
+  CIBlock *b = L->ciblock;
+  while (b != NULL && !inblock(b, L->ci)) {
+    CIBlock *previous = b->previous;
+    luaM_freemem(L, b, sizeCIblock(b->size));
+    b = previous;
   }
+  L->ciblock = b;
+  if (b != NULL)
+    b->ci[b->size - 1].next = NULL;
+  else
+    L->base_ci.next = NULL;
 }
 
 
-static void stack_init (lua_State *L1, lua_State *L) {
-  int i; CallInfo *ci;
-  /* initialize stack array */
-  L1->stack = luaM_newvector(L, BASIC_STACK_SIZE, TValue);
-  L1->stacksize = BASIC_STACK_SIZE;
-  for (i = 0; i < BASIC_STACK_SIZE; i++)
-    setnilvalue(L1->stack + i);  /* erase new stack */
+/*
+** set the first 'ci' of a thread over an empty stack
+*/
+static void base_ci_init (lua_State *L1) {
+  CallInfo *ci = &L1->base_ci;
   L1->top = L1->stack;
-  L1->stack_last = L1->stack + L1->stacksize - EXTRA_STACK;
-  /* initialize first ci */
-  ci = &L1->base_ci;
-  ci->next = ci->previous = NULL;
+  ci->previous = NULL;
   ci->callstatus = 0;
   ci->func = L1->top;
   setnilvalue(L1->top++);  /* 'function' entry for this 'ci' */
@@ -157,6 +210,20 @@ static void stack_init (lua_State *L1, lua_State *L) {
 }
 
 
+static void stack_init (lua_State *L1, lua_State *L) {
+  int i;
+  /* initialize stack array */
+  int size = G(L)->stackinit;
+  L1->stack = luaM_newvector(L, size, TValue);
+  L1->stacksize = size;
+  for (i = 0; i < size; i++)
+    setnilvalue(L1->stack + i);  /* erase new stack */
+  L1->stack_last = L1->stack + L1->stacksize - EXTRA_STACK;
+  L1->base_ci.next = NULL;
+  base_ci_init(L1);
+}
+
+
 static void freestack (lua_State *L) {
   if (L->stack == NULL)
     return;  /* stack not completely built yet */
@@ -201,12 +268,14 @@ static void f_luaopen (lua_State *L, void *ud) {
   luaS_fix(g->memerrmsg);  /* it should never be collected */
   /* allocate rope and substring clusters */
   g->ropestack = luaM_newvector(L, g->ropestacksize, TString *);
-  g->ropeclusters = luaM_newvector(L, ROPE_CLUSTER_SIZE, TString);
+  g->ropeclusters = cast(TString *, luaM_newobject(L, LUA_TROPSTR,
+                   ROPE_CLUSTER_SIZE * sizeof(TString)));
   memset(g->ropeclusters, 0, ROPE_CLUSTER_SIZE * sizeof(TString));
   nextropecluster(g->ropeclusters) = NULL;  /* ensure next pointer is NULL */
   ((unsigned long*)g->ropeclusters)[BITMAP_SKIP] = 0xFFFF;  /* always mark first entry as used by bitmap */
   g->ropefreecluster = g->ropeclusters;
-  g->ssclusters = luaM_newvector(L, SUBSTR_CLUSTER_SIZE, TString);
+  g->ssclusters = cast(TString *, luaM_newobject(L, LUA_TSUBSTR,
+                   SUBSTR_CLUSTER_SIZE * sizeof(TString)));
   memset(g->ssclusters, 0, SUBSTR_CLUSTER_SIZE * sizeof(TString));
   nextsscluster(g->ssclusters) = NULL;  /* ensure next pointer is NULL */
   ((unsigned long*)g->ssclusters)[BITMAP_SKIP] = 0xFFFF;  /* always mark first entry as used by bitmap */
@@ -226,11 +295,15 @@ static void preinit_state (lua_State *L, global_State *g) {
   G(L) = g;
   L->stack = NULL;
   L->ci = NULL;
+  L->ciblock = NULL;
   L->stacksize = 0;
+  L->stackhwm = 0;
   L->errorJmp = NULL;
   L->nCcalls = 0;
+  L->baseCcalls = 0;
   L->hook = NULL;
   L->hookmask = 0;
+  memset(&L->acct, 0, sizeof(L->acct));
   L->basehookcount = 0;
   L->allowhook = 1;
   resethookcount(L);
@@ -248,8 +321,19 @@ static void close_state (lua_State *L) {
   l_mem olddebt;
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeallobjects(L);  /* collect all objects */
+  luaW_freesampler(L);
   if (g->version)  /* closing a fully built state? */
     luai_userstateclose(L);
+  if (g->frelease) {  /* memory is a region? */
+    lua_Release frelease = g->frelease;
+    void *ud = g->ud;
+    lua_unlock(L);
+    _lua_freelock(g->lock);
+    _lua_freeeventqueue(g->events);
+    (*frelease)(ud);  /* release everything (including 'g') at once */
+    return;
+  }
+  luaE_trimthreadpool(L, 0);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
   luaZ_freebuffer(L, &g->buff);
   freestack(L);
@@ -265,28 +349,88 @@ static void close_state (lua_State *L) {
     sscluster = ssnext;
   }
   //lua_assert(gettotalbytes(g) == sizeof(LG));
-  if (g->lockstate) lua_unlock(L);
+  lua_unlock(L);
   _lua_freelock(g->lock);
+  _lua_freeeventqueue(g->events);
   (*g->frealloc)(g->ud, fromstate(L), sizeof(LG), 0);  /* free main block */
 }
 
 
+/*
+** {======================================================
+** Thread pool: dead threads keep their stacks and 'ci' lists and
+** are handed out again by 'lua_newthread'. Pooled threads are out of
+** all GC lists, so their memory is still counted as in use.
+** =======================================================
+*/
+
+static void poolthread (global_State *g, lua_State *L1) {
+  StkId stack = L1->stack;
+  int stacksize = L1->stacksize;
+  CIBlock *ciblock = L1->ciblock;
+  StkId o;
+  for (o = stack; o < stack + stacksize; o++)
+    setnilvalue(o);  /* do not keep old values alive */
+  preinit_state(L1, g);
+  L1->stack = stack;  /* keep stack and 'ci' list */
+  L1->stacksize = stacksize;
+  L1->ciblock = ciblock;
+  gch(obj2gco(L1))->next = g->threadpool;
+  g->threadpool = obj2gco(L1);
+  g->npooled++;
+}
+
+
+static lua_State *unpoolthread (global_State *g) {
+  GCObject *o = g->threadpool;
+  g->threadpool = gch(o)->next;
+  g->npooled--;
+  gch(o)->marked = luaC_white(g);  /* link it back as a new object */
+  gch(o)->next = g->allgc;
+  g->allgc = o;
+  return gco2th(o);
+}
+
+
+/*
+** free pooled threads until there are at most 'n' of them
+*/
+void luaE_trimthreadpool (lua_State *L, int n) {
+  global_State *g = G(L);
+  while (g->npooled > n) {
+    lua_State *L1 = gco2th(g->threadpool);
+    g->threadpool = gch(g->threadpool)->next;
+    g->npooled--;
+    freestack(L1);
+    luaM_free(L, fromstate(L1));
+  }
+}
+
+/* }====================================================== */
+
+
 LUA_API lua_State *lua_newthread (lua_State *L) {
+  global_State *g = G(L);
   TValue ptmp;
   const TValue *hookt, *val;
   lua_State *L1;
   lua_lock(L);
   luaC_checkGC(L);
-  L1 = &luaC_newobj(L, LUA_TTHREAD, sizeof(LX), NULL, offsetof(LX, l))->th;
+  if (g->threadpool != NULL)  /* is there a dead thread to reuse? */
+    L1 = unpoolthread(g);
+  else {
+    L1 = &luaC_newobj(L, LUA_TTHREAD, sizeof(LX), NULL, offsetof(LX, l))->th;
+    preinit_state(L1, g);
+  }
   setthvalue(L, L->top, L1);
   api_incr_top(L);
-  preinit_state(L1, G(L));
-  L1->hookmask = L->hookmask;
+  L1->hookmask = L->hookmask & ~LUAI_MASKINTERNAL;
+  memset(&L1->acct, 0, sizeof(L1->acct));
   L1->basehookcount = L->basehookcount;
   L1->hook = L->hook;
   /* copy Lua hook function */
   setpvalue(&ptmp, (void *)&KEY_HOOK)
-  hookt = luaH_get(L, hvalue(&G(L)->l_registry), &ptmp);
+  hookt = luaH_get(L, hvalue(&g->l_registry), &ptmp);
   if (hookt != luaO_nilobject) {
     setthvalue(L, &ptmp, L);
     val = luaH_get(L, hvalue(hookt), &ptmp);
@@ -295,17 +439,26 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   }
   resethookcount(L1);
   luai_userstatethread(L, L1);
-  stack_init(L1, L);  /* init stack */
+  if (L1->stack == NULL)
+    stack_init(L1, L);  /* init stack */
+  else
+    base_ci_init(L1);  /* reuse stack from the pool */
   lua_unlock(L);
   return L1;
 }
 
 
 void luaE_freethread (lua_State *L, lua_State *L1) {
+  global_State *g = G(L);
   LX *l = fromstate(L1);
   luaF_close(L1, L1->stack);  /* close all upvalues for this thread */
   lua_assert(L1->openupval == NULL);
   luai_userstatefree(L, L1);
+  if (g->npooled < g->maxpooled && L1->stack != NULL &&
+      (L1->stacksize <= LUAI_POOLSTACK || L1->stacksize <= g->stackinit)) {
+    poolthread(g, L1);  /* keep it for 'lua_newthread' */
+    return;
+  }
   freestack(L1);
   luaM_free(L, l);
 }
@@ -327,6 +480,7 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   preinit_state(L, g);
   g->frealloc = f;
   g->ud = ud;
+  g->frelease = NULL;
   g->mainthread = L;
   g->seed = makeseed(L);
   g->uvhead.u.l.prev = &g->uvhead;
@@ -353,10 +507,24 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcmajorinc = LUAI_GCMAJOR;
   g->gcstepmul = LUAI_GCMUL;
   g->lock = _lua_newlock();
-  g->lockstate = 0;
+  g->events = _lua_neweventqueue();
   g->haltstate = 0;
   g->disabled = 0;
   g->ropestacksize = 8;
+  g->ropestack = NULL;  /* 'close_state' may run before 'f_luaopen' is done */
+  g->ropeclusters = g->ssclusters = NULL;
+  memset(&g->gcst, 0, sizeof(g->gcst));
+  g->sampler = NULL;
+  g->budget = 0;
+  g->budgetthread = NULL;
+  g->preempted = 0;
+  g->threadpool = NULL;
+  g->npooled = 0;
+  g->maxpooled = LUAI_THREADPOOL;
+  g->stackinit = BASIC_STACK_SIZE;
+  g->accounting = LUAI_ACCOUNTING;
+  g->acctthread = NULL;
+  g->allocated = 0;
   for (i=0; i < 14; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
@@ -50,6 +50,18 @@ struct lua_longjmp;  /* defined in ldo.c */
 #define BASIC_STACK_SIZE        (2*LUA_MINSTACK)
 
 
+/*
+** internal hook-mask bit (no hook uses it): thread is running under the
+** instruction budget of 'lua_resumebudget'
+*/
+#define LUAI_MASKBUDGET	(1 << LUA_HOOKTAILCALL)
+
+/* internal bit: thread counts the instructions it executes */
+#define LUAI_MASKACCOUNT	(1 << 8)
+
+#define LUAI_MASKINTERNAL	(LUAI_MASKBUDGET | LUAI_MASKACCOUNT)
+
+
 /* kinds of Garbage Collection */
 #define KGC_NORMAL	0
 #define KGC_EMERGENCY	1	/* gc was forced by an allocation failure */
@@ -99,6 +111,16 @@ typedef struct CallInfo {
 } CallInfo;
 
 
+/*
+** block of contiguous CallInfo entries (see 'luaE_extendCI')
+*/
+typedef struct CIBlock {
+  struct CIBlock *previous;  /* block allocated before this one */
+  int size;  /* number of entries in 'ci' */
+  CallInfo ci[1];
+} CIBlock;
+
+
 /*
 ** Bits in CallInfo status
 */
@@ -116,6 +138,17 @@ typedef struct CallInfo {
 #define isLua(ci)	((ci)->callstatus & CIST_LUA)
 
 
+/*
+** collector telemetry (see 'lua_gcstats')
+*/
+typedef struct GCstats {
+  lua_GCStats s;  /* values reported by the API */
+  double cycletime[LUA_GCSTATPHASES];  /* time per phase in current cycle */
+  lu_mem live[LUA_GCSTATKINDS];  /* bytes marked in current cycle */
+  double clock;  /* start of the interval being measured */
+} GCstats;
+
+
 /*
 ** `global state', shared by all threads of this state
 */
@@ -156,8 +189,9 @@ typedef struct global_State {
   TString *tmname[TM_N];  /* array with tag-method names */
   struct Table *mt[14];  /* metatables for basic types */
   /* all members below this are added in craftos2-lua */
+  lua_Release frelease;  /* function to release all memory of 'frealloc' */
   void* lock;  /* pointer to lock */
-  lu_byte lockstate;  /* 0 = unlocked, 1 = locked */
+  void* events;  /* queue of events posted by other threads */
   lu_byte haltstate;  /* set to indicate state execution should be halted (1 = halt all, 2 = throw error) */
   lu_byte disabled;  /* bit flags for features to disable: bit 0 = bytecode loading/dumping */
   const char * haltmessage;  /* if haltstate is 2, a message to show as the error message */
@@ -168,6 +202,20 @@ typedef struct global_State {
   TString *ssclusters;  /* pointer to first node of rope cluster list */
   TString *ssfreecluster;  /* pointer to first potentially free cluster */
   functable *allowedcfuncs[256];  /* "hash map" storing allowed C functions */
+  GCstats gcst;  /* collector telemetry */
+  struct AllocSampler *sampler;  /* allocation sampler (NULL if off) */
+  l_mem budget;  /* instructions left to 'budgetthread' */
+  struct lua_State *budgetthread;  /* thread run by 'lua_resumebudget' */
+  lu_byte preempted;  /* true if 'budgetthread' ran out of budget */
+  GCObject *threadpool;  /* list of dead threads kept for reuse */
+  int npooled;  /* number of threads in 'threadpool' */
+  int maxpooled;  /* maximum number of threads in 'threadpool' */
+  int stackinit;  /* initial stack size of new threads */
+  lu_byte accounting;  /* true if resumes are accounted */
+  struct lua_State *acctthread;  /* thread being charged (NULL if none) */
+  double acctwall, acctcpu;  /* clocks when it started being charged */
+  lu_mem acctbytes;  /* 'allocated' when it started being charged */
+  lu_mem allocated;  /* bytes allocated since the state was created */
 } global_State;
 
 
@@ -180,13 +228,16 @@ struct lua_State {
   StkId top;  /* first free slot in the stack */
   global_State *l_G;
   CallInfo *ci;  /* call info for current function */
+  CIBlock *ciblock;  /* last block of CallInfo entries */
   const Instruction *oldpc;  /* last pc traced */
   StkId stack_last;  /* last free slot in the stack */
   StkId stack;  /* stack base */
   int stacksize;
+  int stackhwm;  /* decaying high-water mark of stack use */
   unsigned short nny;  /* number of non-yieldable calls in stack */
   unsigned short nCcalls;  /* number of nested C calls */
-  lu_byte hookmask;
+  unsigned short baseCcalls;  /* nested C calls when thread was resumed */
+  unsigned short hookmask;
   lu_byte allowhook;
   int basehookcount;
   int hookcount;
@@ -196,6 +247,7 @@ struct lua_State {
   struct lua_longjmp *errorJmp;  /* current error recover point */
   ptrdiff_t errfunc;  /* current error handling function (stack index) */
   CallInfo base_ci;  /* CallInfo for first level (C calling Lua) */
+  lua_ThreadStats acct;  /* accounting (see 'lua_threadstats') */
 };
 
 
@@ -247,6 +299,7 @@ union GCObject {
 
 LUAI_FUNC void luaE_setdebt (global_State *g, l_mem debt);
 LUAI_FUNC void luaE_freethread (lua_State *L, lua_State *L1);
+LUAI_FUNC void luaE_trimthreadpool (lua_State *L, int n);
 LUAI_FUNC CallInfo *luaE_extendCI (lua_State *L);
 LUAI_FUNC void luaE_freeCI (lua_State *L);
 
@@ -209,7 +209,8 @@ TString *luaS_concat (lua_State *L, TString *l, TString *r) {
     }
     if (rope != NULL) break;
     if (nextropecluster(cluster) == NULL) {  /* need new cluster? */
-      next = luaM_newvector(L, ROPE_CLUSTER_SIZE, TString);
+      next = cast(TString *, luaM_newobject(L, LUA_TROPSTR,
+                       ROPE_CLUSTER_SIZE * sizeof(TString)));
       memset(next, 0, ROPE_CLUSTER_SIZE * sizeof(TString));
       nextropecluster(cluster) = next;  /* chain next cluster in list */
       nextropecluster(next) = NULL;  /* ensure next pointer is NULL */
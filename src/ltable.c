@@ -376,6 +376,33 @@ Table *luaH_new (lua_State *L) {
 }
 
 
+/*
+** fills the new (empty) table 'c' with the contents of 't'. Both parts
+** are copied as they are, so no key is hashed again; only the chains
+** of the hash part move to the new nodes.
+*/
+void luaH_copy (lua_State *L, Table *c, const Table *t) {
+  if (t->sizearray > 0) {
+    TValue *array = luaM_newvector(L, t->sizearray, TValue);
+    memcpy(array, t->array, t->sizearray * sizeof(TValue));
+    c->array = array;
+    c->sizearray = t->sizearray;
+  }
+  if (!isdummy(t->node)) {
+    int i, size = sizenode(t);
+    Node *n = luaM_newvector(L, size, Node);
+    memcpy(n, t->node, size * sizeof(Node));
+    for (i = 0; i < size; i++) {
+      if (gnext(&n[i]) != NULL)
+        gnext(&n[i]) = n + (gnext(&n[i]) - t->node);
+    }
+    c->node = n;
+    c->lsizenode = t->lsizenode;
+    c->lastfree = n + (t->lastfree - t->node);
+  }
+}
+
+
 void luaH_free (lua_State *L, Table *t) {
   if (!isdummy(t->node))
     luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
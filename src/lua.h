@@ -49,6 +49,7 @@
 #define LUA_ERRMEM	4
 #define LUA_ERRGCMM	5
 #define LUA_ERRERR	6
+#define LUA_PREEMPT	7	/* returned only by 'lua_resumebudget' */
 
 
 typedef struct lua_State lua_State;
@@ -70,6 +71,12 @@ typedef int (*lua_Writer) (lua_State *L, const void* p, size_t sz, void* ud);
 typedef void * (*lua_Alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
 
 
+/*
+** prototype for functions that release a whole memory region at once
+*/
+typedef void (*lua_Release) (void *ud);
+
+
 /*
 ** basic types
 */
@@ -262,9 +269,17 @@ LUA_API int   (lua_pcallk) (lua_State *L, int nargs, int nresults, int errfunc,
 LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
                                         const char *chunkname,
                                         const char *mode);
+/* besides 'b' and 't', 'mode' may hold 'O' (optimize the code) and 'L'
+   (lazy: functions keep only their text until first called). A lazy load
+   only scans the bodies of functions, which reports every syntax error
+   and finds the locals they capture, and generates code for the main
+   function alone; limits of code generation (such as "function or
+   expression too complex") are reported when a function is compiled.
+   The debug API compiles a function when it needs its locals or lines. */
 
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data);
 LUA_API int (lua_dump53) (lua_State *L, lua_Writer writer, void *data, int strip);
+LUA_API int (lua_heapsnapshot) (lua_State *L, lua_Writer writer, void *data);
 
 
 /*
@@ -274,6 +289,8 @@ LUA_API int  (lua_yieldk) (lua_State *L, int nresults, int ctx,
                            lua_CFunction k);
 #define lua_yield(L,n)		lua_yieldk(L, (n), 0, NULL)
 LUA_API int  (lua_resume) (lua_State *L, lua_State *from, int narg);
+LUA_API int  (lua_resumebudget) (lua_State *L, lua_State *from, int narg,
+                                 int budget);
 LUA_API int  (lua_status) (lua_State *L);
 LUA_API int  (lua_isyieldable) (lua_State *L);
 
@@ -293,10 +310,88 @@ LUA_API int  (lua_isyieldable) (lua_State *L);
 #define LUA_GCISRUNNING		9
 #define LUA_GCGEN		10
 #define LUA_GCINC		11
+#define LUA_GCTHREADPOOL	12
+#define LUA_GCSTACKSIZE		13
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
 
+/*
+** garbage-collection statistics
+*/
+
+#define LUA_GCSTATPHASES	6	/* collector phases (propagate ... pause) */
+#define LUA_GCSTATBUCKETS	20	/* buckets in the pause histogram */
+
+/* kinds of objects in per-kind byte counts */
+#define LUA_GCKSTRING		0
+#define LUA_GCKROPE		1
+#define LUA_GCKSUBSTR		2
+#define LUA_GCKTABLE		3
+#define LUA_GCKLCL		4
+#define LUA_GCKCCL		5
+#define LUA_GCKUDATA		6
+#define LUA_GCKTHREAD		7
+#define LUA_GCKPROTO		8
+#define LUA_GCKUPVAL		9
+
+#define LUA_GCSTATKINDS		10
+
+typedef struct lua_GCStats {
+  double phasetime[LUA_GCSTATPHASES];  /* seconds spent in each phase */
+  double lastphasetime[LUA_GCSTATPHASES];  /* same, in last complete cycle */
+  unsigned long pauses[LUA_GCSTATBUCKETS];  /* steps shorter than 2^(i+1) us */
+  double maxpause;  /* longest step, in seconds */
+  size_t live[LUA_GCSTATKINDS];  /* bytes marked in last cycle, per kind */
+  size_t freed[LUA_GCSTATKINDS];  /* bytes freed since state creation */
+  size_t ropeclusters;  /* bytes held by rope clusters */
+  size_t substrclusters;  /* bytes held by substring clusters */
+  unsigned long cycles;  /* complete collection cycles */
+  unsigned long finalized;  /* finalizers called */
+  unsigned long finalizererrors;  /* finalizers that raised an error */
+  unsigned long strnuse;  /* strings in the string table */
+  unsigned long strsize;  /* slots in the string table */
+  unsigned long stackgrows;  /* times a thread stack was enlarged */
+  unsigned long stackshrinks;  /* times a thread stack was reduced */
+} lua_GCStats;
+
+LUA_API void (lua_gcstats) (lua_State *L, lua_GCStats *s);
+
+
+/*
+** allocation sampling
+*/
+
+typedef struct lua_AllocSample {
+  const char *stack;  /* folded call stack ("outer;...;inner") */
+  const char *type;  /* kind of object allocated ("memory" for other blocks) */
+  const char *func;  /* innermost Lua function ("source:linedefined") */
+  int line;  /* current line of 'func' */
+  size_t count;  /* number of samples */
+  size_t bytes;  /* bytes represented by the samples */
+} lua_AllocSample;
+
+LUA_API int (lua_setallocsampler) (lua_State *L, size_t rate);
+LUA_API int (lua_getallocsample) (lua_State *L, int n, lua_AllocSample *s);
+
+
+/*
+** per-thread accounting (time spent in coroutines they resumed is
+** charged to those coroutines, not to the thread)
+*/
+
+typedef struct lua_ThreadStats {
+  double walltime;  /* seconds the thread ran while resumed */
+  double cputime;  /* processor seconds it used while resumed */
+  unsigned long instructions;  /* VM instructions it executed */
+  size_t allocated;  /* bytes allocated while it ran */
+  unsigned long resumes;  /* times it was resumed */
+} lua_ThreadStats;
+
+LUA_API int (lua_setaccounting) (lua_State *L, int on); /* returns previous setting */
+LUA_API void (lua_threadstats) (lua_State *L, lua_ThreadStats *s);
+
+
 /*
 ** miscellaneous functions
 */
@@ -312,12 +407,45 @@ LUA_API void  (lua_len)    (lua_State *L, int idx);
 
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void      (lua_setallocf) (lua_State *L, lua_Alloc f, void *ud);
+LUA_API void      (lua_setreleasef) (lua_State *L, lua_Release f);
 
 LUA_API void  (lua_halt) (lua_State *L); /* forcefully halts the Lua state specified from a separate thread
 											warning: this will leave the state in an invalid state;
 											do not use the state after calling this - close it immediately */
 LUA_API void  (lua_externalerror) (lua_State *L, const char * message); /* throws an error into a running state - meant to be run from a different thread */
 LUA_API void  (lua_setlockstate) (lua_State *L, int enabled); /* enables/disables lua_lock */
+
+/* lock policies */
+#define LUA_LOCKNONE	0	/* no locking (single-threaded hosts) */
+#define LUA_LOCKFUTEX	1	/* sleep in the kernel while contended */
+#define LUA_LOCKSPIN	2	/* spin for a while, then sleep */
+
+typedef struct lua_LockStats {
+  unsigned long acquisitions;  /* times the lock was taken */
+  unsigned long contended;  /* acquisitions that found it taken */
+  unsigned long spins;  /* spins done by contended acquisitions */
+  unsigned long parks;  /* times a thread slept waiting for it */
+  unsigned long elided;  /* lock calls skipped inside a lock scope */
+} lua_LockStats;
+
+LUA_API int   (lua_setlockpolicy) (lua_State *L, int policy); /* returns previous policy */
+LUA_API void  (lua_lockscope_begin) (lua_State *L); /* holds the lock across a batch of API calls (which must not raise errors) */
+LUA_API void  (lua_lockscope_end) (lua_State *L);
+LUA_API void  (lua_lockstats) (lua_State *L, lua_LockStats *s);
+
+/* events posted by other threads (see levent.cpp); building and posting
+   an event needs neither the state lock nor the Lua heap */
+typedef struct lua_Event lua_Event;
+
+LUA_API lua_Event *(lua_newevent) (void);
+LUA_API void  (lua_eventnil) (lua_Event *ev);
+LUA_API void  (lua_eventboolean) (lua_Event *ev, int b);
+LUA_API void  (lua_eventnumber) (lua_Event *ev, lua_Number n);
+LUA_API void  (lua_eventstring) (lua_Event *ev, const char *s, size_t l);
+LUA_API int   (lua_eventtable) (lua_Event *ev, int n); /* next 2n values are its keys and values */
+LUA_API int   (lua_postevent) (lua_State *L, lua_Event *ev); /* takes ownership of 'ev' */
+LUA_API int   (lua_pendingevents) (lua_State *L);
+LUA_API int   (lua_drainevents) (lua_State *L, int max); /* pushes a sequence of events */
 LUA_API void  (lua_setdisableflags)(lua_State *L, unsigned char flags); /* sets flags to disable features; bit 0 = bytecode load/dump */
 
 
@@ -406,6 +534,14 @@ LUA_API const char *(lua_setlocal) (lua_State *L, const lua_Debug *ar, int n);
 LUA_API const char *(lua_getupvalue) (lua_State *L, int funcindex, int n);
 LUA_API const char *(lua_setupvalue) (lua_State *L, int funcindex, int n);
 
+/*
+** A closure over a local that nothing assigns after its declaration gets
+** its own copy of the value (see 'byvalue' in lopt.c). Such an upvalue is
+** not shared: 'lua_setupvalue' changes only that closure (not the local
+** nor other closures of it), 'lua_setlocal' does not reach closures
+** already created, and 'lua_upvalueid' gives a different id for each
+** closure. Use 'lua_upvaluejoin' to share it again.
+*/
 LUA_API void *(lua_upvalueid) (lua_State *L, int fidx, int n);
 LUA_API void  (lua_upvaluejoin) (lua_State *L, int fidx1, int n1,
                                                int fidx2, int n2);
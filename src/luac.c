@@ -28,6 +28,7 @@ static void PrintFunction(const Proto* f, int full);
 static int listing=0;			/* list bytecodes? */
 static int dumping=1;			/* dump bytecodes? */
 static int stripping=0;			/* strip debug information? */
+static int optimizing=0;		/* optimize bytecodes? */
 static char Output[]={ OUTPUT };	/* default output file name */
 static const char* output=Output;	/* actual output file name */
 static const char* progname=PROGNAME;	/* actual program name */
@@ -55,6 +56,7 @@ static void usage(const char* message)
   "Available options are:\n"
   "  -l       list (use -l -l for full listing)\n"
   "  -o name  output to file " LUA_QL("name") " (default is \"%s\")\n"
+  "  -O       optimize bytecodes\n"
   "  -p       parse only\n"
   "  -s       strip debug information\n"
   "  -v       show version information\n"
@@ -92,6 +94,8 @@ static int doargs(int argc, char* argv[])
     usage(LUA_QL("-o") " needs argument");
    if (IS("-")) output=NULL;
   }
+  else if (IS("-O"))			/* optimize */
+   optimizing=1;
   else if (IS("-p"))			/* parse only */
    dumping=0;
   else if (IS("-s"))			/* strip debug information */
@@ -149,6 +153,7 @@ static const Proto* combine(lua_State* L, int n)
    if (f->p[i]->sizeupvalues>0) f->p[i]->upvalues[0].instack=0;
   }
   f->sizelineinfo=0;
+  f->sizeabslineinfo=0;
   return f;
  }
 }
@@ -169,7 +174,8 @@ static int pmain(lua_State* L)
  for (i=0; i<argc; i++)
  {
   const char* filename=IS("-") ? NULL : argv[i];
-  if (luaL_loadfile(L,filename)!=LUA_OK) fatal(lua_tostring(L,-1));
+  if (luaL_loadfilex(L,filename,optimizing ? "btO" : NULL)!=LUA_OK)
+   fatal(lua_tostring(L,-1));
  }
  f=combine(L,argc);
  if (listing) luaU_print(f,listing>1);
@@ -288,16 +294,17 @@ static void PrintCode(const Proto* f)
   int ax=GETARG_Ax(i);
   int bx=GETARG_Bx(i);
   int sbx=GETARG_sBx(i);
-  int line=getfuncline(f,pc);
+  int line=luaG_getfuncline(f,pc);
   printf("\t%d\t",pc+1);
   if (line>0) printf("[%d]\t",line); else printf("[-]\t");
   printf("%-9s\t",luaP_opnames[o]);
   switch (getOpMode(o))
   {
    case iABC:
-    printf("%d",a);
+    printf("%d",isjumpcmp(o) ? GETARG_sA(i) : a);
     if (getBMode(o)!=OpArgN) printf(" %d",ISK(b) ? (MYK(INDEXK(b))) : b);
-    if (getCMode(o)!=OpArgN) printf(" %d",ISK(c) ? (MYK(INDEXK(c))) : c);
+    if (o==OP_ADDI || o==OP_SUBI) printf(" %d",GETARG_sC(i));
+    else if (getCMode(o)!=OpArgN) printf(" %d",ISK(c) ? (MYK(INDEXK(c))) : c);
     break;
    case iABx:
     printf("%d",a);
@@ -331,6 +338,7 @@ static void PrintCode(const Proto* f)
     break;
    case OP_GETTABLE:
    case OP_SELF:
+   case OP_SWITCH:
     if (ISK(c)) { printf("\t; "); PrintConstant(f,INDEXK(c)); }
     break;
    case OP_SETTABLE:
@@ -350,15 +358,35 @@ static void PrintCode(const Proto* f)
      if (ISK(c)) PrintConstant(f,INDEXK(c)); else printf("-");
     }
     break;
+   case OP_JEQ:
+   case OP_JNE:
+   case OP_JLT:
+   case OP_JNLT:
+   case OP_JLE:
+   case OP_JNLE:
+    printf("\t; to %d",GETARG_sA(i)+pc+2);
+    if (ISK(b) || ISK(c))
+    {
+     printf(" ");
+     if (ISK(b)) PrintConstant(f,INDEXK(b)); else printf("-");
+     printf(" ");
+     if (ISK(c)) PrintConstant(f,INDEXK(c)); else printf("-");
+    }
+    break;
    case OP_JMP:
    case OP_FORLOOP:
    case OP_FORPREP:
    case OP_TFORLOOP:
+   case OP_JTRUE:
+   case OP_JFALSE:
     printf("\t; to %d",sbx+pc+2);
     break;
    case OP_CLOSURE:
     printf("\t; %p",VOID(f->p[bx]));
     break;
+   case OP_TEMPLATE:
+    printf("\t; %p",VOID(f->templates[bx]));
+    break;
    case OP_SETLIST:
     if (c==0) printf("\t; %d",(int)code[++pc]); else printf("\t; %d",c);
     break;
@@ -417,8 +445,9 @@ static void PrintDebug(const Proto* f)
  printf("upvalues (%d) for %p:\n",n,VOID(f));
  for (i=0; i<n; i++)
  {
-  printf("\t%d\t%s\t%d\t%d\n",
-  i,UPVALNAME(i),f->upvalues[i].instack,f->upvalues[i].idx);
+  printf("\t%d\t%s\t%d\t%d\t%s\n",
+  i,UPVALNAME(i),f->upvalues[i].instack,f->upvalues[i].idx,
+  f->upvalues[i].byvalue ? "value" : "");
  }
 }
 
@@ -44,6 +44,9 @@ LUAMOD_API int (luaopen_package) (lua_State *L);
 #define LUA_UTF8LIBNAME "utf8"
 LUAMOD_API int (luaopen_utf8) (lua_State *L);
 
+#define LUA_WORKLIBNAME	"work"
+LUAMOD_API int (luaopen_work) (lua_State *L);
+
 
 /* open all previous libraries */
 LUALIB_API void (luaL_openlibs) (lua_State *L);
@@ -18,6 +18,7 @@
 #include "lmem.h"
 #include "lobject.h"
 #include "lstring.h"
+#include "ltable.h"
 #include "lundump.h"
 #include "lzio.h"
 
@@ -26,6 +27,11 @@ typedef struct {
  ZIO* Z;
  Mbuffer* b;
  const char* name;
+ const lu_byte* p;		/* next byte of the chunk */
+ const lu_byte* end;		/* end of the chunk (where the checksum is) */
+ Table* strings;		/* strings read so far, by index */
+ int nstrings;
+ int strip;
 } LoadState;
 
 static l_noret error(LoadState* S, const char* why)
@@ -45,22 +51,45 @@ static l_noret error(LoadState* S, const char* why)
 
 static void LoadBlock(LoadState* S, void* b, size_t size)
 {
- if (luaZ_read(S->Z,b,size)!=0) error(S,"truncated");
+ if (size>cast(size_t,S->end-S->p)) error(S,"truncated");
+ memcpy(b,S->p,size);
+ S->p+=size;
 }
 
 static int LoadChar(LoadState* S)
 {
- char x;
- LoadVar(S,x);
+ if (S->p==S->end) error(S,"truncated");
+ return *S->p++;
+}
+
+static size_t LoadSize(LoadState* S)
+{
+ size_t x=0;
+ int shift=0;
+ int b;
+ do
+ {
+  b=LoadChar(S);
+  if (shift>=cast_int(sizeof(size_t)*8)) error(S,"corrupted");
+  x|=cast(size_t,b&0x7f)<<shift;
+  shift+=7;
+ } while (b&0x80);
  return x;
 }
 
 static int LoadInt(LoadState* S)
 {
- int x;
- LoadVar(S,x);
- if (x<0) error(S,"corrupted");
- return x;
+ size_t x=LoadSize(S);
+ if (x>INT_MAX) error(S,"corrupted");
+ return cast_int(x);
+}
+
+/* number of items that take at least a byte each */
+static int LoadCount(LoadState* S)
+{
+ int n=LoadInt(S);
+ if (cast(size_t,n)>cast(size_t,S->end-S->p)) error(S,"truncated");
+ return n;
 }
 
 static lua_Number LoadNumber(LoadState* S)
@@ -70,23 +99,34 @@ static lua_Number LoadNumber(LoadState* S)
  return x;
 }
 
+/* see DumpString */
 static TString* LoadString(LoadState* S)
 {
- uint32_t size;
- LoadVar(S,size);
- if (size==0)
+ int i=LoadInt(S);
+ if (i==0)
   return NULL;
- else
+ else if (i<=S->nstrings)
+  return rawtsvalue(&S->strings->array[i-1]);
+ else if (i==S->nstrings+1)
  {
-  char* s=luaZ_openspace(S->L,S->b,size);
-  LoadBlock(S,s,size*sizeof(char));
-  return luaS_newlstr(S->L,s,size-1);		/* remove trailing '\0' */
+  Table* t=S->strings;
+  size_t size=LoadSize(S);
+  TString* ts;
+  if (size>cast(size_t,S->end-S->p)) error(S,"truncated");
+  ts=luaS_newlstr(S->L,cast(const char*,S->p),size);
+  S->p+=size;
+  if (S->nstrings==t->sizearray)
+   luaH_resizearray(S->L,t,(t->sizearray>0) ? 2*t->sizearray : 32);
+  setsvalue(S->L,&t->array[S->nstrings++],ts);
+  return ts;
  }
+ else
+  error(S,"corrupted");
 }
 
 static void LoadCode(LoadState* S, Proto* f)
 {
- int n=LoadInt(S);
+ int n=LoadCount(S);
  f->code=luaM_newvector(S->L,n,Instruction);
  f->sizecode=n;
  LoadVector(S,f->code,n,sizeof(Instruction));
@@ -94,35 +134,47 @@ static void LoadCode(LoadState* S, Proto* f)
 
 static void LoadFunction(LoadState* S, Proto* f);
 
-static void LoadConstants(LoadState* S, Proto* f)
+static void LoadValue(LoadState* S, TValue* o)
 {
- int i,n;
- n=LoadInt(S);
- f->k=luaM_newvector(S->L,n,TValue);
- f->sizek=n;
- for (i=0; i<n; i++) setnilvalue(&f->k[i]);
- for (i=0; i<n; i++)
+ int t=LoadChar(S);
+ switch (t)
  {
-  TValue* o=&f->k[i];
-  int t=LoadChar(S);
-  switch (t)
-  {
-   case LUA_TNIL:
+  case LUA_TNIL:
 	setnilvalue(o);
 	break;
-   case LUA_TBOOLEAN:
+  case LUA_TBOOLEAN:
 	setbvalue(o,LoadChar(S));
 	break;
-   case LUA_TNUMBER:
+  case LUA_TNUMBER:
 	setnvalue(o,LoadNumber(S));
 	break;
-   case LUA_TSTRING:
-	setsvalue2n(S->L,o,LoadString(S));
+  case LUAC_TINT:
+  {
+	size_t x=LoadSize(S);
+	setnvalue(o,(x&1) ? -cast_num(x>>1)-1 : cast_num(x>>1));
 	break;
-    default: lua_assert(0);
   }
+  case LUA_TSTRING:
+  {
+	TString* ts=LoadString(S);
+	if (ts==NULL) error(S,"corrupted");
+	setsvalue2n(S->L,o,ts);
+	break;
+  }
+  default:
+	error(S,"corrupted");
  }
- n=LoadInt(S);
+}
+
+static void LoadConstants(LoadState* S, Proto* f)
+{
+ int i,n;
+ n=LoadCount(S);
+ f->k=luaM_newvector(S->L,n,TValue);
+ f->sizek=n;
+ for (i=0; i<n; i++) setnilvalue(&f->k[i]);
+ for (i=0; i<n; i++) LoadValue(S,&f->k[i]);
+ n=LoadCount(S);
  f->p=luaM_newvector(S->L,n,Proto*);
  f->sizep=n;
  for (i=0; i<n; i++) f->p[i]=NULL;
@@ -136,7 +188,7 @@ static void LoadConstants(LoadState* S, Proto* f)
 static void LoadUpvalues(LoadState* S, Proto* f)
 {
  int i,n;
- n=LoadInt(S);
+ n=LoadCount(S);
  f->upvalues=luaM_newvector(S->L,n,Upvaldesc);
  f->sizeupvalues=n;
  for (i=0; i<n; i++) f->upvalues[i].name=NULL;
@@ -144,18 +196,54 @@ static void LoadUpvalues(LoadState* S, Proto* f)
  {
   f->upvalues[i].instack=LoadByte(S);
   f->upvalues[i].idx=LoadByte(S);
+  f->upvalues[i].byvalue=LoadByte(S);
+ }
+}
+
+/* builds the templates again, hashing their keys for this state */
+static void LoadTemplates(LoadState* S, Proto* f)
+{
+ int i,j,n;
+ n=LoadCount(S);
+ f->templates=luaM_newvector(S->L,n,Table*);
+ f->sizetemplates=n;
+ for (i=0; i<n; i++) f->templates[i]=NULL;
+ for (i=0; i<n; i++)
+ {
+  Table* t=f->templates[i]=luaH_new(S->L);
+  int na=LoadCount(S);
+  luaH_resize(S->L,t,na,0);
+  for (j=0; j<na; j++) LoadValue(S,&t->array[j]);
+  luaH_resize(S->L,t,na,LoadInt(S));
+  for (j=LoadInt(S); j>0; j--)
+  {
+   TValue k,v;
+   LoadValue(S,&k);
+   LoadValue(S,&v);
+   if (ttisnil(&k)) error(S,"corrupted");
+   setobj2t(S->L,luaH_set(S->L,t,&k),&v);
+  }
  }
 }
 
 static void LoadDebug(LoadState* S, Proto* f)
 {
  int i,n;
+ if (S->strip) return;
  f->source=LoadString(S);
- n=LoadInt(S);
- f->lineinfo=luaM_newvector(S->L,n,int);
+ n=LoadCount(S);
+ f->lineinfo=luaM_newvector(S->L,n,ls_byte);
  f->sizelineinfo=n;
- LoadVector(S,f->lineinfo,n,sizeof(int));
- n=LoadInt(S);
+ LoadVector(S,f->lineinfo,n,sizeof(ls_byte));
+ n=LoadCount(S);
+ f->abslineinfo=luaM_newvector(S->L,n,AbsLineInfo);
+ f->sizeabslineinfo=n;
+ for (i=0; i<n; i++)
+ {
+  f->abslineinfo[i].pc=LoadInt(S)+((i>0) ? f->abslineinfo[i-1].pc : 0);
+  f->abslineinfo[i].line=LoadInt(S);
+ }
+ n=LoadCount(S);
  f->locvars=luaM_newvector(S->L,n,LocVar);
  f->sizelocvars=n;
  for (i=0; i<n; i++) f->locvars[i].varname=NULL;
@@ -165,8 +253,7 @@ static void LoadDebug(LoadState* S, Proto* f)
   f->locvars[i].startpc=LoadInt(S);
   f->locvars[i].endpc=LoadInt(S);
  }
- n=LoadInt(S);
- for (i=0; i<n; i++) f->upvalues[i].name=LoadString(S);
+ for (i=0; i<f->sizeupvalues; i++) f->upvalues[i].name=LoadString(S);
 }
 
 static void LoadFunction(LoadState* S, Proto* f)
@@ -179,6 +266,7 @@ static void LoadFunction(LoadState* S, Proto* f)
  LoadCode(S,f);
  LoadConstants(S,f);
  LoadUpvalues(S,f);
+ LoadTemplates(S,f);
  LoadDebug(S,f);
 }
 
@@ -194,13 +282,68 @@ static void LoadHeader(LoadState* S)
  lu_byte s[LUAC_HEADERSIZE];
  luaU_header(h);
  memcpy(s,h,sizeof(char));			/* first char already read */
- LoadBlock(S,s+sizeof(char),LUAC_HEADERSIZE-sizeof(char));
+ if (luaZ_read(S->Z,s+sizeof(char),LUAC_HEADERSIZE-sizeof(char))!=0)
+  error(S,"truncated");
  if (memcmp(h,s,N0)==0) return;
  if (memcmp(h,s,N1)!=0) error(S,"not a");
  if (memcmp(h,s,N2)!=0) error(S,"version mismatch in");
  if (memcmp(h,s,N3)!=0) error(S,"incompatible"); else error(S,"corrupted");
 }
 
+/*
+** reads the rest of the chunk into one buffer and checks it against its
+** checksum; the chunk is then read from there
+*/
+static void LoadChunk(LoadState* S)
+{
+ Mbuffer* b=S->b;
+ size_t n=0;
+ lu_int32 sum=0;
+ const lu_byte* p;
+ int i;
+ for (;;)
+ {
+  size_t size=luaZ_sizebuffer(b);
+  if (n==size)
+  {
+   size=(size<LUA_MINBUFFER) ? LUA_MINBUFFER : 2*size;
+   luaZ_resizebuffer(S->L,b,size);
+  }
+  size-=n;
+  size-=luaZ_read(S->Z,luaZ_buffer(b)+n,size);
+  n+=size;
+  if (n<luaZ_sizebuffer(b)) break;	/* no more input */
+ }
+ if (n<5) error(S,"truncated");
+ p=cast(const lu_byte*,luaZ_buffer(b));
+ S->end=p+n-4;
+ for (i=3; i>=0; i--) sum=(sum<<8)|S->end[i];
+ if (luaU_checksum(1,p,n-4)!=sum) error(S,"corrupted");
+ S->strip=*p;
+ S->p=p+1;
+}
+
+/*
+** Adler-32 of 'n' bytes at 'p', going on from 'sum' (1 to start)
+*/
+lu_int32 luaU_checksum (lu_int32 sum, const lu_byte* p, size_t n)
+{
+ lu_int32 a=sum&0xffff, b=sum>>16;
+ while (n>0)
+ {
+  size_t k=(n<5552) ? n : 5552;		/* most bytes without overflow */
+  n-=k;
+  while (k--)
+  {
+   a+=*p++;
+   b+=a;
+  }
+  a%=65521;
+  b%=65521;
+ }
+ return (b<<16)|a;
+}
+
 /*
 ** load precompiled chunk
 */
@@ -218,24 +361,33 @@ Closure* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
  S.Z=Z;
  S.b=buff;
  LoadHeader(&S);
- cl=luaF_newLclosure(L,1);
+ LoadChunk(&S);
+ S.strings=luaH_new(L);
+ S.nstrings=0;
+ sethvalue(L,L->top,S.strings); incr_top(L);	/* anchor it */
+ cl=luaF_newLclosure(L,1,0);
  setclLvalue(L,L->top,cl); incr_top(L);
  cl->l.p=luaF_newproto(L);
  LoadFunction(&S,cl->l.p);
+ if (S.p!=S.end) error(&S,"corrupted");
  if (cl->l.p->sizeupvalues != 1)
  {
   Proto* p=cl->l.p;
-  cl=luaF_newLclosure(L,cl->l.p->sizeupvalues);
+  cl=luaF_newLclosure(L,cl->l.p->sizeupvalues,0);
   cl->l.p=p;
   setclLvalue(L,L->top-1,cl);
  }
+ setobj2s(L,L->top-2,L->top-1);		/* drop the strings */
+ L->top--;
  luai_verifycode(L,buff,cl->l.p);
  return cl;
 }
 
 #define MYINT(s)	(s[0]-'0')
 #define VERSION		MYINT(LUA_VERSION_MAJOR)*16+MYINT(LUA_VERSION_MINOR)
-#define FORMAT		0		/* this is the official format */
+#define FORMAT		6		/* v2: varints, one string pool and a checksum,
+					   plus superinstructions, by-value upvalues,
+					   table templates and line deltas */
 
 /*
 * make header for precompiled chunks
@@ -16,9 +16,15 @@ LUAI_FUNC Closure* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char*
 /* make header; from lundump.c */
 LUAI_FUNC void luaU_header (lu_byte* h);
 
+/* checksum of the chunk after the header; from lundump.c */
+LUAI_FUNC lu_int32 luaU_checksum (lu_int32 sum, const lu_byte* p, size_t n);
+
 /* dump one chunk; from ldump.c */
 LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip);
 
+/* tag of an integral number in a chunk, written as a varint */
+#define LUAC_TINT		(LUA_TNUMBER | (1 << 4))
+
 /* data to catch conversion errors */
 #define LUAC_TAIL		"\x19\x93\r\n\x1a\n"
 
@@ -69,7 +69,7 @@ int luaV_tostring (lua_State *L, StkId obj) {
 
 static void traceexec (lua_State *L) {
   CallInfo *ci = L->ci;
-  lu_byte mask = L->hookmask;
+  int mask = L->hookmask;
   int counthook = ((mask & LUA_MASKCOUNT) && L->hookcount == 0);
   if (counthook)
     resethookcount(L);  /* reset count */
@@ -84,11 +84,10 @@ static void traceexec (lua_State *L) {
   if (mask & LUA_MASKLINE) {
     Proto *p = ci_func(ci)->p;
     int npc = pcRel(ci->u.l.savedpc, p);
-    int newline = getfuncline(p, npc);
     if (npc == 0 ||  /* call linehook when enter a new function, */
         ci->u.l.savedpc <= L->oldpc ||  /* when jump back (loop), or when */
-        newline != getfuncline(p, pcRel(L->oldpc, p)))  /* enter a new line */
-      luaD_hook(L, LUA_HOOKLINE, newline);  /* call line hook */
+        luaG_changedline(p, pcRel(L->oldpc, p), npc))  /* enter a new line */
+      luaD_hook(L, LUA_HOOKLINE, luaG_getfuncline(p, npc));
   }
   L->oldpc = ci->u.l.savedpc;
   if (L->status == LUA_YIELD) {  /* did hook yield? */
@@ -414,6 +413,24 @@ void luaV_arith (lua_State *L, StkId ra, const TValue *rb,
 }
 
 
+/*
+** can a closure holding a copy of 'v1' stand for one holding 'v2'? (Only
+** for the same object or equal non-collectable values, and zeros of the
+** same sign.)
+*/
+static int samevalue (const TValue *v1, const TValue *v2) {
+  if (!ttisequal(v1, v2))
+    return 0;
+  else if (ttisnumber(v1))
+    return luai_numeq(nvalue(v1), nvalue(v2)) &&
+           (nvalue(v1) != 0 || luai_numeq(1 / nvalue(v1), 1 / nvalue(v2)));
+  else if (iscollectable(v1))
+    return gcvalue(v1) == gcvalue(v2);
+  else
+    return luaV_rawequalobj(v1, v2);
+}
+
+
 /*
 ** check whether cached closure in prototype 'p' may be reused, that is,
 ** whether there is a cached closure with the same upvalues needed by
@@ -427,7 +444,9 @@ static Closure *getcached (Proto *p, UpVal **encup, StkId base) {
     int i;
     for (i = 0; i < nup; i++) {  /* check whether it has right upvalues */
       TValue *v = uv[i].instack ? base + uv[i].idx : encup[uv[i].idx]->v;
-      if (c->l.upvals[i]->v != v)
+      UpVal *up = c->l.upvals[i];
+      if (uv[i].byvalue && isownupval(&c->l, up) ? !samevalue(up->v, v)
+                                                 : up->v != v)
         return NULL;  /* wrong upvalue; cannot reuse closure */
     }
   }
@@ -437,7 +456,8 @@ static Closure *getcached (Proto *p, UpVal **encup, StkId base) {
 
 /*
 ** create a new Lua closure, push it in the stack, and initialize
-** its upvalues. Note that the call to 'luaC_barrierproto' must come
+** its upvalues. Upvalues captured by value are copied into the
+** closure. Note that the call to 'luaC_barrierproto' must come
 ** before the assignment to 'p->cache', as the function needs the
 ** original value of that field.
 */
@@ -445,12 +465,23 @@ static void pushclosure (lua_State *L, Proto *p, UpVal **encup, StkId base,
                          StkId ra) {
   int nup = p->sizeupvalues;
   Upvaldesc *uv = p->upvalues;
-  int i;
-  Closure *ncl = luaF_newLclosure(L, nup);
+  int i, nv = 0;
+  Closure *ncl;
+  UpVal *own;
+  for (i = 0; i < nup; i++)
+    nv += uv[i].byvalue;
+  ncl = luaF_newLclosure(L, nup, nv);
   ncl->l.p = p;
   setclLvalue(L, ra, ncl);  /* anchor new closure in stack */
+  own = ownupvals(&ncl->l);
   for (i = 0; i < nup; i++) {  /* fill in its upvalues */
-    if (uv[i].instack)  /* upvalue refers to local variable? */
+    if (uv[i].byvalue) {  /* copy of a value that never changes? */
+      UpVal *up = own++;
+      up->v = &up->u.value;
+      setobj(L, up->v, uv[i].instack ? base + uv[i].idx : encup[uv[i].idx]->v);
+      ncl->l.upvals[i] = up;
+    }
+    else if (uv[i].instack)  /* upvalue refers to local variable? */
       ncl->l.upvals[i] = luaF_findupval(L, base + uv[i].idx);
     else  /* get upvalue from enclosing function */
       ncl->l.upvals[i] = encup[uv[i].idx];
@@ -460,6 +491,72 @@ static void pushclosure (lua_State *L, Proto *p, UpVal **encup, StkId base,
 }
 
 
+/* maps constant 'k' to 'pc', unless an earlier test already has it */
+static void addcase (lua_State *L, Table *t, const TValue *k, int pc) {
+  if (ttisnumber(k) && luai_numisnan(L, nvalue(k)))
+    return;  /* never equal to anything */
+  if (ttisnil(luaH_get(L, t, k)))
+    setnvalue(luaH_set(L, t, k), cast_num(pc));
+}
+
+
+/*
+** Jump map of the OP_SWITCH at 'pc'. The first time the switch runs,
+** it follows the chain of tests that starts with the switch itself:
+** 'OP_EQ 0' (and its jump) or OP_JNE of the same register against a
+** string or number constant, each jumping forward to the next one.
+** Each constant maps to the code after its test, and 'false' (which no
+** test of the chain compares with) maps to where the chain ends.
+*/
+static Table *switchmap (lua_State *L, Proto *p, int pc) {
+  Instruction i = p->code[pc];
+  int n = GETARG_A(i);
+  int r = GETARG_B(i);
+  int next;
+  Table *t;
+  TValue key;
+  if (n < p->sizeswitches && p->switches[n] != NULL)
+    return p->switches[n];
+  if (n >= p->sizeswitches) {
+    int old = p->sizeswitches;
+    luaM_reallocvector(L, p->switches, old, n + 1, Table *);
+    p->sizeswitches = n + 1;
+    while (old <= n) p->switches[old++] = NULL;
+  }
+  t = p->switches[n] = luaH_new(L);
+  luaC_objbarrier(L, p, t);
+  addcase(L, t, p->k + INDEXK(GETARG_C(i)), pc + 2);
+  next = pc + 2 + GETARG_sBx(p->code[pc + 1]);
+  while (next + 1 < p->sizecode) {
+    Instruction j = p->code[next];
+    int b = GETARG_B(j);
+    int c = GETARG_C(j);
+    int body, dest;
+    const TValue *k;
+    if (GET_OPCODE(j) == OP_EQ && GETARG_A(j) == 0 &&
+        GET_OPCODE(p->code[next + 1]) == OP_JMP &&
+        GETARG_A(p->code[next + 1]) == 0) {
+      body = next + 2;
+      dest = body + GETARG_sBx(p->code[next + 1]);
+    }
+    else if (GET_OPCODE(j) == OP_JNE) {
+      body = next + 1;
+      dest = body + GETARG_sA(j);
+    }
+    else break;
+    if (b == r && ISK(c)) k = p->k + INDEXK(c);
+    else if (c == r && ISK(b)) k = p->k + INDEXK(b);
+    else break;
+    if (!(ttisstring(k) || ttisnumber(k)) || dest <= next) break;
+    addcase(L, t, k, body);
+    next = dest;
+  }
+  setbvalue(&key, 0);
+  setnvalue(luaH_set(L, t, &key), cast_num(next));
+  return t;
+}
+
+
 /*
 ** finish execution of an opcode interrupted by an yield
 */
@@ -523,11 +620,13 @@ int luaV_finishOp (lua_State *L) {
   switch (op) {  /* finish its execution */
     case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
     case OP_MOD: case OP_POW: case OP_UNM: case OP_LEN:
-    case OP_GETTABUP: case OP_GETTABLE: case OP_SELF: {
+    case OP_GETTABUP: case OP_GETTABLE: case OP_SELF:
+    case OP_ADDI: case OP_SUBI:
+    case OP_ADDN: case OP_SUBN: case OP_MULN: {
       setobjs2s(L, base + GETARG_A(inst), --L->top);
       break;
     }
-    case OP_LE: case OP_LT: case OP_EQ: {
+    case OP_LE: case OP_LT: case OP_EQ: case OP_LTN: {
       int res = !l_isfalse(L->top - 1);
       L->top--;
       /* metamethod should not be called when operand is K */
@@ -540,6 +639,20 @@ int luaV_finishOp (lua_State *L) {
         ci->u.l.savedpc++;  /* skip jump instruction */
       break;
     }
+    case OP_JEQ: case OP_JNE: case OP_JLT: case OP_JNLT:
+    case OP_JLE: case OP_JNLE: case OP_JLTN: case OP_JNLTN: {
+      int res = !l_isfalse(L->top - 1);
+      L->top--;
+      lua_assert(!ISK(GETARG_B(inst)));
+      if ((op == OP_JLE || op == OP_JNLE) &&  /* "<=" using "<" instead? */
+          ttisnil(luaT_gettmbyobj(L, base + GETARG_B(inst), TM_LE)))
+        res = !res;  /* invert result */
+      if (op == OP_JNE || op == OP_JNLT || op == OP_JNLE || op == OP_JNLTN)
+        res = !res;  /* jump when the comparison fails */
+      if (res)
+        ci->u.l.savedpc += GETARG_sA(inst);
+      break;
+    }
     case OP_CONCAT: {
       StkId top = L->top - 1;  /* top when 'call_binTM' was called */
       int b = GETARG_B(inst);      /* first element to concatenate */
@@ -681,6 +794,37 @@ static void PrintConstant(const Proto* f, int i)
         else { Protect(luaV_arith(L, ra, rb, rc, tm)); } }
 
 
+/*
+** Quickening: OP_ADD, OP_SUB, OP_MUL and the '<' comparisons rewrite
+** themselves into numbers-only forms when they find numbers, and these
+** go back to the generic opcode (and run it) when they do not. Both
+** forms compute the same results, so closures sharing a prototype may
+** see either of them at any time.
+*/
+#define quicken(ci,o)	SET_OPCODE(*cast(Instruction *, (ci)->u.l.savedpc - 1), o)
+
+#define arith_opq(op,tm,q) { \
+        TValue *rb = RKB(i); \
+        TValue *rc = RKC(i); \
+        if (ttisnumber(rb) && ttisnumber(rc)) { \
+          lua_Number nb = nvalue(rb), nc = nvalue(rc); \
+          setnvalue(ra, op(L, nb, nc)); \
+          quicken(ci, q); \
+        } \
+        else { Protect(luaV_arith(L, ra, rb, rc, tm)); } }
+
+#define arith_opn(op,tm,g) { \
+        TValue *rb = RKB(i); \
+        TValue *rc = RKC(i); \
+        if (ttisnumber(rb) && ttisnumber(rc)) { \
+          lua_Number nb = nvalue(rb), nc = nvalue(rc); \
+          setnvalue(ra, op(L, nb, nc)); \
+        } \
+        else { \
+          quicken(ci, g); \
+          Protect(luaV_arith(L, ra, rb, rc, tm)); } }
+
+
 #define vmdispatch(o)	switch(o)
 #define vmcase(l,b)	case l: {b}  break;
 #define vmcasenb(l,b)	case l: {b}		/* nb = no break */
@@ -709,7 +853,7 @@ void luaV_execute (lua_State *L) {
             size_t wheresize;
             luaO_chunkid(wheretemp, getstr(clvalue(ci->func)->l.p->source), LUA_IDSIZE);
             wheresize = strlen(wheretemp);
-            wheresize += sprintf(wheretemp + wheresize, ":%d: ", getfuncline(ci_func(ci)->p, pcRel(ci->u.l.savedpc, ci_func(ci)->p)));
+            wheresize += sprintf(wheretemp + wheresize, ":%d: ", luaG_getfuncline(ci_func(ci)->p, pcRel(ci->u.l.savedpc, ci_func(ci)->p)));
             setsvalue2s(L, L->top, luaS_newlstr(L, wheretemp, wheresize));
             L->top++;
             concat = 1;
@@ -727,9 +871,16 @@ void luaV_execute (lua_State *L) {
       }
       return;
     }
-    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
-        (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
-      Protect(traceexec(L));
+    if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT | LUAI_MASKINTERNAL)) {
+      if (L->hookmask & LUAI_MASKACCOUNT)
+        L->acct.instructions++;
+      if ((L->hookmask & LUAI_MASKBUDGET) && --G(L)->budget < 0 &&
+          luaD_preempt(L))
+        return;  /* out of budget: suspended before this instruction */
+      if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
+          (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
+        Protect(traceexec(L));
+      }
     }
     /* WARNING: several calls may realloc the stack and invalidate `ra' */
     ra = RA(i);
@@ -750,7 +901,7 @@ void luaV_execute (lua_State *L) {
         printf("\t%d\t[-]\tOVERFLOW (!)\n", pc - cl->p->code + 1);
         goto debugend;
       }
-      line=getfuncline(cl->p,pc - cl->p->code);
+      line=luaG_getfuncline(cl->p,pc - cl->p->code);
       printf("\t%d\t",pc-cl->p->code+1);
       if (line>0) printf("[%d]\t",line); else printf("[-]\t");
       printf("%-9s\t",luaP_opnames[o]);
@@ -890,19 +1041,25 @@ void luaV_execute (lua_State *L) {
           luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c));
         checkGC(L, ra + 1);
       )
+      vmcase(OP_TEMPLATE,
+        Table *t = luaH_new(L);
+        sethvalue(L, ra, t);
+        luaH_copy(L, t, cl->p->templates[GETARG_Bx(i)]);
+        checkGC(L, ra + 1);
+      )
       vmcase(OP_SELF,
         StkId rb = RB(i);
         setobjs2s(L, ra+1, rb);
         Protect(luaV_gettable(L, rb, RKC(i), ra));
       )
       vmcase(OP_ADD,
-        arith_op(luai_numadd, TM_ADD);
+        arith_opq(luai_numadd, TM_ADD, OP_ADDN);
       )
       vmcase(OP_SUB,
-        arith_op(luai_numsub, TM_SUB);
+        arith_opq(luai_numsub, TM_SUB, OP_SUBN);
       )
       vmcase(OP_MUL,
-        arith_op(luai_nummul, TM_MUL);
+        arith_opq(luai_nummul, TM_MUL, OP_MULN);
       )
       vmcase(OP_DIV,
         arith_op(luai_numdiv, TM_DIV);
@@ -961,6 +1118,8 @@ void luaV_execute (lua_State *L) {
         )
       )
       vmcase(OP_LT,
+        if (ttisnumber(RKB(i)) && ttisnumber(RKC(i)))
+          quicken(ci, OP_LTN);
         Protect(
           if (luaV_lessthan(L, RKB(i), RKC(i)) != GETARG_A(i))
             ci->u.l.savedpc++;
@@ -992,10 +1151,13 @@ void luaV_execute (lua_State *L) {
         }
       )
       vmcase(OP_CALL,
-        int b = GETARG_B(i);
-        int nresults = GETARG_C(i) - 1;
+        int b;
+        int nresults;
+        b = GETARG_B(i);
+        nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         if (luaD_precall(L, ra, nresults)) {  /* C function? */
+          if (L->status == LUA_YIELD) return;  /* it yielded */
           if (nresults >= 0) L->top = ci->top;  /* adjust results */
           base = ci->u.l.base;
         }
@@ -1009,8 +1171,10 @@ void luaV_execute (lua_State *L) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         lua_assert(GETARG_C(i) - 1 == LUA_MULTRET);
-        if (luaD_precall(L, ra, LUA_MULTRET))  /* C function? */
+        if (luaD_precall(L, ra, LUA_MULTRET)) {  /* C function? */
+          if (L->status == LUA_YIELD) return;  /* it yielded */
           base = ci->u.l.base;
+        }
         else {
           /* tail call: put called frame (n) in place of caller one (o) */
           CallInfo *nci = L->ci;  /* called frame */
@@ -1143,6 +1307,163 @@ void luaV_execute (lua_State *L) {
           }
         }
       )
+      vmcase(OP_JEQ,
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        resolverope(L, rb);
+        resolvesubstr(L, rb);
+        resolverope(L, rc);
+        resolvesubstr(L, rc);
+        Protect(
+          if (equalobj(L, rb, rc))
+            ci->u.l.savedpc += GETARG_sA(i);
+        )
+      )
+      vmcase(OP_JNE,
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        resolverope(L, rb);
+        resolvesubstr(L, rb);
+        resolverope(L, rc);
+        resolvesubstr(L, rc);
+        Protect(
+          if (!equalobj(L, rb, rc))
+            ci->u.l.savedpc += GETARG_sA(i);
+        )
+      )
+      vmcase(OP_JLT,
+        if (ttisnumber(RKB(i)) && ttisnumber(RKC(i)))
+          quicken(ci, OP_JLTN);
+        Protect(
+          if (luaV_lessthan(L, RKB(i), RKC(i)))
+            ci->u.l.savedpc += GETARG_sA(i);
+        )
+      )
+      vmcase(OP_JNLT,
+        if (ttisnumber(RKB(i)) && ttisnumber(RKC(i)))
+          quicken(ci, OP_JNLTN);
+        Protect(
+          if (!luaV_lessthan(L, RKB(i), RKC(i)))
+            ci->u.l.savedpc += GETARG_sA(i);
+        )
+      )
+      vmcase(OP_JLE,
+        Protect(
+          if (luaV_lessequal(L, RKB(i), RKC(i)))
+            ci->u.l.savedpc += GETARG_sA(i);
+        )
+      )
+      vmcase(OP_JNLE,
+        Protect(
+          if (!luaV_lessequal(L, RKB(i), RKC(i)))
+            ci->u.l.savedpc += GETARG_sA(i);
+        )
+      )
+      vmcase(OP_JTRUE,
+        if (!l_isfalse(ra))
+          ci->u.l.savedpc += GETARG_sBx(i);
+      )
+      vmcase(OP_JFALSE,
+        if (l_isfalse(ra))
+          ci->u.l.savedpc += GETARG_sBx(i);
+      )
+      vmcase(OP_ADDI,
+        TValue *rb = RB(i);
+        if (ttisnumber(rb)) {
+          lua_Number nb = nvalue(rb);
+          setnvalue(ra, luai_numadd(L, nb, cast_num(GETARG_sC(i))));
+        }
+        else {
+          TValue rc;
+          setnvalue(&rc, cast_num(GETARG_sC(i)));
+          Protect(luaV_arith(L, ra, rb, &rc, TM_ADD));
+        }
+      )
+      vmcase(OP_SUBI,
+        TValue *rb = RB(i);
+        if (ttisnumber(rb)) {
+          lua_Number nb = nvalue(rb);
+          setnvalue(ra, luai_numsub(L, nb, cast_num(GETARG_sC(i))));
+        }
+        else {
+          TValue rc;
+          setnvalue(&rc, cast_num(GETARG_sC(i)));
+          Protect(luaV_arith(L, ra, rb, &rc, TM_SUB));
+        }
+      )
+      vmcase(OP_ADDN,
+        arith_opn(luai_numadd, TM_ADD, OP_ADD);
+      )
+      vmcase(OP_SUBN,
+        arith_opn(luai_numsub, TM_SUB, OP_SUB);
+      )
+      vmcase(OP_MULN,
+        arith_opn(luai_nummul, TM_MUL, OP_MUL);
+      )
+      vmcase(OP_LTN,
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisnumber(rb) && ttisnumber(rc)) {
+          if (luai_numlt(L, nvalue(rb), nvalue(rc)) != GETARG_A(i))
+            ci->u.l.savedpc++;
+          else
+            donextjump(ci);
+        }
+        else {
+          quicken(ci, OP_LT);
+          Protect(
+            if (luaV_lessthan(L, rb, rc) != GETARG_A(i))
+              ci->u.l.savedpc++;
+            else
+              donextjump(ci);
+          )
+        }
+      )
+      vmcase(OP_JLTN,
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisnumber(rb) && ttisnumber(rc)) {
+          if (luai_numlt(L, nvalue(rb), nvalue(rc)))
+            ci->u.l.savedpc += GETARG_sA(i);
+        }
+        else {
+          quicken(ci, OP_JLT);
+          Protect(
+            if (luaV_lessthan(L, rb, rc))
+              ci->u.l.savedpc += GETARG_sA(i);
+          )
+        }
+      )
+      vmcase(OP_JNLTN,
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisnumber(rb) && ttisnumber(rc)) {
+          if (!luai_numlt(L, nvalue(rb), nvalue(rc)))
+            ci->u.l.savedpc += GETARG_sA(i);
+        }
+        else {
+          quicken(ci, OP_JNLT);
+          Protect(
+            if (!luaV_lessthan(L, rb, rc))
+              ci->u.l.savedpc += GETARG_sA(i);
+          )
+        }
+      )
+      vmcase(OP_SWITCH,
+        TValue *rb = RB(i);
+        Table *t;
+        const TValue *v;
+        TValue key;
+        resolverope(L, rb);
+        resolvesubstr(L, rb);
+        Protect(t = switchmap(L, cl->p, pcRel(ci->u.l.savedpc, cl->p)));
+        v = luaH_get(L, t, RB(i));
+        if (!ttisnumber(v)) {  /* no case for it? */
+          setbvalue(&key, 0);
+          v = luaH_get(L, t, &key);
+        }
+        ci->u.l.savedpc = cl->p->code + cast_int(nvalue(v));
+      )
       vmcase(OP_EXTRAARG,
         lua_assert(0);
       )
@@ -0,0 +1,895 @@
+// Worker pool library for Lua
+//
+// A pool runs tasks on N threads, each with a lua_State of its own;
+// channels pass values between any states of the process. Values are
+// copied: tables (with sharing and cycles preserved), strings,
+// numbers, booleans, Lua functions (as bytecode, with their upvalues
+// copied as well) and channels, which are shared.
+//
+// Every Lua error raised by code in this file is raised while no C++
+// object with a destructor lives in the frames being unwound (the core
+// unwinds with longjmp), so encoding and decoding run in protected
+// calls and the C functions only hold plain pointers.
+extern "C" {
+#define LUA_LIB
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+}
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define POOLMT "work.pool"
+#define FUTUREMT "work.future"
+#define CHANNELMT "work.channel"
+
+// maximum nesting of tables and functions in a copied value
+#if !defined(LUAI_MAXWORKDEPTH)
+#define LUAI_MAXWORKDEPTH 200
+#endif
+
+// tasks made by pool:map for each worker
+#define MAPCHUNKS 4
+
+struct Message;
+
+// A channel is shared by every state holding it: each userdata and
+// each message referring to it counts as a reference. A channel cannot
+// be sent into itself, but channels queued in each other (a cycle) keep
+// each other alive until one of them is drained.
+struct Channel {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<Message*> queue;
+    size_t capacity;  // 0 = unbounded
+    bool closed;
+    std::atomic<int> refs;
+};
+
+static void retainchannel(Channel *c) {
+    c->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void releasechannel(Channel *c);
+static void pushchannel(lua_State *L, Channel *c);
+
+// ======================================================
+// Messages
+// ======================================================
+
+enum {
+    W_NIL, W_FALSE, W_TRUE, W_NUMBER, W_STRING, W_TABLE, W_FUNCTION,
+    W_GLOBALS, W_REF, W_CHANNEL
+};
+
+// A copied sequence of values. Tables and functions are numbered in the
+// order they are written so that W_REF can point back to them.
+struct Message {
+    std::string data;
+    std::vector<Channel*> chans;  // channels referenced by 'data'
+    int n = 0;  // number of values
+    ~Message() { for (Channel *c : chans) releasechannel(c); }
+};
+
+static void releasechannel(Channel *c) {
+    if (c->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        for (Message *m : c->queue) delete m;
+        delete c;
+    }
+}
+
+struct Encoder {
+    Message *m;
+    int seen;  // stack index of table object -> reference number
+    int nseen;
+};
+
+static void put(Message *m, const void *p, size_t l) {
+    m->data.append((const char*)p, l);
+}
+
+static void puttag(Message *m, int tag) {
+    m->data.push_back((char)tag);
+}
+
+template <typename T> static void putraw(Message *m, T v) {
+    put(m, &v, sizeof(v));
+}
+
+static int writer(lua_State *L, const void *p, size_t sz, void *ud) {
+    (void)L;
+    put((Message*)ud, p, sz);
+    return 0;
+}
+
+static void encode(lua_State *L, Encoder *e, int idx, int depth);
+
+// writes a back reference if the object at 'idx' was written before,
+// otherwise numbers it and returns 0
+static int encoderef(lua_State *L, Encoder *e, int idx) {
+    lua_pushvalue(L, idx);
+    lua_rawget(L, e->seen);
+    if (!lua_isnil(L, -1)) {
+        puttag(e->m, W_REF);
+        putraw(e->m, (int)lua_tointeger(L, -1));
+        lua_pop(L, 1);
+        return 1;
+    }
+    lua_pop(L, 1);
+    lua_pushvalue(L, idx);
+    lua_pushinteger(L, ++e->nseen);
+    lua_rawset(L, e->seen);
+    return 0;
+}
+
+static void encodetable(lua_State *L, Encoder *e, int idx, int depth) {
+    size_t pos;
+    int n = 0;
+    if (encoderef(L, e, idx)) return;
+    puttag(e->m, W_TABLE);
+    putraw(e->m, (int)lua_rawlen(L, idx));
+    pos = e->m->data.size();
+    putraw(e->m, n);  // number of pairs, patched below
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        encode(L, e, lua_gettop(L) - 1, depth);
+        encode(L, e, lua_gettop(L), depth);
+        lua_pop(L, 1);
+        n++;
+    }
+    memcpy(&e->m->data[pos], &n, sizeof(n));
+}
+
+static void encodefunction(lua_State *L, Encoder *e, int idx, int depth) {
+    Message *m = e->m;
+    size_t pos, len;
+    int i;
+    if (lua_iscfunction(L, idx))
+        luaL_error(L, "cannot copy a C function");
+    if (encoderef(L, e, idx)) return;
+    puttag(m, W_FUNCTION);
+    pos = m->data.size();
+    putraw(m, (size_t)0);  // size of the bytecode, patched below
+    lua_pushvalue(L, idx);
+    if (lua_dump(L, writer, m) != 0)
+        luaL_error(L, "cannot copy a function (bytecode is disabled)");
+    lua_pop(L, 1);
+    len = m->data.size() - pos - sizeof(size_t);
+    memcpy(&m->data[pos], &len, sizeof(len));
+    for (i = 1; lua_getupvalue(L, idx, i) != NULL; i++) lua_pop(L, 1);
+    putraw(m, i - 1);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    for (i = 1; lua_getupvalue(L, idx, i) != NULL; i++) {
+        if (lua_rawequal(L, -1, -2))  // _ENV: globals of the receiving state
+            puttag(m, W_GLOBALS);
+        else
+            encode(L, e, lua_gettop(L), depth);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+static void encode(lua_State *L, Encoder *e, int idx, int depth) {
+    Message *m = e->m;
+    if (depth >= LUAI_MAXWORKDEPTH)
+        luaL_error(L, "value too deeply nested to copy");
+    luaL_checkstack(L, 4, "value too deeply nested to copy");
+    switch (lua_type(L, idx)) {
+        case LUA_TNIL: puttag(m, W_NIL); break;
+        case LUA_TBOOLEAN: puttag(m, lua_toboolean(L, idx) ? W_TRUE : W_FALSE); break;
+        case LUA_TNUMBER:
+            puttag(m, W_NUMBER);
+            putraw(m, lua_tonumber(L, idx));
+            break;
+        case LUA_TSTRING: {
+            size_t l;
+            const char *s = lua_tolstring(L, idx, &l);
+            puttag(m, W_STRING);
+            putraw(m, l);
+            put(m, s, l);
+            break;
+        }
+        case LUA_TTABLE: encodetable(L, e, idx, depth + 1); break;
+        case LUA_TFUNCTION: encodefunction(L, e, idx, depth + 1); break;
+        case LUA_TUSERDATA: {
+            Channel **c = (Channel**)luaL_testudata(L, idx, CHANNELMT);
+            if (c != NULL) {
+                puttag(m, W_CHANNEL);
+                putraw(m, (int)m->chans.size());
+                m->chans.push_back(*c);
+                retainchannel(*c);
+                break;
+            }
+        }  /* FALLTHROUGH */
+        default:
+            luaL_error(L, "cannot copy a %s value", luaL_typename(L, idx));
+    }
+}
+
+// protected: encodes values 2..top into the message at index 1
+static int f_encode(lua_State *L) {
+    Encoder e;
+    int i, top = lua_gettop(L);
+    e.m = (Message*)lua_touserdata(L, 1);
+    lua_newtable(L);
+    e.seen = lua_gettop(L);
+    e.nseen = 0;
+    for (i = 2; i <= top; i++) encode(L, &e, i, 0);
+    e.m->n = top - 1;
+    return 0;
+}
+
+// copies values 'first'..'last' of the stack into a new message;
+// raises the error (freeing the message) if any of them cannot be copied
+static Message *tomessage(lua_State *L, int first, int last) {
+    Message *m = new Message;
+    int i;
+    luaL_checkstack(L, last - first + 3, "too many values to copy");
+    lua_pushcfunction(L, f_encode);
+    lua_pushlightuserdata(L, m);
+    for (i = first; i <= last; i++) lua_pushvalue(L, i);
+    if (lua_pcall(L, last - first + 2, 0, 0) != LUA_OK) {
+        delete m;
+        lua_error(L);
+    }
+    return m;
+}
+
+struct Decoder {
+    const Message *m;
+    const char *p;
+    int refs;  // stack index of reference number -> object
+    int nrefs;
+};
+
+template <typename T> static T getraw(Decoder *d) {
+    T v;
+    memcpy(&v, d->p, sizeof(v));
+    d->p += sizeof(v);
+    return v;
+}
+
+static const char *reader(lua_State *L, void *ud, size_t *size) {
+    std::pair<const char*, size_t> *b = (std::pair<const char*, size_t>*)ud;
+    (void)L;
+    *size = b->second;
+    b->second = 0;
+    return b->first;
+}
+
+static void decode(lua_State *L, Decoder *d) {
+    luaL_checkstack(L, 4, "value too deeply nested to copy");
+    switch (*d->p++) {
+        case W_NIL: lua_pushnil(L); break;
+        case W_FALSE: lua_pushboolean(L, 0); break;
+        case W_TRUE: lua_pushboolean(L, 1); break;
+        case W_NUMBER: lua_pushnumber(L, getraw<lua_Number>(d)); break;
+        case W_STRING: {
+            size_t l = getraw<size_t>(d);
+            lua_pushlstring(L, d->p, l);
+            d->p += l;
+            break;
+        }
+        case W_TABLE: {
+            int narr = getraw<int>(d);
+            int n = getraw<int>(d);
+            lua_createtable(L, narr, n - narr > 0 ? n - narr : 0);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, d->refs, ++d->nrefs);
+            while (n-- > 0) {
+                decode(L, d);
+                decode(L, d);
+                lua_rawset(L, -3);
+            }
+            break;
+        }
+        case W_FUNCTION: {
+            std::pair<const char*, size_t> b;
+            int i, nup;
+            b.second = getraw<size_t>(d);
+            b.first = d->p;
+            d->p += b.second;
+            if (lua_load(L, reader, &b, "=work", "b") != LUA_OK)
+                lua_error(L);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, d->refs, ++d->nrefs);
+            nup = getraw<int>(d);
+            for (i = 1; i <= nup; i++) {
+                decode(L, d);
+                lua_setupvalue(L, -2, i);
+            }
+            break;
+        }
+        case W_GLOBALS: lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS); break;
+        case W_REF: lua_rawgeti(L, d->refs, getraw<int>(d)); break;
+        case W_CHANNEL: pushchannel(L, d->m->chans[getraw<int>(d)]); break;
+    }
+}
+
+// protected: pushes the values of the message at index 1
+static int f_decode(lua_State *L) {
+    Decoder d;
+    int i;
+    d.m = (const Message*)lua_touserdata(L, 1);
+    d.p = d.m->data.data();
+    luaL_checkstack(L, d.m->n + 1, "too many values to copy");
+    lua_newtable(L);
+    d.refs = lua_gettop(L);
+    d.nrefs = 0;
+    for (i = 0; i < d.m->n; i++) decode(L, &d);
+    return d.m->n;
+}
+
+// pushes the values of 'm'; returns their number, or -1 with an error
+// message on the stack
+static int pushmessage(lua_State *L, const Message *m) {
+    int top = lua_gettop(L);
+    lua_pushcfunction(L, f_decode);
+    lua_pushlightuserdata(L, (void*)m);
+    if (lua_pcall(L, 1, LUA_MULTRET, 0) != LUA_OK) return -1;
+    return lua_gettop(L) - top;
+}
+
+// a message holding one string (never raises errors)
+static Message *errormessage(lua_State *L, int idx) {
+    Message *m = new Message;
+    size_t l;
+    const char *s = lua_tolstring(L, idx, &l);
+    if (s == NULL) {
+        s = "(error object is not a string)";
+        l = strlen(s);
+    }
+    puttag(m, W_STRING);
+    putraw(m, l);
+    put(m, s, l);
+    m->n = 1;
+    return m;
+}
+
+// ======================================================
+// Channels
+// ======================================================
+
+static Channel *checkchannel(lua_State *L) {
+    Channel *c = *(Channel**)luaL_checkudata(L, 1, CHANNELMT);
+    luaL_argcheck(L, c != NULL, 1, "invalid channel");
+    return c;
+}
+
+static int work_channel(lua_State *L) {
+    int cap = luaL_optint(L, 1, 0);
+    Channel *c;
+    luaL_argcheck(L, cap >= 0, 1, "capacity must be non-negative");
+    c = new Channel;
+    c->capacity = (size_t)cap;
+    c->closed = false;
+    c->refs.store(0);
+    pushchannel(L, c);
+    return 1;
+}
+
+// Sends one value; blocks while a bounded channel is full. Returns true,
+// or false if the channel was closed.
+static int channel_send(lua_State *L) {
+    Channel *c = checkchannel(L);
+    Message *m;
+    bool sent;
+    luaL_checkany(L, 2);
+    m = tomessage(L, 2, 2);
+    for (Channel *r : m->chans) {
+        if (r == c) {  // it would keep itself alive
+            delete m;
+            luaL_error(L, "cannot send a channel into itself");
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lk(c->m);
+        while (!c->closed && c->capacity > 0 && c->queue.size() >= c->capacity)
+            c->cv.wait(lk);
+        sent = !c->closed;
+        if (sent) c->queue.push_back(m);
+    }
+    if (sent) c->cv.notify_all();
+    else delete m;
+    lua_pushboolean(L, sent);
+    return 1;
+}
+
+// Receives one value, waiting at most 'timeout' seconds if given.
+// Returns the value, or nil and "closed" or "timeout".
+static int channel_receive(lua_State *L) {
+    Channel *c = checkchannel(L);
+    lua_Number timeout = luaL_optnumber(L, 2, -1);
+    Message *m = NULL;
+    const char *why = NULL;
+    int n;
+    {
+        std::unique_lock<std::mutex> lk(c->m);
+        auto ready = [c] { return !c->queue.empty() || c->closed; };
+        if (timeout < 0) c->cv.wait(lk, ready);
+        else c->cv.wait_for(lk, std::chrono::duration<double>(timeout), ready);
+        if (!c->queue.empty()) {
+            m = c->queue.front();
+            c->queue.pop_front();
+        }
+        else why = c->closed ? "closed" : "timeout";
+    }
+    if (m == NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, why);
+        return 2;
+    }
+    c->cv.notify_all();  // wake senders waiting for room
+    n = pushmessage(L, m);
+    delete m;
+    if (n < 0) lua_error(L);
+    return n;
+}
+
+// Closes the channel: sends fail and receives return what is left, then
+// nil, "closed".
+static int channel_close(lua_State *L) {
+    Channel *c = checkchannel(L);
+    {
+        std::lock_guard<std::mutex> lk(c->m);
+        c->closed = true;
+    }
+    c->cv.notify_all();
+    return 0;
+}
+
+static int channel_len(lua_State *L) {
+    Channel *c = checkchannel(L);
+    size_t n;
+    {
+        std::lock_guard<std::mutex> lk(c->m);
+        n = c->queue.size();
+    }
+    lua_pushinteger(L, (lua_Integer)n);
+    return 1;
+}
+
+static int channel_gc(lua_State *L) {
+    Channel **p = (Channel**)luaL_checkudata(L, 1, CHANNELMT);
+    if (*p != NULL) {
+        releasechannel(*p);
+        *p = NULL;
+    }
+    return 0;
+}
+
+static const luaL_Reg channel_m[] = {
+    {"send", channel_send},
+    {"receive", channel_receive},
+    {"close", channel_close},
+    {"__len", channel_len},
+    {"__gc", channel_gc},
+    {NULL, NULL}
+};
+
+static void pushchannel(lua_State *L, Channel *c) {
+    Channel **p = (Channel**)lua_newuserdata(L, sizeof(Channel*));
+    *p = NULL;
+    if (luaL_newmetatable(L, CHANNELMT)) {  // first channel in this state?
+        luaL_setfuncs(L, channel_m, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+    retainchannel(c);
+    *p = c;
+}
+
+// ======================================================
+// Futures and tasks
+// ======================================================
+
+struct Future {
+    std::mutex m;
+    std::condition_variable cv;
+    bool done = false;
+    bool ok = false;
+    Message *result = NULL;  // results, or the error message
+    std::atomic<int> refs{1};
+};
+
+static void releasefuture(Future *f) {
+    if (f->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete f->result;
+        delete f;
+    }
+}
+
+static void completefuture(Future *f, bool ok, Message *result) {
+    {
+        std::lock_guard<std::mutex> lk(f->m);
+        f->done = true;
+        f->ok = ok;
+        f->result = result;
+    }
+    f->cv.notify_all();
+}
+
+enum { TASK_CALL, TASK_MAP };
+
+struct Task {
+    int kind;
+    Message *args;  // TASK_CALL: f, ...; TASK_MAP: f, list, n
+    Future *future;
+    Message *result;
+};
+
+// protected: runs the task at index 1 in a worker state
+static int f_runtask(lua_State *L) {
+    Task *t = (Task*)lua_touserdata(L, 1);
+    int base = lua_gettop(L), n, i;
+    lua_pushcfunction(L, f_decode);
+    lua_pushlightuserdata(L, t->args);
+    lua_call(L, 1, LUA_MULTRET);
+    if (t->kind == TASK_CALL) {
+        lua_call(L, lua_gettop(L) - base - 1, LUA_MULTRET);
+    }
+    else {  // apply f to list[1..n], giving {results, n}
+        n = (int)lua_tointeger(L, base + 3);
+        lua_createtable(L, n, 0);
+        for (i = 1; i <= n; i++) {
+            lua_pushvalue(L, base + 1);
+            lua_rawgeti(L, base + 2, i);
+            lua_call(L, 1, 1);
+            lua_rawseti(L, -2, i);
+        }
+        lua_replace(L, base + 1);
+        lua_settop(L, base + 1);
+        lua_pushinteger(L, n);
+    }
+    lua_pushcfunction(L, f_encode);
+    lua_insert(L, base + 1);
+    lua_pushlightuserdata(L, t->result);
+    lua_insert(L, base + 2);
+    lua_call(L, lua_gettop(L) - base - 1, 0);
+    return 0;
+}
+
+static void runtask(lua_State *L, Task *t) {
+    bool ok;
+    t->result = new Message;
+    lua_pushcfunction(L, f_runtask);
+    lua_pushlightuserdata(L, t);
+    ok = (lua_pcall(L, 1, 0, 0) == LUA_OK);
+    if (!ok) {
+        delete t->result;
+        t->result = errormessage(L, -1);
+    }
+    lua_settop(L, 0);
+    completefuture(t->future, ok, t->result);
+    releasefuture(t->future);
+    delete t->args;
+    delete t;
+}
+
+// ======================================================
+// Pools
+// ======================================================
+
+// Each worker owns a deque of tasks: it takes work from the front of its
+// own deque and, when that is empty, steals from the back of the others.
+struct Worker {
+    std::thread thread;
+    lua_State *L;
+    std::mutex m;
+    std::deque<Task*> tasks;
+};
+
+struct Pool {
+    std::vector<Worker*> workers;
+    std::mutex m;  // protects 'stop' and the sleep of idle workers
+    std::condition_variable cv;
+    std::atomic<int> pending{0};  // tasks queued in all deques
+    bool stop = false;
+    unsigned next = 0;  // worker receiving the next task
+};
+
+static Task *poptask(Worker *w, bool front) {
+    std::lock_guard<std::mutex> lk(w->m);
+    Task *t;
+    if (w->tasks.empty()) return NULL;
+    if (front) {
+        t = w->tasks.front();
+        w->tasks.pop_front();
+    }
+    else {
+        t = w->tasks.back();
+        w->tasks.pop_back();
+    }
+    return t;
+}
+
+// next task for worker 'i'; NULL when the pool is stopping and no
+// task is left
+static Task *nexttask(Pool *p, size_t i) {
+    size_t n = p->workers.size(), k;
+    for (;;) {
+        Task *t = poptask(p->workers[i], true);
+        for (k = 1; t == NULL && k < n; k++)
+            t = poptask(p->workers[(i + k) % n], false);
+        if (t != NULL) {
+            p->pending.fetch_sub(1, std::memory_order_relaxed);
+            return t;
+        }
+        std::unique_lock<std::mutex> lk(p->m);
+        p->cv.wait(lk, [p] { return p->stop || p->pending.load() > 0; });
+        if (p->stop) return NULL;
+    }
+}
+
+static void workerloop(Pool *p, size_t i) {
+    Task *t;
+    while ((t = nexttask(p, i)) != NULL)
+        runtask(p->workers[i]->L, t);
+}
+
+static void pushtask(Pool *p, Task *t) {
+    Worker *w = p->workers[p->next++ % p->workers.size()];
+    {
+        std::lock_guard<std::mutex> lk(w->m);
+        w->tasks.push_back(t);
+    }
+    p->pending.fetch_add(1, std::memory_order_relaxed);
+    { std::lock_guard<std::mutex> lk(p->m); }  // no lost wake-ups
+    p->cv.notify_one();
+}
+
+// stops the pool once every queued task has run
+static void stoppool(Pool *p) {
+    {
+        std::lock_guard<std::mutex> lk(p->m);
+        p->stop = true;
+    }
+    p->cv.notify_all();
+    for (Worker *w : p->workers) w->thread.join();
+    for (Worker *w : p->workers) {
+        lua_close(w->L);
+        delete w;
+    }
+    delete p;
+}
+
+static Pool *checkpool(lua_State *L) {
+    Pool *p = *(Pool**)luaL_checkudata(L, 1, POOLMT);
+    luaL_argcheck(L, p != NULL, 1, "pool is closed");
+    return p;
+}
+
+static Pool *newpool(lua_State *L, int n) {
+    Pool **pp = (Pool**)lua_newuserdata(L, sizeof(Pool*));
+    Pool *p;
+    int i;
+    *pp = NULL;
+    luaL_setmetatable(L, POOLMT);
+    p = new Pool;
+    for (i = 0; i < n; i++) {
+        Worker *w = new Worker;
+        w->L = luaL_newstate();
+        if (w->L == NULL) {
+            delete w;
+            break;
+        }
+        luaL_openlibs(w->L);
+        p->workers.push_back(w);
+    }
+    if ((int)p->workers.size() < n) {
+        for (Worker *w : p->workers) {
+            lua_close(w->L);
+            delete w;
+        }
+        delete p;
+        luaL_error(L, "cannot create worker states");
+    }
+    for (i = 0; i < n; i++)
+        p->workers[i]->thread = std::thread(workerloop, p, (size_t)i);
+    *pp = p;
+    return p;
+}
+
+static int defaultworkers(void) {
+    int n = (int)std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// work.pool([n]): a pool of n workers (default: one per hardware thread)
+static int work_pool(lua_State *L) {
+    int n = luaL_optint(L, 1, defaultworkers());
+    luaL_argcheck(L, n > 0, 1, "at least one worker needed");
+    newpool(L, n);
+    return 1;
+}
+
+// queues the values first..last (function and arguments) as a task and
+// pushes its future
+static void submit(lua_State *L, Pool *p, int kind, int first, int last) {
+    Future **pf = (Future**)lua_newuserdata(L, sizeof(Future*));
+    Message *args;
+    Task *t;
+    *pf = NULL;
+    luaL_setmetatable(L, FUTUREMT);
+    args = tomessage(L, first, last);  // last thing that can raise an error
+    *pf = new Future;
+    t = new Task;
+    t->kind = kind;
+    t->args = args;
+    t->future = *pf;
+    t->result = NULL;
+    (*pf)->refs.fetch_add(1, std::memory_order_relaxed);  // one for the task
+    pushtask(p, t);
+}
+
+// pool:submit(f, ...): runs f(...) on a worker; returns a future
+static int pool_submit(lua_State *L) {
+    Pool *p = checkpool(L);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    submit(L, p, TASK_CALL, 2, lua_gettop(L));
+    return 1;
+}
+
+static Future *checkfuture(lua_State *L, int idx) {
+    return *(Future**)luaL_checkudata(L, idx, FUTUREMT);
+}
+
+// waits for the future at 'idx' and pushes its results, or raises its
+// error
+static int waitfuture(lua_State *L, int idx) {
+    Future *f = checkfuture(L, idx);
+    int n;
+    {
+        std::unique_lock<std::mutex> lk(f->m);
+        f->cv.wait(lk, [f] { return f->done; });
+    }
+    n = pushmessage(L, f->result);
+    if (n < 0 || !f->ok) lua_error(L);
+    return n;
+}
+
+// pool:map(f, list): the sequence f(list[1]), ..., f(list[#list]),
+// computed by all the workers
+static int pool_map(lua_State *L) {
+    Pool *p = checkpool(L);
+    int n, nchunks, size, i, k, first;
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 3);
+    n = luaL_len(L, 3);
+    nchunks = (int)p->workers.size() * MAPCHUNKS;
+    if (nchunks > n) nchunks = n;
+    lua_createtable(L, nchunks, 0);  // futures (4)
+    for (k = 0, first = 1; k < nchunks; k++, first += size) {
+        size = n / nchunks + (k < n % nchunks);
+        lua_pushvalue(L, 2);
+        lua_createtable(L, size, 0);
+        for (i = 1; i <= size; i++) {
+            lua_rawgeti(L, 3, first + i - 1);
+            lua_rawseti(L, -2, i);
+        }
+        lua_pushinteger(L, size);
+        submit(L, p, TASK_MAP, 5, 7);
+        lua_rawseti(L, 4, k + 1);
+        lua_settop(L, 4);
+    }
+    lua_createtable(L, n, 0);  // results (5)
+    for (k = 0, first = 1; k < nchunks; k++, first += size) {
+        lua_rawgeti(L, 4, k + 1);
+        waitfuture(L, -1);  // pushes chunk results and their number
+        size = (int)lua_tointeger(L, -1);
+        for (i = 1; i <= size; i++) {
+            lua_rawgeti(L, -2, i);
+            lua_rawseti(L, 5, first + i - 1);
+        }
+        lua_settop(L, 5);
+    }
+    return 1;
+}
+
+static int pool_close(lua_State *L) {
+    Pool **pp = (Pool**)luaL_checkudata(L, 1, POOLMT);
+    if (*pp != NULL) {
+        Pool *p = *pp;
+        *pp = NULL;
+        stoppool(p);
+    }
+    return 0;
+}
+
+static int pool_len(lua_State *L) {
+    lua_pushinteger(L, (lua_Integer)checkpool(L)->workers.size());
+    return 1;
+}
+
+static const luaL_Reg pool_m[] = {
+    {"submit", pool_submit},
+    {"map", pool_map},
+    {"close", pool_close},
+    {"__len", pool_len},
+    {"__gc", pool_close},
+    {NULL, NULL}
+};
+
+// future:wait(): the results of the task, or raises its error
+static int future_wait(lua_State *L) {
+    lua_settop(L, 1);
+    return waitfuture(L, 1);
+}
+
+static int future_ready(lua_State *L) {
+    Future *f = checkfuture(L, 1);
+    bool done;
+    {
+        std::lock_guard<std::mutex> lk(f->m);
+        done = f->done;
+    }
+    lua_pushboolean(L, done);
+    return 1;
+}
+
+static int future_gc(lua_State *L) {
+    Future **pf = (Future**)luaL_checkudata(L, 1, FUTUREMT);
+    if (*pf != NULL) {
+        releasefuture(*pf);
+        *pf = NULL;
+    }
+    return 0;
+}
+
+static const luaL_Reg future_m[] = {
+    {"wait", future_wait},
+    {"ready", future_ready},
+    {"__gc", future_gc},
+    {NULL, NULL}
+};
+
+// work.parallel_map(f, list): pool:map on a pool shared by the state
+static int work_parallel_map(lua_State *L) {
+    lua_getfield(L, LUA_REGISTRYINDEX, POOLMT ".default");
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        newpool(L, defaultworkers());
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, POOLMT ".default");
+    }
+    lua_insert(L, 1);
+    return pool_map(L);
+}
+
+static int work_workers(lua_State *L) {
+    lua_pushinteger(L, defaultworkers());
+    return 1;
+}
+
+static const luaL_Reg work_funcs[] = {
+    {"pool", work_pool},
+    {"channel", work_channel},
+    {"parallel_map", work_parallel_map},
+    {"workers", work_workers},
+    {NULL, NULL}
+};
+
+static void newclass(lua_State *L, const char *name, const luaL_Reg *m) {
+    luaL_newmetatable(L, name);
+    luaL_setfuncs(L, m, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
+
+LUAMOD_API int luaopen_work(lua_State *L) {
+    newclass(L, POOLMT, pool_m);
+    newclass(L, FUTUREMT, future_m);
+    newclass(L, CHANNELMT, channel_m);
+    luaL_newlib(L, work_funcs);
+    return 1;
+}
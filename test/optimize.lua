@@ -0,0 +1,61 @@
+-- check that the bytecode optimizer (load mode "O") keeps the meaning of
+-- programs: each case runs as written and optimized, in a fresh
+-- environment, and both runs must give the same results
+
+local cases = {
+
+-- a call reached with another function in the register is not inlined
+[[
+local function clamp(x) return x+1 end
+local function other(x) return x*100 end
+local c = true
+return (c and other or clamp)(5)
+]],
+
+-- a global changed by another chunk while a loop reads it
+[[
+local set = load("done = true", "=set", "t", _ENV)
+local n = 0
+while not done do
+  n = n + 1
+  if n == 3 then set() end
+  if n > 10 then break end
+end
+return n
+]],
+
+-- a global changed through the environment table
+[[
+local n = 0
+while not done do
+  n = n + 1
+  if n == 3 then rawset(_ENV, "done", true) end
+  if n > 10 then break end
+end
+return n
+]],
+
+-- a loop that never runs reads no globals
+[[
+local tostring = tostring
+setmetatable(_ENV, {__index = function (_, k) error("no global " .. k) end})
+local s = ""
+for i = 1, 0 do s = s .. tostring(missing) end
+return s
+]],
+
+}
+
+local function run(src, mode)
+  local env = setmetatable({}, {__index = _G})
+  local f = assert(load(src, "=optimize", mode, env))
+  return table.concat({tostring(select(2, pcall(f)))}, " ")
+end
+
+for i, src in ipairs(cases) do
+  local plain, optimized = run(src, "t"), run(src, "tO")
+  if plain ~= optimized then
+    error("case " .. i .. ": " .. plain .. " but optimized " .. optimized)
+  end
+end
+print(#cases .. " cases ok")